@@ -0,0 +1,253 @@
+#include "hash_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP_SIZE (16)
+
+// A full slot's control byte is the low seven bits of its key's hash, so
+// only empty and deleted slots have the high bit set.
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+static uint64_t hash_key(const char *key, size_t length);
+static uint32_t match_byte(const int8_t *group, int8_t byte);
+static uint32_t match_empty_or_deleted(const int8_t *group);
+static int lowest_bit(uint32_t mask);
+static size_t find_slot(MMDBW_hash_table_s *table, const char *key);
+static size_t find_free_slot(MMDBW_hash_table_s *table, uint64_t hash);
+static void resize(MMDBW_hash_table_s *table, size_t capacity);
+static void *checked_malloc(size_t size);
+
+void hash_table_init(MMDBW_hash_table_s *table, size_t key_length) {
+    table->control = NULL;
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->growth_left = 0;
+    table->key_length = key_length;
+}
+
+void *hash_table_find(MMDBW_hash_table_s *table, const char *key) {
+    size_t slot = find_slot(table, key);
+    return slot == table->capacity ? NULL : table->slots[slot].entry;
+}
+
+void hash_table_insert(MMDBW_hash_table_s *table,
+                       const char *key,
+                       void *entry) {
+    if (0 == table->growth_left) {
+        // If most of the used slots are deleted, rehashing at the same size
+        // frees enough of them.
+        size_t capacity = table->capacity;
+        if (0 == capacity) {
+            capacity = GROUP_SIZE;
+        } else if (table->count >= capacity * 7 / 16) {
+            capacity *= 2;
+        }
+        resize(table, capacity);
+    }
+
+    uint64_t hash = hash_key(key, table->key_length);
+    size_t slot = find_free_slot(table, hash);
+    if (CONTROL_EMPTY == table->control[slot]) {
+        table->growth_left--;
+    }
+
+    table->control[slot] = (int8_t)(hash & 0x7f);
+    table->slots[slot].key = key;
+    table->slots[slot].entry = entry;
+    table->count++;
+}
+
+void *hash_table_remove(MMDBW_hash_table_s *table, const char *key) {
+    size_t slot = find_slot(table, key);
+    if (slot == table->capacity) {
+        return NULL;
+    }
+
+    // The slot cannot simply be emptied, as that would end the probe for
+    // keys that were placed after it.
+    table->control[slot] = CONTROL_DELETED;
+    table->count--;
+
+    return table->slots[slot].entry;
+}
+
+void *hash_table_next(MMDBW_hash_table_s *table, size_t *position) {
+    while (*position < table->capacity) {
+        size_t slot = (*position)++;
+        if (table->control[slot] >= 0) {
+            return table->slots[slot].entry;
+        }
+    }
+
+    return NULL;
+}
+
+void hash_table_free(MMDBW_hash_table_s *table) {
+    free(table->control);
+    free(table->slots);
+    hash_table_init(table, table->key_length);
+}
+
+// Returns the slot holding the key, or the table's capacity if there is none.
+static size_t find_slot(MMDBW_hash_table_s *table, const char *key) {
+    if (0 == table->capacity) {
+        return 0;
+    }
+
+    uint64_t hash = hash_key(key, table->key_length);
+    int8_t h2 = (int8_t)(hash & 0x7f);
+    size_t group_mask = table->capacity / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & group_mask;
+
+    for (size_t step = 1;; step++) {
+        const int8_t *control = &(table->control[group * GROUP_SIZE]);
+
+        for (uint32_t matches = match_byte(control, h2); matches;
+             matches &= matches - 1) {
+            size_t slot = group * GROUP_SIZE + lowest_bit(matches);
+            if (0 == memcmp(table->slots[slot].key, key, table->key_length)) {
+                return slot;
+            }
+        }
+
+        if (match_byte(control, CONTROL_EMPTY)) {
+            return table->capacity;
+        }
+
+        // Triangular probing visits every group when the number of groups
+        // is a power of two.
+        group = (group + step) & group_mask;
+    }
+}
+
+static size_t find_free_slot(MMDBW_hash_table_s *table, uint64_t hash) {
+    size_t group_mask = table->capacity / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & group_mask;
+
+    for (size_t step = 1;; step++) {
+        uint32_t free_slots =
+            match_empty_or_deleted(&(table->control[group * GROUP_SIZE]));
+        if (free_slots) {
+            return group * GROUP_SIZE + lowest_bit(free_slots);
+        }
+
+        group = (group + step) & group_mask;
+    }
+}
+
+static void resize(MMDBW_hash_table_s *table, size_t capacity) {
+    int8_t *old_control = table->control;
+    MMDBW_hash_slot_s *old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    table->control = checked_malloc(capacity);
+    memset(table->control, CONTROL_EMPTY, capacity);
+    table->slots = checked_malloc(capacity * sizeof(MMDBW_hash_slot_s));
+    table->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_control[i] < 0) {
+            continue;
+        }
+
+        uint64_t hash = hash_key(old_slots[i].key, table->key_length);
+        size_t slot = find_free_slot(table, hash);
+        table->control[slot] = old_control[i];
+        table->slots[slot] = old_slots[i];
+    }
+
+    // Keeping the table at most 7/8 full keeps probes short and guarantees
+    // every probe reaches an empty slot.
+    table->growth_left = capacity * 7 / 8 - table->count;
+
+    free(old_control);
+    free(old_slots);
+}
+
+// The keys are mostly base64 SHA1 digests, so they are well distributed
+// already, but the merge cache keys share a prefix. This mixes in every
+// byte.
+static uint64_t hash_key(const char *key, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, key + i, 8);
+        hash = (hash ^ chunk) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    if (i < length) {
+        uint64_t chunk = 0;
+        memcpy(&chunk, key + i, length - i);
+        hash = (hash ^ chunk) * 0xff51afd7ed558ccdULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+#ifdef __SSE2__
+static uint32_t match_byte(const int8_t *group, int8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+}
+
+static uint32_t match_empty_or_deleted(const int8_t *group) {
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)group));
+}
+#else
+static uint32_t match_byte(const int8_t *group, int8_t byte) {
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == byte) {
+            mask |= 1U << i;
+        }
+    }
+    return mask;
+}
+
+static uint32_t match_empty_or_deleted(const int8_t *group) {
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] < 0) {
+            mask |= 1U << i;
+        }
+    }
+    return mask;
+}
+#endif
+
+static int lowest_bit(uint32_t mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static void *checked_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        abort();
+    }
+
+    return ptr;
+}
@@ -0,0 +1,48 @@
+#ifndef MMDBW_HASH_TABLE_H
+#define MMDBW_HASH_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* An open addressing hash table keyed by fixed length strings, in the style
+ * of Swiss tables. Each slot has a control byte holding seven bits of its
+ * key's hash, and a lookup checks a group of 16 control bytes at once (with
+ * SSE2 where it is available), so keys are only compared when those bits
+ * match. The slots are one contiguous array.
+ *
+ * The table holds pointers to entries rather than the entries themselves, as
+ * the tree keeps pointers to the keys stored in its entries. Each slot also
+ * holds a pointer to its entry's key, so the table does not need to know the
+ * layout of the entries. */
+
+typedef struct MMDBW_hash_slot_s {
+    const char *key;
+    void *entry;
+} MMDBW_hash_slot_s;
+
+typedef struct MMDBW_hash_table_s {
+    int8_t *control;
+    MMDBW_hash_slot_s *slots;
+    size_t capacity;
+    size_t count;
+    /* The number of empty slots that can be filled before the table is
+     * resized. Deleted slots are only reclaimed when it is. */
+    size_t growth_left;
+    size_t key_length;
+} MMDBW_hash_table_s;
+
+extern void hash_table_init(MMDBW_hash_table_s *table, size_t key_length);
+extern void *hash_table_find(MMDBW_hash_table_s *table, const char *key);
+/* The key must not already be in the table, and must stay valid for as long
+ * as the entry is in the table. */
+extern void
+hash_table_insert(MMDBW_hash_table_s *table, const char *key, void *entry);
+extern void *hash_table_remove(MMDBW_hash_table_s *table, const char *key);
+/* Returns the entry at or after *position and moves *position past it, or
+ * returns NULL at the end of the table. The entry returned may be removed
+ * while iterating, but nothing may be inserted. */
+extern void *hash_table_next(MMDBW_hash_table_s *table, size_t *position);
+extern void hash_table_free(MMDBW_hash_table_s *table);
+
+#endif
@@ -0,0 +1,1371 @@
+#include "tree.h"
+#include "reader.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Deeper values are almost certainly not data anyone means to write to a
+// database, and parsing them recursively could run out of stack.
+#define MAX_JSON_DEPTH (512)
+
+// Maps and arrays in a database can only nest this deep if a pointer loops
+// back to a value containing it.
+#define MAX_MMDB_DEPTH (512)
+
+// Room for the longest IPv6 address (with an embedded IPv4 address), which
+// is all that comes before the prefix length in a network.
+#define MAX_ADDRESS_LENGTH (45)
+
+typedef struct json_parser_s {
+    const char *filename;
+    size_t line_number;
+    const char *position;
+    const char *end;
+    int depth;
+} json_parser_s;
+
+typedef struct csv_field_s {
+    const char *start;
+    size_t length;
+} csv_field_s;
+
+typedef struct input_file_s {
+    FILE *file;
+    char *line;
+    size_t line_size;
+    // For CSV files, the record being parsed, which may span several lines,
+    // and the fields parsed from it.
+    char *record;
+    csv_field_s *fields;
+} input_file_s;
+
+typedef struct csv_reader_s {
+    const char *filename;
+    input_file_s *input;
+    size_t record_size;
+    size_t record_length;
+    // The line the current record starts on, and the last line read.
+    size_t line_number;
+    size_t last_line_number;
+    size_t field_count;
+    size_t fields_size;
+    // The columns used from each record, or SIZE_MAX when a column is not
+    // used.
+    size_t network_index;
+    size_t first_ip_index;
+    size_t last_ip_index;
+    size_t id_index;
+} csv_reader_s;
+
+typedef struct mmdb_loader_s {
+    MMDBW_mmdb_s mmdb;
+    mmdb_section_s data_section;
+    int bit_count;
+    // In an IPv6 database, the root of the IPv4 subtree at ::/96 and its
+    // parent. Aliased networks point at the same node, and are skipped.
+    int64_t ipv4_root;
+    int64_t ipv4_root_parent;
+    // Maps the offset of each data record already seen to an array of its
+    // key and data, so each distinct value is decoded once.
+    HV *data_by_offset;
+} mmdb_loader_s;
+
+static void close_input_on_leave(pTHX_ void *input);
+static bool read_line(input_file_s *input, size_t *length);
+static void insert_record_from_jsonl(MMDBW_tree_s *tree,
+                                     json_parser_s *parser,
+                                     const char *const network_field,
+                                     MMDBW_merge_strategy merge_strategy);
+static void insert_json_network(MMDBW_tree_s *tree,
+                                json_parser_s *parser,
+                                SV *network_sv,
+                                SV *data,
+                                MMDBW_merge_strategy merge_strategy);
+static void insert_csv_record(MMDBW_tree_s *tree,
+                              csv_reader_s *reader,
+                              HV *data_by_id,
+                              MMDBW_merge_strategy merge_strategy);
+static bool read_csv_record(csv_reader_s *reader);
+static void parse_csv_fields(csv_reader_s *reader);
+static size_t csv_column_index(csv_reader_s *reader,
+                               const char *const column);
+static csv_field_s *csv_field(csv_reader_s *reader, size_t index);
+static void insert_network_string(MMDBW_tree_s *tree,
+                                  const char *const filename,
+                                  const size_t line_number,
+                                  const char *const network,
+                                  const size_t length,
+                                  SV *key,
+                                  SV *data,
+                                  MMDBW_merge_strategy merge_strategy);
+static bool copy_address(char *address,
+                         const char *const string,
+                         const size_t length);
+static void find_ipv4_root(MMDBW_mmdb_s *mmdb,
+                           int64_t *ipv4_root,
+                           int64_t *ipv4_root_parent);
+static void insert_mmdb_node(MMDBW_tree_s *tree,
+                             mmdb_loader_s *loader,
+                             uint32_t node,
+                             uint128_t network,
+                             int depth);
+static void insert_mmdb_record(MMDBW_tree_s *tree,
+                               mmdb_loader_s *loader,
+                               uint32_t node,
+                               const int right,
+                               uint128_t network,
+                               int depth);
+static AV *mmdb_data_for_offset(mmdb_loader_s *loader, uint32_t offset);
+static uint64_t decode_mmdb_value(mmdb_section_s *section,
+                                  uint64_t offset,
+                                  int depth,
+                                  SV *value);
+static void decode_mmdb_map(mmdb_section_s *section,
+                            MMDBW_mmdb_entry_s *entry,
+                            int depth,
+                            SV *value);
+static void decode_mmdb_array(mmdb_section_s *section,
+                              MMDBW_mmdb_entry_s *entry,
+                              int depth,
+                              SV *value);
+static void decode_mmdb_scalar(mmdb_section_s *section,
+                               uint64_t offset,
+                               MMDBW_mmdb_entry_s *entry,
+                               SV *value);
+static void set_sv_to_uint128(SV *value, uint128_t number);
+static void *checked_realloc(void *ptr, size_t size);
+static void parse_json_value(json_parser_s *parser, SV *value);
+static void parse_json_object(json_parser_s *parser, SV *value);
+static void parse_json_array(json_parser_s *parser, SV *value);
+static void parse_json_string(json_parser_s *parser, SV *string);
+static void parse_json_escape(json_parser_s *parser, SV *string);
+static uint32_t parse_json_hex4(json_parser_s *parser);
+static void parse_json_number(json_parser_s *parser, SV *number);
+static bool skip_json_digits(json_parser_s *parser);
+static void expect_json_literal(json_parser_s *parser,
+                                const char *const literal);
+static void expect_json_character(json_parser_s *parser, char c);
+static void skip_json_whitespace(json_parser_s *parser);
+static void json_error(json_parser_s *parser, const char *const message)
+    __attribute__((noreturn));
+
+// Each line of the file is a JSON value that is parsed straight into the
+// Perl data structure the tree stores, so nothing is decoded or copied in
+// Perl. With a network_field, each line is an object and the network is the
+// value of that field, which is removed from the data. Without one, each line
+// is an array holding the network and the data.
+void insert_from_jsonl(MMDBW_tree_s *tree,
+                       const char *const filename,
+                       const char *const network_field,
+                       MMDBW_merge_strategy merge_strategy) {
+    input_file_s input = {.file = fopen(filename, "r")};
+    if (NULL == input.file) {
+        croak("Could not open file %s: %s", filename, strerror(errno));
+    }
+
+    // This closes the file on LEAVE, including when we croak.
+    ENTER;
+    SAVEDESTRUCTOR_X(close_input_on_leave, &input);
+
+    json_parser_s parser = {.filename = filename, .line_number = 0};
+    size_t length;
+    while (read_line(&input, &length)) {
+        parser.line_number++;
+        parser.position = input.line;
+        parser.end = input.line + length;
+        parser.depth = 0;
+
+        skip_json_whitespace(&parser);
+        if (parser.position == parser.end) {
+            continue;
+        }
+
+        insert_record_from_jsonl(tree, &parser, network_field, merge_strategy);
+    }
+
+    if (ferror(input.file)) {
+        croak("Error reading from %s: %s", filename, strerror(errno));
+    }
+
+    LEAVE;
+}
+
+static void close_input_on_leave(pTHX_ void *input) {
+    input_file_s *in = (input_file_s *)input;
+    fclose(in->file);
+    free(in->line);
+    free(in->record);
+    free(in->fields);
+}
+
+// Reads the next line, with its line ending, into the input's line buffer,
+// growing the buffer as needed. We use this rather than getline(), which not
+// every compiler we build with has. Returns false at the end of the file.
+static bool read_line(input_file_s *input, size_t *length) {
+    *length = 0;
+    while (true) {
+        if (input->line_size - *length < 2) {
+            input->line_size = input->line_size ? 2 * input->line_size : 256;
+            input->line = checked_realloc(input->line, input->line_size);
+        }
+
+        size_t available = input->line_size - *length;
+        if (available > INT_MAX) {
+            available = INT_MAX;
+        }
+        if (NULL ==
+            fgets(input->line + *length, (int)available, input->file)) {
+            return *length > 0;
+        }
+
+        *length += strlen(input->line + *length);
+        if (*length > 0 && '\n' == input->line[*length - 1]) {
+            return true;
+        }
+    }
+}
+
+static void insert_record_from_jsonl(MMDBW_tree_s *tree,
+                                     json_parser_s *parser,
+                                     const char *const network_field,
+                                     MMDBW_merge_strategy merge_strategy) {
+    ENTER;
+    SAVETMPS;
+
+    // Everything parsed hangs off this SV as soon as it is created, so it is
+    // all freed if the line turns out to be invalid.
+    SV *record = sv_2mortal(newSV(0));
+    parse_json_value(parser, record);
+    skip_json_whitespace(parser);
+    if (parser->position != parser->end) {
+        json_error(parser, "unexpected data after the value");
+    }
+
+    if (NULL != network_field) {
+        if (!SvROK(record) || SVt_PVHV != SvTYPE(SvRV(record))) {
+            json_error(parser, "expected an object");
+        }
+
+        SV *network = hv_delete(
+            (HV *)SvRV(record), network_field, strlen(network_field), 0);
+        if (NULL == network) {
+            croak("Line %zu of %s does not have a %s field",
+                  parser->line_number,
+                  parser->filename,
+                  network_field);
+        }
+
+        insert_json_network(tree, parser, network, record, merge_strategy);
+    } else {
+        AV *pair = SvROK(record) && SVt_PVAV == SvTYPE(SvRV(record))
+                       ? (AV *)SvRV(record)
+                       : NULL;
+        if (NULL == pair || 1 != av_len(pair)) {
+            json_error(parser, "expected an array of a network and its data");
+        }
+
+        insert_json_network(tree,
+                            parser,
+                            *av_fetch(pair, 0, 0),
+                            *av_fetch(pair, 1, 0),
+                            merge_strategy);
+    }
+
+    FREETMPS;
+    LEAVE;
+}
+
+static void insert_json_network(MMDBW_tree_s *tree,
+                                json_parser_s *parser,
+                                SV *network_sv,
+                                SV *data,
+                                MMDBW_merge_strategy merge_strategy) {
+    if (SvROK(network_sv) || !SvPOK(network_sv)) {
+        croak("The network on line %zu of %s is not a string",
+              parser->line_number,
+              parser->filename);
+    }
+
+    STRLEN length;
+    const char *const network = SvPV(network_sv, length);
+    insert_network_string(tree,
+                          parser->filename,
+                          parser->line_number,
+                          network,
+                          length,
+                          sv_2mortal(key_for_data(data)),
+                          data,
+                          merge_strategy);
+}
+
+// The first record of the file names the columns. Each record after that is
+// a network, or a range of addresses, and an id for its data, which is looked
+// up in data_by_id. The values of data_by_id are arrays of the data's key and
+// the data, so the key is only computed once for each id however many
+// records use it.
+void insert_from_csv(MMDBW_tree_s *tree,
+                     const char *const filename,
+                     const char *const network_column,
+                     const char *const first_ip_column,
+                     const char *const last_ip_column,
+                     const char *const id_column,
+                     HV *data_by_id,
+                     MMDBW_merge_strategy merge_strategy) {
+    input_file_s input = {.file = fopen(filename, "r")};
+    if (NULL == input.file) {
+        croak("Could not open file %s: %s", filename, strerror(errno));
+    }
+
+    // This closes the file on LEAVE, including when we croak.
+    ENTER;
+    SAVEDESTRUCTOR_X(close_input_on_leave, &input);
+
+    csv_reader_s reader = {.filename = filename,
+                           .input = &input,
+                           .network_index = SIZE_MAX,
+                           .first_ip_index = SIZE_MAX,
+                           .last_ip_index = SIZE_MAX};
+    if (!read_csv_record(&reader)) {
+        croak("The CSV file %s is empty", filename);
+    }
+
+    // Files written on Windows often start with a byte order mark.
+    if (reader.record_length >= 3 &&
+        0 == memcmp(input.record, "\xEF\xBB\xBF", 3)) {
+        reader.record_length -= 3;
+        memmove(input.record, input.record + 3, reader.record_length + 1);
+    }
+
+    parse_csv_fields(&reader);
+    reader.id_index = csv_column_index(&reader, id_column);
+    if (NULL != network_column) {
+        reader.network_index = csv_column_index(&reader, network_column);
+    } else {
+        reader.first_ip_index = csv_column_index(&reader, first_ip_column);
+        reader.last_ip_index = csv_column_index(&reader, last_ip_column);
+    }
+
+    while (read_csv_record(&reader)) {
+        if (0 == reader.record_length) {
+            continue;
+        }
+
+        parse_csv_fields(&reader);
+
+        ENTER;
+        SAVETMPS;
+        insert_csv_record(tree, &reader, data_by_id, merge_strategy);
+        FREETMPS;
+        LEAVE;
+    }
+
+    LEAVE;
+}
+
+static void insert_csv_record(MMDBW_tree_s *tree,
+                              csv_reader_s *reader,
+                              HV *data_by_id,
+                              MMDBW_merge_strategy merge_strategy) {
+    csv_field_s *id = csv_field(reader, reader->id_index);
+
+    // Some sources have networks with no data, such as GeoIP2 blocks with
+    // no location. There is nothing to insert for these.
+    if (0 == id->length) {
+        return;
+    }
+
+    SV **key_and_data = hv_fetch(data_by_id, id->start, id->length, 0);
+    if (NULL == key_and_data) {
+        croak("There is no data for the id %.*s on line %zu of %s",
+              (int)id->length,
+              id->start,
+              reader->line_number,
+              reader->filename);
+    }
+
+    if (!SvROK(*key_and_data) ||
+        SvTYPE(SvRV(*key_and_data)) != SVt_PVAV) {
+        croak("The data for the id %.*s is not an array of its key and data",
+              (int)id->length,
+              id->start);
+    }
+    AV *pair = (AV *)SvRV(*key_and_data);
+    SV *key = *av_fetch(pair, 0, 0);
+    SV *data = *av_fetch(pair, 1, 0);
+
+    if (SIZE_MAX != reader->network_index) {
+        csv_field_s *network = csv_field(reader, reader->network_index);
+        insert_network_string(tree,
+                              reader->filename,
+                              reader->line_number,
+                              network->start,
+                              network->length,
+                              key,
+                              data,
+                              merge_strategy);
+        return;
+    }
+
+    char first_ip[MAX_ADDRESS_LENGTH + 1];
+    char last_ip[MAX_ADDRESS_LENGTH + 1];
+    csv_field_s *first = csv_field(reader, reader->first_ip_index);
+    csv_field_s *last = csv_field(reader, reader->last_ip_index);
+    if (!copy_address(first_ip, first->start, first->length) ||
+        !copy_address(last_ip, last->start, last->length)) {
+        croak("Invalid IP address on line %zu of %s",
+              reader->line_number,
+              reader->filename);
+    }
+
+    insert_range(tree, first_ip, last_ip, key, data, merge_strategy);
+}
+
+// Reads the next record into the input's record buffer, joining lines while
+// a quoted field is open, and strips its line ending. Returns false at the
+// end of the file.
+static bool read_csv_record(csv_reader_s *reader) {
+    input_file_s *input = reader->input;
+
+    reader->record_length = 0;
+    reader->line_number = reader->last_line_number + 1;
+
+    bool in_quotes = false;
+    do {
+        size_t length;
+        if (!read_line(input, &length)) {
+            if (ferror(input->file)) {
+                croak("Error reading from %s: %s",
+                      reader->filename,
+                      strerror(errno));
+            }
+            if (0 == reader->record_length) {
+                return false;
+            }
+            croak("Unterminated quoted field on line %zu of %s",
+                  reader->line_number,
+                  reader->filename);
+        }
+        reader->last_line_number++;
+
+        // A doubled quote inside a quoted field flips this twice, so it
+        // only ends up set while a field is open.
+        for (size_t i = 0; i < length; i++) {
+            if ('"' == input->line[i]) {
+                in_quotes = !in_quotes;
+            }
+        }
+
+        if (reader->record_length + length + 1 > reader->record_size) {
+            reader->record_size = 2 * (reader->record_length + length + 1);
+            input->record =
+                checked_realloc(input->record, reader->record_size);
+        }
+        memcpy(input->record + reader->record_length, input->line, length);
+        reader->record_length += length;
+    } while (in_quotes);
+
+    while (reader->record_length > 0 &&
+           ('\n' == input->record[reader->record_length - 1] ||
+            '\r' == input->record[reader->record_length - 1])) {
+        reader->record_length--;
+    }
+    input->record[reader->record_length] = '\0';
+
+    return true;
+}
+
+// Splits the record into fields in place, removing the quotes around quoted
+// fields and undoubling the quotes within them.
+static void parse_csv_fields(csv_reader_s *reader) {
+    char *position = reader->input->record;
+    char *const end = position + reader->record_length;
+
+    reader->field_count = 0;
+    while (true) {
+        if (reader->field_count == reader->fields_size) {
+            reader->fields_size =
+                reader->fields_size ? 2 * reader->fields_size : 16;
+            reader->input->fields =
+                checked_realloc(reader->input->fields,
+                                reader->fields_size * sizeof(csv_field_s));
+        }
+        csv_field_s *field = &(reader->input->fields[reader->field_count++]);
+
+        if (position < end && '"' == *position) {
+            char *write = ++position;
+            field->start = position;
+            while (position < end) {
+                if ('"' == *position) {
+                    if (position + 1 < end && '"' == position[1]) {
+                        position++;
+                    } else {
+                        break;
+                    }
+                }
+                *write++ = *position++;
+            }
+            field->length = write - field->start;
+
+            // Skip the closing quote.
+            position++;
+            if (position < end && ',' != *position) {
+                croak("Invalid quoted field on line %zu of %s",
+                      reader->line_number,
+                      reader->filename);
+            }
+        } else {
+            field->start = position;
+            while (position < end && ',' != *position) {
+                position++;
+            }
+            field->length = position - field->start;
+        }
+
+        if (position >= end) {
+            break;
+        }
+        // Skip the comma.
+        position++;
+    }
+}
+
+static size_t csv_column_index(csv_reader_s *reader,
+                               const char *const column) {
+    const size_t length = strlen(column);
+    for (size_t i = 0; i < reader->field_count; i++) {
+        csv_field_s *field = &(reader->input->fields[i]);
+        if (field->length == length &&
+            0 == memcmp(field->start, column, length)) {
+            return i;
+        }
+    }
+
+    croak("The CSV file %s does not have a %s column",
+          reader->filename,
+          column);
+}
+
+static csv_field_s *csv_field(csv_reader_s *reader, size_t index) {
+    if (index >= reader->field_count) {
+        croak("Line %zu of %s has only %zu fields",
+              reader->line_number,
+              reader->filename,
+              reader->field_count);
+    }
+
+    return &(reader->input->fields[index]);
+}
+
+static void insert_network_string(MMDBW_tree_s *tree,
+                                  const char *const filename,
+                                  const size_t line_number,
+                                  const char *const network,
+                                  const size_t length,
+                                  SV *key,
+                                  SV *data,
+                                  MMDBW_merge_strategy merge_strategy) {
+    const char *const slash = memchr(network, '/', length);
+    const char *const end = network + length;
+
+    // The prefix length has one to three digits.
+    bool valid = NULL != slash && end - slash >= 2 && end - slash <= 4;
+    unsigned int prefix_length = 0;
+    for (const char *digit = valid ? slash + 1 : end; digit < end; digit++) {
+        if (*digit < '0' || *digit > '9') {
+            valid = false;
+            break;
+        }
+        prefix_length = prefix_length * 10 + (*digit - '0');
+    }
+
+    char address[MAX_ADDRESS_LENGTH + 1];
+    if (!valid || prefix_length > 128 ||
+        !copy_address(address, network, slash - network)) {
+        croak("Invalid network on line %zu of %s: %.*s",
+              line_number,
+              filename,
+              (int)length,
+              network);
+    }
+
+    insert_network(
+        tree, address, (uint8_t)prefix_length, key, data, merge_strategy);
+}
+
+// Copies the address into a NUL-terminated buffer of MAX_ADDRESS_LENGTH + 1
+// bytes, returning false if it cannot be an address.
+static bool copy_address(char *address,
+                         const char *const string,
+                         const size_t length) {
+    if (0 == length || length > MAX_ADDRESS_LENGTH) {
+        return false;
+    }
+
+    memcpy(address, string, length);
+    address[length] = '\0';
+
+    return true;
+}
+
+// Walks the search tree of a database and inserts each network with data
+// into the tree. Each data record is decoded into a Perl data structure the
+// first time it is seen, so data shared by many networks is decoded and
+// hashed once. The networks in a database never overlap, so nothing is
+// merged.
+void insert_from_mmdb(MMDBW_tree_s *tree, const char *const filename) {
+    mmdb_loader_s loader = {.ipv4_root = -1, .ipv4_root_parent = -1};
+    open_mmdb(&loader.mmdb, filename);
+
+    // This unmaps the database on LEAVE, including when we croak.
+    ENTER;
+    SAVEDESTRUCTOR_X(close_mmdb_on_leave, &loader.mmdb);
+
+    if (loader.mmdb.ip_version != tree->ip_version) {
+        croak("The database %s is for IPv%" PRIu16 " but the tree is for "
+              "IPv%" PRIu8,
+              filename,
+              loader.mmdb.ip_version,
+              tree->ip_version);
+    }
+
+    loader.data_section = (mmdb_section_s){
+        .filename = filename,
+        .name = "data section",
+        .bytes = loader.mmdb.data_section,
+        .size = loader.mmdb.data_section_size,
+    };
+    loader.bit_count = loader.mmdb.ip_version == 6 ? 128 : 32;
+    loader.data_by_offset = (HV *)sv_2mortal((SV *)newHV());
+    find_ipv4_root(&loader.mmdb, &loader.ipv4_root, &loader.ipv4_root_parent);
+
+    insert_mmdb_node(tree, &loader, 0, 0, 0);
+
+    LEAVE;
+}
+
+// Returns a reference to the database's metadata map.
+SV *read_mmdb_metadata(const char *const filename) {
+    MMDBW_mmdb_s mmdb;
+    open_mmdb(&mmdb, filename);
+
+    ENTER;
+    SAVEDESTRUCTOR_X(close_mmdb_on_leave, &mmdb);
+
+    mmdb_section_s section = {
+        .filename = filename,
+        .name = "metadata",
+        .bytes = mmdb.metadata,
+        .size = mmdb.metadata_size,
+    };
+    SV *metadata = sv_newmortal();
+    decode_mmdb_value(&section, 0, 0, metadata);
+    if (!SvROK(metadata) || SVt_PVHV != SvTYPE(SvRV(metadata))) {
+        croak("The metadata in %s is not a map", filename);
+    }
+    SvREFCNT_inc_simple_void_NN(metadata);
+
+    LEAVE;
+
+    return metadata;
+}
+
+// Returns true if the IPv4-mapped network (::ffff:0:0/96) in the database
+// points at the IPv4 subtree, as it does in a database written with
+// alias_ipv6_to_ipv4.
+bool mmdb_has_ipv4_aliases(const char *const filename) {
+    MMDBW_mmdb_s mmdb;
+    open_mmdb(&mmdb, filename);
+
+    int64_t ipv4_root = -1, ipv4_root_parent = -1;
+    find_ipv4_root(&mmdb, &ipv4_root, &ipv4_root_parent);
+
+    const uint8_t ipv4_mapped[16] = {[10] = 0xff, [11] = 0xff};
+    const bool has_aliases =
+        ipv4_root >= 0 &&
+        (int64_t)mmdb_lookup(&mmdb, ipv4_mapped, 96) == ipv4_root;
+
+    close_mmdb(&mmdb);
+
+    return has_aliases;
+}
+
+// In an IPv6 database, the IPv4 space is the subtree at ::/96. This finds the
+// node at the root of that subtree, if there is one.
+static void find_ipv4_root(MMDBW_mmdb_s *mmdb,
+                           int64_t *ipv4_root,
+                           int64_t *ipv4_root_parent) {
+    if (mmdb->ip_version != 6) {
+        return;
+    }
+
+    uint32_t parent = 0;
+    uint32_t node = 0;
+    for (int i = 0; i < 96; i++) {
+        uint32_t value = mmdb_record_value(mmdb, node, 0);
+        if (value >= mmdb->node_count) {
+            return;
+        }
+        parent = node;
+        node = value;
+    }
+
+    *ipv4_root = node;
+    *ipv4_root_parent = parent;
+}
+
+// The depth is the number of bits of the address used to reach the node.
+static void insert_mmdb_node(MMDBW_tree_s *tree,
+                             mmdb_loader_s *loader,
+                             uint32_t node,
+                             uint128_t network,
+                             int depth) {
+    insert_mmdb_record(tree, loader, node, 0, network, depth + 1);
+    insert_mmdb_record(tree,
+                       loader,
+                       node,
+                       1,
+                       network | ((uint128_t)1 << (loader->bit_count - depth -
+                                                   1)),
+                       depth + 1);
+}
+
+static void insert_mmdb_record(MMDBW_tree_s *tree,
+                               mmdb_loader_s *loader,
+                               uint32_t node,
+                               const int right,
+                               uint128_t network,
+                               int depth) {
+    const MMDBW_mmdb_s *const mmdb = &loader->mmdb;
+    const uint32_t value = mmdb_record_value(mmdb, node, right);
+
+    if (value == mmdb->node_count) {
+        return;
+    }
+
+    if (value < mmdb->node_count) {
+        // The tree makes its own aliases if it was created with
+        // alias_ipv6_to_ipv4.
+        if ((int64_t)value == loader->ipv4_root &&
+            !(0 == right && (int64_t)node == loader->ipv4_root_parent)) {
+            return;
+        }
+        if (depth >= loader->bit_count) {
+            croak("The search tree in %s is deeper than %d bits",
+                  loader->data_section.filename,
+                  loader->bit_count);
+        }
+
+        insert_mmdb_node(tree, loader, value, network, depth);
+        return;
+    }
+
+    if (value - mmdb->node_count < DATA_SECTION_SEPARATOR_SIZE) {
+        croak("The search tree in %s has an invalid record value (%" PRIu32
+              ")",
+              loader->data_section.filename,
+              value);
+    }
+
+    ENTER;
+    SAVETMPS;
+
+    AV *key_and_data = mmdb_data_for_offset(
+        loader, value - mmdb->node_count - DATA_SECTION_SEPARATOR_SIZE);
+    insert_integer_network(tree,
+                           network,
+                           (uint8_t)depth,
+                           *av_fetch(key_and_data, 0, 0),
+                           *av_fetch(key_and_data, 1, 0),
+                           MMDBW_MERGE_STRATEGY_NONE);
+
+    FREETMPS;
+    LEAVE;
+}
+
+static AV *mmdb_data_for_offset(mmdb_loader_s *loader, uint32_t offset) {
+    SV **cached = hv_fetch(
+        loader->data_by_offset, (const char *)&offset, sizeof(offset), 0);
+    if (NULL != cached) {
+        return (AV *)SvRV(*cached);
+    }
+
+    AV *key_and_data = newAV();
+    (void)hv_store(loader->data_by_offset,
+                   (const char *)&offset,
+                   sizeof(offset),
+                   newRV_noinc((SV *)key_and_data),
+                   0);
+
+    SV *data = newSV(0);
+    av_store(key_and_data, 1, data);
+    decode_mmdb_value(&loader->data_section, offset, 0, data);
+    av_store(key_and_data, 0, key_for_data(data));
+
+    return key_and_data;
+}
+
+// Decodes the value at the offset into the SV, returning the offset after the
+// value. As with JSON, each new SV is attached to its parent before anything
+// is decoded into it, so nothing leaks when we croak.
+static uint64_t decode_mmdb_value(mmdb_section_s *section,
+                                  uint64_t offset,
+                                  int depth,
+                                  SV *value) {
+    if (depth > MAX_MMDB_DEPTH) {
+        mmdb_data_error(section, offset, "values are nested too deeply");
+    }
+
+    MMDBW_mmdb_entry_s entry;
+    if (!mmdb_decode_control(section->bytes, section->size, offset, &entry)) {
+        mmdb_data_error(section, offset, "invalid control byte");
+    }
+
+    switch (entry.type) {
+        case MMDBW_TYPE_POINTER:
+            decode_mmdb_value(section, entry.size, depth + 1, value);
+            return entry.payload;
+        case MMDBW_TYPE_MAP:
+            decode_mmdb_map(section, &entry, depth, value);
+            return entry.payload;
+        case MMDBW_TYPE_ARRAY:
+            decode_mmdb_array(section, &entry, depth, value);
+            return entry.payload;
+        case MMDBW_TYPE_BOOLEAN:
+            sv_setiv(value, entry.size ? 1 : 0);
+            return entry.payload;
+        default:
+            decode_mmdb_scalar(section, offset, &entry, value);
+            return entry.payload + entry.size;
+    }
+}
+
+// This leaves the entry's payload at the offset after the map.
+static void decode_mmdb_map(mmdb_section_s *section,
+                            MMDBW_mmdb_entry_s *entry,
+                            int depth,
+                            SV *value) {
+    HV *hash = newHV();
+    sv_setsv(value, sv_2mortal(newRV_noinc((SV *)hash)));
+
+    SV *key = sv_newmortal();
+    uint64_t offset = entry->payload;
+    for (uint64_t i = 0; i < entry->size; i++) {
+        const uint64_t key_offset = offset;
+        offset = decode_mmdb_value(section, offset, depth + 1, key);
+        if (!SvPOK(key) || SvROK(key)) {
+            mmdb_data_error(section, key_offset, "map key is not a string");
+        }
+
+        SV *member = newSV(0);
+        (void)hv_store_ent(hash, key, member, 0);
+        offset = decode_mmdb_value(section, offset, depth + 1, member);
+    }
+
+    entry->payload = offset;
+}
+
+static void decode_mmdb_array(mmdb_section_s *section,
+                              MMDBW_mmdb_entry_s *entry,
+                              int depth,
+                              SV *value) {
+    AV *array = newAV();
+    sv_setsv(value, sv_2mortal(newRV_noinc((SV *)array)));
+
+    uint64_t offset = entry->payload;
+    for (uint64_t i = 0; i < entry->size; i++) {
+        SV *element = newSV(0);
+        av_push(array, element);
+        offset = decode_mmdb_value(section, offset, depth + 1, element);
+    }
+
+    entry->payload = offset;
+}
+
+// Numbers are stored in the smallest Perl type that holds them, and uint128
+// values too large for a UV become decimal strings, which the serializer
+// accepts.
+static void decode_mmdb_scalar(mmdb_section_s *section,
+                               uint64_t offset,
+                               MMDBW_mmdb_entry_s *entry,
+                               SV *value) {
+    if (entry->payload + entry->size > section->size) {
+        mmdb_data_error(section, offset, "value runs past the end");
+    }
+
+    const uint8_t *const payload = &section->bytes[entry->payload];
+    const size_t size = entry->size;
+
+    size_t max_size = 0;
+    switch (entry->type) {
+        case MMDBW_TYPE_UTF8_STRING:
+            // As with JSON, only strings with something other than ASCII
+            // are flagged as UTF-8.
+            sv_setpvn(value, (const char *)payload, size);
+            for (size_t i = 0; i < size; i++) {
+                if (payload[i] >= 0x80) {
+                    if (!is_utf8_string((U8 *)payload, size)) {
+                        mmdb_data_error(
+                            section, offset, "invalid UTF-8 in a string");
+                    }
+                    SvUTF8_on(value);
+                    break;
+                }
+            }
+            return;
+        case MMDBW_TYPE_BYTES:
+            sv_setpvn(value, (const char *)payload, size);
+            return;
+        case MMDBW_TYPE_DOUBLE:
+        case MMDBW_TYPE_FLOAT: {
+            const bool is_double = MMDBW_TYPE_DOUBLE == entry->type;
+            if (size != (is_double ? 8 : 4)) {
+                mmdb_data_error(section, offset, "invalid size for a float");
+            }
+            uint64_t bits = 0;
+            for (size_t i = 0; i < size; i++) {
+                bits = (bits << 8) | payload[i];
+            }
+            if (is_double) {
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                sv_setnv(value, d);
+            } else {
+                uint32_t bits32 = (uint32_t)bits;
+                float f;
+                memcpy(&f, &bits32, sizeof(f));
+                sv_setnv(value, f);
+            }
+            return;
+        }
+        case MMDBW_TYPE_INT32:
+        case MMDBW_TYPE_UINT16:
+        case MMDBW_TYPE_UINT32:
+            max_size = MMDBW_TYPE_UINT16 == entry->type ? 2 : 4;
+            break;
+        case MMDBW_TYPE_UINT64:
+            max_size = 8;
+            break;
+        case MMDBW_TYPE_UINT128:
+            max_size = 16;
+            break;
+        default:
+            mmdb_data_error(section, offset, "unsupported data type");
+    }
+
+    if (size > max_size) {
+        mmdb_data_error(section, offset, "invalid size for an integer");
+    }
+
+    uint128_t number = 0;
+    for (size_t i = 0; i < size; i++) {
+        number = (number << 8) | payload[i];
+    }
+
+    if (MMDBW_TYPE_INT32 == entry->type) {
+        sv_setiv(value, (IV)(int32_t)(uint32_t)number);
+    } else {
+        set_sv_to_uint128(value, number);
+    }
+}
+
+static void set_sv_to_uint128(SV *value, uint128_t number) {
+    if (number <= IV_MAX) {
+        sv_setiv(value, (IV)number);
+        return;
+    }
+    if (number <= UV_MAX) {
+        sv_setuv(value, (UV)number);
+        return;
+    }
+
+    char digits[40];
+    char *start = digits + sizeof(digits);
+    do {
+        *--start = '0' + (char)(number % 10);
+        number /= 10;
+    } while (number);
+
+    sv_setpvn(value, start, digits + sizeof(digits) - start);
+}
+
+static void parse_json_value(json_parser_s *parser, SV *value) {
+    skip_json_whitespace(parser);
+    if (parser->position == parser->end) {
+        json_error(parser, "unexpected end of line");
+    }
+
+    switch (*parser->position) {
+        case '{':
+            parse_json_object(parser, value);
+            break;
+        case '[':
+            parse_json_array(parser, value);
+            break;
+        case '"':
+            parse_json_string(parser, value);
+            break;
+        case 't':
+            expect_json_literal(parser, "true");
+            sv_setiv(value, 1);
+            break;
+        case 'f':
+            expect_json_literal(parser, "false");
+            sv_setiv(value, 0);
+            break;
+        case 'n':
+            json_error(parser, "null can only be a value in an object");
+        default:
+            parse_json_number(parser, value);
+    }
+}
+
+static void parse_json_object(json_parser_s *parser, SV *value) {
+    if (++parser->depth > MAX_JSON_DEPTH) {
+        json_error(parser, "values are nested too deeply");
+    }
+
+    HV *hash = newHV();
+    sv_setsv(value, sv_2mortal(newRV_noinc((SV *)hash)));
+
+    SV *key = sv_newmortal();
+    parser->position++;
+    skip_json_whitespace(parser);
+    if (parser->position < parser->end && '}' == *parser->position) {
+        parser->position++;
+        parser->depth--;
+        return;
+    }
+
+    while (true) {
+        skip_json_whitespace(parser);
+        if (parser->position == parser->end || '"' != *parser->position) {
+            json_error(parser, "expected a string for an object key");
+        }
+        parse_json_string(parser, key);
+        skip_json_whitespace(parser);
+        expect_json_character(parser, ':');
+        skip_json_whitespace(parser);
+
+        // A pair with a null value is left out, as there is no way to write
+        // a null to a database.
+        if (parser->position < parser->end && 'n' == *parser->position) {
+            expect_json_literal(parser, "null");
+            (void)hv_delete_ent(hash, key, G_DISCARD, 0);
+        } else {
+            SV *member = newSV(0);
+            (void)hv_store_ent(hash, key, member, 0);
+            parse_json_value(parser, member);
+        }
+
+        skip_json_whitespace(parser);
+        if (parser->position < parser->end && ',' == *parser->position) {
+            parser->position++;
+            continue;
+        }
+        expect_json_character(parser, '}');
+        break;
+    }
+
+    parser->depth--;
+}
+
+static void parse_json_array(json_parser_s *parser, SV *value) {
+    if (++parser->depth > MAX_JSON_DEPTH) {
+        json_error(parser, "values are nested too deeply");
+    }
+
+    AV *array = newAV();
+    sv_setsv(value, sv_2mortal(newRV_noinc((SV *)array)));
+
+    parser->position++;
+    skip_json_whitespace(parser);
+    if (parser->position < parser->end && ']' == *parser->position) {
+        parser->position++;
+        parser->depth--;
+        return;
+    }
+
+    while (true) {
+        SV *element = newSV(0);
+        av_push(array, element);
+        parse_json_value(parser, element);
+
+        skip_json_whitespace(parser);
+        if (parser->position < parser->end && ',' == *parser->position) {
+            parser->position++;
+            continue;
+        }
+        expect_json_character(parser, ']');
+        break;
+    }
+
+    parser->depth--;
+}
+
+// Strings are only flagged as UTF-8 when they contain something other than
+// ASCII, like those from other JSON decoders. This matters for the data's
+// key, as Sereal encodes the two differently.
+static void parse_json_string(json_parser_s *parser, SV *string) {
+    sv_setpvs(string, "");
+    SvUTF8_off(string);
+
+    parser->position++;
+    bool is_ascii = true;
+    while (true) {
+        const char *const start = parser->position;
+        while (parser->position < parser->end && '"' != *parser->position &&
+               '\\' != *parser->position) {
+            unsigned char c = (unsigned char)*parser->position;
+            if (c < 0x20) {
+                json_error(parser, "control character in a string");
+            }
+            if (c >= 0x80) {
+                is_ascii = false;
+            }
+            parser->position++;
+        }
+        sv_catpvn(string, start, parser->position - start);
+
+        if (parser->position == parser->end) {
+            json_error(parser, "unterminated string");
+        }
+        if ('"' == *parser->position++) {
+            break;
+        }
+
+        const STRLEN length = SvCUR(string);
+        parse_json_escape(parser, string);
+        if (!is_ascii) {
+            continue;
+        }
+        for (STRLEN i = length; i < SvCUR(string); i++) {
+            if ((unsigned char)SvPVX(string)[i] >= 0x80) {
+                is_ascii = false;
+            }
+        }
+    }
+
+    if (!is_ascii) {
+        if (!is_utf8_string((U8 *)SvPVX(string), SvCUR(string))) {
+            json_error(parser, "invalid UTF-8 in a string");
+        }
+        SvUTF8_on(string);
+    }
+}
+
+static void parse_json_escape(json_parser_s *parser, SV *string) {
+    if (parser->position == parser->end) {
+        json_error(parser, "unterminated string");
+    }
+
+    char c = *parser->position++;
+    switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            sv_catpvn(string, &c, 1);
+            return;
+        case 'b':
+            sv_catpvs(string, "\b");
+            return;
+        case 'f':
+            sv_catpvs(string, "\f");
+            return;
+        case 'n':
+            sv_catpvs(string, "\n");
+            return;
+        case 'r':
+            sv_catpvs(string, "\r");
+            return;
+        case 't':
+            sv_catpvs(string, "\t");
+            return;
+        case 'u':
+            break;
+        default:
+            json_error(parser, "invalid escape in a string");
+    }
+
+    uint32_t code_point = parse_json_hex4(parser);
+    if (code_point >= 0xDC00 && code_point <= 0xDFFF) {
+        json_error(parser, "unpaired surrogate in a string");
+    }
+    if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+        if (parser->end - parser->position < 2 ||
+            '\\' != parser->position[0] || 'u' != parser->position[1]) {
+            json_error(parser, "unpaired surrogate in a string");
+        }
+        parser->position += 2;
+        uint32_t low = parse_json_hex4(parser);
+        if (low < 0xDC00 || low > 0xDFFF) {
+            json_error(parser, "unpaired surrogate in a string");
+        }
+        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+    }
+
+    char bytes[4];
+    int size;
+    if (code_point < 0x80) {
+        bytes[0] = (char)code_point;
+        size = 1;
+    } else if (code_point < 0x800) {
+        bytes[0] = (char)(0xC0 | (code_point >> 6));
+        bytes[1] = (char)(0x80 | (code_point & 0x3F));
+        size = 2;
+    } else if (code_point < 0x10000) {
+        bytes[0] = (char)(0xE0 | (code_point >> 12));
+        bytes[1] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        bytes[2] = (char)(0x80 | (code_point & 0x3F));
+        size = 3;
+    } else {
+        bytes[0] = (char)(0xF0 | (code_point >> 18));
+        bytes[1] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+        bytes[2] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        bytes[3] = (char)(0x80 | (code_point & 0x3F));
+        size = 4;
+    }
+    sv_catpvn(string, bytes, size);
+}
+
+static uint32_t parse_json_hex4(json_parser_s *parser) {
+    if (parser->end - parser->position < 4) {
+        json_error(parser, "invalid \\u escape in a string");
+    }
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *parser->position++;
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            json_error(parser, "invalid \\u escape in a string");
+        }
+    }
+
+    return value;
+}
+
+// Integers become IVs or UVs, like those from other JSON decoders. Integers
+// too large for a UV are kept as strings, so they can still be written as a
+// uint128 without losing precision.
+static void parse_json_number(json_parser_s *parser, SV *number) {
+    const char *const start = parser->position;
+
+    bool is_negative = false;
+    if (parser->position < parser->end && '-' == *parser->position) {
+        is_negative = true;
+        parser->position++;
+    }
+    if (parser->position < parser->end && '0' == *parser->position) {
+        parser->position++;
+    } else if (!skip_json_digits(parser)) {
+        json_error(parser, "invalid value");
+    }
+
+    bool is_integer = true;
+    if (parser->position < parser->end && '.' == *parser->position) {
+        is_integer = false;
+        parser->position++;
+        if (!skip_json_digits(parser)) {
+            json_error(parser, "invalid number");
+        }
+    }
+    if (parser->position < parser->end &&
+        ('e' == *parser->position || 'E' == *parser->position)) {
+        is_integer = false;
+        parser->position++;
+        if (parser->position < parser->end &&
+            ('+' == *parser->position || '-' == *parser->position)) {
+            parser->position++;
+        }
+        if (!skip_json_digits(parser)) {
+            json_error(parser, "invalid number");
+        }
+    }
+
+    // The line always ends with a newline or a NUL, so these stop within it.
+    errno = 0;
+    if (!is_integer) {
+        sv_setnv(number, strtod(start, NULL));
+    } else if (is_negative) {
+        long long value = strtoll(start, NULL, 10);
+        if (ERANGE == errno) {
+            sv_setnv(number, strtod(start, NULL));
+        } else {
+            sv_setiv(number, (IV)value);
+        }
+    } else {
+        unsigned long long value = strtoull(start, NULL, 10);
+        if (ERANGE == errno || value > UV_MAX) {
+            sv_setpvn(number, start, parser->position - start);
+        } else if (value <= IV_MAX) {
+            sv_setiv(number, (IV)value);
+        } else {
+            sv_setuv(number, (UV)value);
+        }
+    }
+}
+
+static bool skip_json_digits(json_parser_s *parser) {
+    const char *const start = parser->position;
+    while (parser->position < parser->end && *parser->position >= '0' &&
+           *parser->position <= '9') {
+        parser->position++;
+    }
+
+    return parser->position != start;
+}
+
+static void expect_json_literal(json_parser_s *parser,
+                                const char *const literal) {
+    const size_t length = strlen(literal);
+    if ((size_t)(parser->end - parser->position) < length ||
+        0 != memcmp(parser->position, literal, length)) {
+        json_error(parser, "invalid value");
+    }
+    parser->position += length;
+}
+
+static void expect_json_character(json_parser_s *parser, char c) {
+    if (parser->position == parser->end || c != *parser->position) {
+        char message[] = "expected '?'";
+        message[10] = c;
+        json_error(parser, message);
+    }
+    parser->position++;
+}
+
+static void skip_json_whitespace(json_parser_s *parser) {
+    while (parser->position < parser->end &&
+           (' ' == *parser->position || '\t' == *parser->position ||
+            '\n' == *parser->position || '\r' == *parser->position)) {
+        parser->position++;
+    }
+}
+
+static void json_error(json_parser_s *parser, const char *const message) {
+    croak("Invalid JSON on line %zu of %s: %s",
+          parser->line_number,
+          parser->filename,
+          message);
+}
+
+static void *checked_realloc(void *ptr, size_t size) {
+    void *new_ptr = realloc(ptr, size);
+    if (!new_ptr) {
+        abort();
+    }
+
+    return new_ptr;
+}
@@ -0,0 +1,373 @@
+#include "EXTERN.h"
+#include "perl.h"
+#include "reader.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#else
+#include "windows_mman.h"
+#endif
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#define METADATA_MARKER "\xAB\xCD\xEFMaxMind.com"
+#define METADATA_MARKER_SIZE (sizeof(METADATA_MARKER) - 1)
+#define METADATA_MAX_SIZE (128 * 1024)
+
+// Maps and arrays can only nest this deep if a pointer loops back to a value
+// containing it.
+#define MAX_DATA_DEPTH (512)
+
+static void read_metadata(MMDBW_mmdb_s *mmdb);
+static const uint8_t *find_metadata_marker(MMDBW_mmdb_s *mmdb);
+static bool read_metadata_uint(const uint8_t *const metadata,
+                               const size_t metadata_size,
+                               uint64_t *offset,
+                               uint64_t *value);
+static bool skip_value(const uint8_t *const section,
+                       const size_t section_size,
+                       uint64_t offset,
+                       const int depth,
+                       uint64_t *next);
+
+// Maps the file and reads the parts of the metadata needed to walk the search
+// tree. This croaks if the file cannot be read or its layout is not valid.
+void open_mmdb(MMDBW_mmdb_s *mmdb, const char *const filename) {
+    int fd = open(filename, O_RDONLY, 0);
+    if (fd == -1) {
+        croak("Could not open file %s: %s", filename, strerror(errno));
+    }
+
+    struct stat fileinfo;
+    if (fstat(fd, &fileinfo) == -1) {
+        close(fd);
+        croak("Could not stat file: %s: %s", filename, strerror(errno));
+    }
+    if (fileinfo.st_size == 0) {
+        close(fd);
+        croak("%s is not a valid MaxMind DB file: it is empty", filename);
+    }
+
+    void *file =
+        mmap(NULL, fileinfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        croak("Could not mmap file %s: %s", filename, strerror(errno));
+    }
+
+    mmdb->file = file;
+    mmdb->file_size = fileinfo.st_size;
+
+    read_metadata(mmdb);
+}
+
+static void read_metadata(MMDBW_mmdb_s *mmdb) {
+    const uint8_t *const marker = find_metadata_marker(mmdb);
+    if (NULL == marker) {
+        munmap((void *)mmdb->file, mmdb->file_size);
+        croak("Could not find the metadata marker in the database");
+    }
+
+    const uint8_t *const metadata = marker + METADATA_MARKER_SIZE;
+    const size_t metadata_size = mmdb->file + mmdb->file_size - metadata;
+
+    MMDBW_mmdb_entry_s map;
+    uint64_t offset = 0;
+    bool ok = mmdb_decode_control(metadata, metadata_size, offset, &map) &&
+              MMDBW_TYPE_MAP == map.type;
+
+    uint64_t node_count = 0, record_size = 0, ip_version = 0;
+    offset = map.payload;
+    for (uint64_t i = 0; ok && i < map.size; i++) {
+        MMDBW_mmdb_entry_s key;
+        ok = mmdb_decode_control(metadata, metadata_size, offset, &key);
+        if (!ok) {
+            break;
+        }
+        uint64_t value_offset = key.payload;
+        if (MMDBW_TYPE_POINTER == key.type) {
+            ok = mmdb_decode_control(metadata, metadata_size, key.size, &key);
+        } else {
+            value_offset += key.size;
+        }
+        if (!ok || MMDBW_TYPE_UTF8_STRING != key.type ||
+            key.payload + key.size > metadata_size) {
+            ok = false;
+            break;
+        }
+
+        const char *const name = (const char *)&metadata[key.payload];
+        offset = value_offset;
+#define IS_KEY(k) (strlen(k) == key.size && !memcmp(name, k, key.size))
+        if (IS_KEY("node_count")) {
+            ok = read_metadata_uint(
+                metadata, metadata_size, &offset, &node_count);
+        } else if (IS_KEY("record_size")) {
+            ok = read_metadata_uint(
+                metadata, metadata_size, &offset, &record_size);
+        } else if (IS_KEY("ip_version")) {
+            ok = read_metadata_uint(
+                metadata, metadata_size, &offset, &ip_version);
+        } else {
+            ok = skip_value(metadata, metadata_size, offset, 0, &offset);
+        }
+#undef IS_KEY
+    }
+
+    if (!ok) {
+        munmap((void *)mmdb->file, mmdb->file_size);
+        croak("Could not decode the database metadata");
+    }
+
+    if ((record_size != 24 && record_size != 28 && record_size != 32) ||
+        (ip_version != 4 && ip_version != 6) || node_count == 0 ||
+        node_count > UINT32_MAX) {
+        munmap((void *)mmdb->file, mmdb->file_size);
+        croak("The database metadata has an invalid node_count (%" PRIu64
+              "), record_size (%" PRIu64 "), or ip_version (%" PRIu64 ")",
+              node_count,
+              record_size,
+              ip_version);
+    }
+
+    mmdb->node_count = node_count;
+    mmdb->record_size = record_size;
+    mmdb->ip_version = ip_version;
+    mmdb->node_size = record_size * 2 / 8;
+
+    const size_t search_tree_size = mmdb->node_size * node_count;
+    const size_t data_start = search_tree_size + DATA_SECTION_SEPARATOR_SIZE;
+    if (data_start > (size_t)(marker - mmdb->file)) {
+        munmap((void *)mmdb->file, mmdb->file_size);
+        croak("The search tree for %" PRIu32 " nodes is larger than the "
+              "database",
+              mmdb->node_count);
+    }
+
+    for (size_t i = search_tree_size; i < data_start; i++) {
+        if (mmdb->file[i]) {
+            munmap((void *)mmdb->file, mmdb->file_size);
+            croak("The data section separator is not all zero bytes");
+        }
+    }
+
+    mmdb->data_section = mmdb->file + data_start;
+    mmdb->data_section_size = marker - mmdb->data_section;
+    mmdb->metadata = metadata;
+    mmdb->metadata_size = metadata_size;
+}
+
+// The marker may appear in the data, so we want the last one in the file.
+static const uint8_t *find_metadata_marker(MMDBW_mmdb_s *mmdb) {
+    if (mmdb->file_size < METADATA_MARKER_SIZE) {
+        return NULL;
+    }
+
+    const uint8_t *const stop = mmdb->file_size > METADATA_MAX_SIZE
+                                    ? mmdb->file + mmdb->file_size -
+                                          METADATA_MAX_SIZE
+                                    : mmdb->file;
+    const uint8_t *p = mmdb->file + mmdb->file_size - METADATA_MARKER_SIZE;
+    for (; p >= stop; p--) {
+        if (!memcmp(p, METADATA_MARKER, METADATA_MARKER_SIZE)) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static bool read_metadata_uint(const uint8_t *const metadata,
+                               const size_t metadata_size,
+                               uint64_t *offset,
+                               uint64_t *value) {
+    MMDBW_mmdb_entry_s entry;
+    if (!mmdb_decode_control(metadata, metadata_size, *offset, &entry) ||
+        (MMDBW_TYPE_UINT16 != entry.type &&
+         MMDBW_TYPE_UINT32 != entry.type &&
+         MMDBW_TYPE_UINT64 != entry.type) ||
+        entry.size > 8 || entry.payload + entry.size > metadata_size) {
+        return false;
+    }
+
+    *value = 0;
+    for (uint64_t i = 0; i < entry.size; i++) {
+        *value = (*value << 8) | metadata[entry.payload + i];
+    }
+    *offset = entry.payload + entry.size;
+
+    return true;
+}
+
+void close_mmdb(MMDBW_mmdb_s *mmdb) {
+    munmap((void *)mmdb->file, mmdb->file_size);
+    mmdb->file = NULL;
+}
+
+// For SAVEDESTRUCTOR_X, so the database is unmapped on LEAVE, including when
+// we croak.
+void close_mmdb_on_leave(pTHX_ void *mmdb) {
+    close_mmdb((MMDBW_mmdb_s *)mmdb);
+}
+
+uint32_t
+mmdb_record_value(const MMDBW_mmdb_s *mmdb, uint32_t node, const int right) {
+    const uint8_t *p = &mmdb->file[(size_t)node * mmdb->node_size];
+
+    switch (mmdb->record_size) {
+        case 24:
+            p += right ? 3 : 0;
+            return ((uint32_t)p[0] << 16) | (p[1] << 8) | p[2];
+        case 28:
+            if (right) {
+                return ((uint32_t)(p[3] & 0x0F) << 24) | (p[4] << 16) |
+                       (p[5] << 8) | p[6];
+            }
+            return ((uint32_t)(p[3] & 0xF0) << 20) | (p[0] << 16) |
+                   (p[1] << 8) | p[2];
+        default:
+            p += right ? 4 : 0;
+            return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+}
+
+// Returns the value of the record the address ends at. The address is in
+// network order and bit_count is 32 or 128.
+uint32_t mmdb_lookup(const MMDBW_mmdb_s *mmdb,
+                     const uint8_t *const address,
+                     const int bit_count) {
+    uint32_t value = 0;
+    for (int i = 0; i < bit_count && value < mmdb->node_count; i++) {
+        value = mmdb_record_value(
+            mmdb, value, (address[i >> 3] >> (7 - (i & 7))) & 1);
+    }
+
+    return value;
+}
+
+// Decodes the control byte(s) at the offset. See the MaxMind DB spec for the
+// format.
+bool mmdb_decode_control(const uint8_t *const section,
+                         const size_t section_size,
+                         uint64_t offset,
+                         MMDBW_mmdb_entry_s *entry) {
+    if (offset >= section_size) {
+        return false;
+    }
+
+    const uint8_t ctrl = section[offset++];
+    entry->type = ctrl >> 5;
+
+    if (MMDBW_TYPE_POINTER == entry->type) {
+        const int pointer_size = ((ctrl >> 3) & 0x3) + 1;
+        if (offset + pointer_size > section_size) {
+            return false;
+        }
+
+        const uint8_t *const p = &section[offset];
+        switch (pointer_size) {
+            case 1:
+                entry->size = ((ctrl & 0x7) << 8) | p[0];
+                break;
+            case 2:
+                entry->size =
+                    (((ctrl & 0x7) << 16) | (p[0] << 8) | p[1]) + 2048;
+                break;
+            case 3:
+                entry->size = (((uint32_t)(ctrl & 0x7) << 24) | (p[0] << 16) |
+                               (p[1] << 8) | p[2]) +
+                              526336;
+                break;
+            default:
+                entry->size = ((uint32_t)p[0] << 24) | (p[1] << 16) |
+                              (p[2] << 8) | p[3];
+                break;
+        }
+        entry->payload = offset + pointer_size;
+
+        return true;
+    }
+
+    if (0 == entry->type) {
+        if (offset >= section_size) {
+            return false;
+        }
+        entry->type = 7 + section[offset++];
+        if (entry->type < MMDBW_TYPE_INT32 ||
+            entry->type > MMDBW_TYPE_FLOAT) {
+            return false;
+        }
+    }
+
+    entry->size = ctrl & 0x1f;
+    if (entry->size >= 29) {
+        const int extra = entry->size - 28;
+        if (offset + extra > section_size) {
+            return false;
+        }
+
+        const uint8_t *const p = &section[offset];
+        if (29 == entry->size) {
+            entry->size = 29 + p[0];
+        } else if (30 == entry->size) {
+            entry->size = 285 + ((p[0] << 8) | p[1]);
+        } else {
+            entry->size = 65821 + ((p[0] << 16) | (p[1] << 8) | p[2]);
+        }
+        offset += extra;
+    }
+    entry->payload = offset;
+
+    return true;
+}
+
+static bool skip_value(const uint8_t *const section,
+                       const size_t section_size,
+                       uint64_t offset,
+                       const int depth,
+                       uint64_t *next) {
+    MMDBW_mmdb_entry_s entry;
+    if (depth > MAX_DATA_DEPTH ||
+        !mmdb_decode_control(section, section_size, offset, &entry)) {
+        return false;
+    }
+
+    *next = entry.payload;
+    switch (entry.type) {
+        case MMDBW_TYPE_POINTER:
+        case MMDBW_TYPE_BOOLEAN:
+            return true;
+        case MMDBW_TYPE_MAP:
+        case MMDBW_TYPE_ARRAY: {
+            uint64_t count =
+                MMDBW_TYPE_MAP == entry.type ? entry.size * 2 : entry.size;
+            for (uint64_t i = 0; i < count; i++) {
+                if (!skip_value(
+                        section, section_size, *next, depth + 1, next)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        default:
+            *next = entry.payload + entry.size;
+            return *next <= section_size;
+    }
+}
+
+void mmdb_data_error(const mmdb_section_s *section,
+                     uint64_t offset,
+                     const char *const message) {
+    croak("Invalid value at offset %" PRIu64 " of the %s in %s: %s",
+          offset,
+          section->name,
+          section->filename,
+          message);
+}
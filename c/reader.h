@@ -0,0 +1,76 @@
+#ifndef MMDBW_READER_H
+#define MMDBW_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A minimal reader for finished MaxMind DB files. It only knows enough to
+ * walk the search tree and decode control bytes, which is what the writer
+ * needs to check its own output. */
+
+/* This is also defined in MaxMind::DB::Common. */
+#define DATA_SECTION_SEPARATOR_SIZE (16)
+
+#define MMDBW_TYPE_POINTER (1)
+#define MMDBW_TYPE_UTF8_STRING (2)
+#define MMDBW_TYPE_DOUBLE (3)
+#define MMDBW_TYPE_BYTES (4)
+#define MMDBW_TYPE_UINT16 (5)
+#define MMDBW_TYPE_UINT32 (6)
+#define MMDBW_TYPE_MAP (7)
+#define MMDBW_TYPE_INT32 (8)
+#define MMDBW_TYPE_UINT64 (9)
+#define MMDBW_TYPE_UINT128 (10)
+#define MMDBW_TYPE_ARRAY (11)
+#define MMDBW_TYPE_BOOLEAN (14)
+#define MMDBW_TYPE_FLOAT (15)
+
+typedef struct MMDBW_mmdb_s {
+    const uint8_t *file;
+    size_t file_size;
+    uint32_t node_count;
+    uint16_t record_size;
+    uint16_t ip_version;
+    size_t node_size;
+    const uint8_t *data_section;
+    size_t data_section_size;
+    // The metadata map, which runs to the end of the file.
+    const uint8_t *metadata;
+    size_t metadata_size;
+} MMDBW_mmdb_s;
+
+// A section of a database, with what is needed to report errors in it.
+typedef struct mmdb_section_s {
+    const char *filename;
+    const char *name;
+    const uint8_t *bytes;
+    size_t size;
+} mmdb_section_s;
+
+typedef struct MMDBW_mmdb_entry_s {
+    int type;
+    // For a pointer, this is the offset it points to.
+    uint64_t size;
+    // The offset of the payload, or of the next value for a pointer.
+    uint64_t payload;
+} MMDBW_mmdb_entry_s;
+
+extern void open_mmdb(MMDBW_mmdb_s *mmdb, const char *const filename);
+extern void close_mmdb(MMDBW_mmdb_s *mmdb);
+extern void close_mmdb_on_leave(pTHX_ void *mmdb);
+extern uint32_t
+mmdb_record_value(const MMDBW_mmdb_s *mmdb, uint32_t node, const int right);
+extern uint32_t mmdb_lookup(const MMDBW_mmdb_s *mmdb,
+                            const uint8_t *const address,
+                            const int bit_count);
+extern bool mmdb_decode_control(const uint8_t *const section,
+                                const size_t section_size,
+                                uint64_t offset,
+                                MMDBW_mmdb_entry_s *entry);
+extern void mmdb_data_error(const mmdb_section_s *section,
+                            uint64_t offset,
+                            const char *const message)
+    __attribute__((noreturn));
+
+#endif
@@ -1,4 +1,5 @@
 #include "tree.h"
+#include "reader.h"
 
 #ifndef WIN32
 #include <sys/mman.h>
@@ -19,17 +20,28 @@
 
 #ifdef __GNUC__
 #define UNUSED(x) UNUSED_##x __attribute__((__unused__))
+#define PREFETCH(x) __builtin_prefetch(x)
 #else
 #define UNUSED(x) UNUSED_##x
+#define PREFETCH(x)
 #endif
 
-/* This is also defined in MaxMind::DB::Common but we don't want to have to
- * fetch it every time we need it. */
-#define DATA_SECTION_SEPARATOR_SIZE (16)
+// Trees using mark and sweep for their data do not sweep until the data
+// table has at least this many entries.
+#define MIN_DATA_SWEEP_THRESHOLD (4096)
 
-#define SHA1_KEY_LENGTH (27)
+// With the blocked node layout, the search tree is written in blocks of this
+// many levels. 511 nodes of at most 8 bytes fit in a 4K page.
+#define NODE_BLOCK_LEVELS (9)
 
-#define MERGE_KEY_SIZE (57)
+// Blocks are laid out recursively until they are no more than this many
+// levels, which are written breadth first. 7 nodes fit in a 64 byte cache
+// line.
+#define NODE_LINE_LEVELS (3)
+
+// The serializer counts the shared parts of the data this many values at a
+// time, so at most this many thawed values are in memory at once.
+#define SHARED_DATA_BATCH_SIZE (1024)
 
 typedef struct freeze_args_s {
     FILE *file;
@@ -46,14 +58,114 @@ typedef struct encode_args_s {
     PerlIO *output_io;
     SV *root_data_type;
     SV *serializer;
+    SV *serializer_buffer;
     HV *data_pointer_cache;
 } encode_args_s;
 
+typedef struct previous_order_s {
+    MMDBW_mmdb_s mmdb;
+    const char *filename;
+    // One bit per node, set once the node has been walked, so the aliased
+    // IPv4 subtree is only walked once.
+    uint8_t *reached_nodes;
+    // One bit per byte of the data section, set for each offset a record
+    // points to.
+    uint8_t *data_offsets;
+} previous_order_s;
+
+typedef struct compact_args_s {
+    MMDBW_node_s *nodes;
+    size_t node_count;
+    MMDBW_path_s *paths;
+    size_t path_count;
+} compact_args_s;
+
+typedef struct block_record_s {
+    MMDBW_record_s *record;
+    uint128_t network;
+    uint8_t depth;
+} block_record_s;
+
+typedef struct block_records_s {
+    block_record_s *records;
+    size_t count;
+    size_t size;
+} block_records_s;
+
+typedef struct lookup_check_s {
+    MMDBW_mmdb_s mmdb;
+    mmdb_section_s data_section;
+    SV *data_encoder;
+    // Content hashes by data key and by database record value.
+    HV *tree_hashes;
+    HV *database_hashes;
+    AV *mismatches;
+} lookup_check_s;
+
+typedef struct mapped_data_s {
+    char key[SHA1_KEY_LENGTH + 1];
+    // The key for the data the transform returned, or NULL if it returned
+    // undef.
+    const char *new_key;
+} mapped_data_s;
+
+typedef struct projected_data_s {
+    char key[SHA1_KEY_LENGTH + 1];
+    // The key of the projected data in each edition's tree, or NULL if the
+    // edition leaves the data out.
+    const char *edition_keys[];
+} projected_data_s;
+
+typedef struct project_tree_s {
+    MMDBW_edition_s *editions;
+    size_t edition_count;
+    MMDBW_hash_table_s *projected_data;
+    // The projected_data_s entries, which are entry_size bytes each as they
+    // have a key for each edition.
+    char *entries;
+    size_t entry_size;
+    size_t entry_count;
+    // The edition records at the same place as the record being projected,
+    // edition_count of them for each bit of the network.
+    MMDBW_record_s **records;
+} project_tree_s;
+
 struct network {
     const char *const ipstr;
     const uint8_t prefix_length;
 };
 
+typedef struct tree_skeleton_s {
+    MMDBW_record_s root_record;
+    MMDBW_node_s *nodes;
+    size_t node_count;
+} tree_skeleton_s;
+
+static MMDBW_tree_s *new_empty_tree(const uint8_t ip_version,
+                                    uint8_t record_size,
+                                    MMDBW_merge_strategy merge_strategy);
+static tree_skeleton_s *tree_skeleton(const uint8_t ip_version,
+                                      const bool alias_ipv6,
+                                      const bool remove_reserved_networks);
+static tree_skeleton_s *
+build_tree_skeleton(const uint8_t ip_version,
+                    const bool alias_ipv6,
+                    const bool remove_reserved_networks);
+static void copy_node_to_skeleton(MMDBW_tree_s *UNUSED(tree),
+                                  MMDBW_node_s *node,
+                                  uint128_t UNUSED(network),
+                                  uint8_t UNUSED(depth),
+                                  void *void_args);
+static void point_record_into_skeleton(tree_skeleton_s *skeleton,
+                                       MMDBW_record_s *record);
+static void copy_tree_skeleton(MMDBW_tree_s *tree, tree_skeleton_s *skeleton);
+static MMDBW_record_s *find_ipv4_root_record(MMDBW_tree_s *tree);
+static MMDBW_record_s *start_record_for_network(MMDBW_tree_s *tree,
+                                                MMDBW_network_s *network,
+                                                int *start_bit);
+static void move_record_to_fixed_nodes(MMDBW_tree_s *tree,
+                                       tree_skeleton_s *skeleton,
+                                       MMDBW_record_s *record);
 static void verify_ip(MMDBW_tree_s *tree, const char *ipstr);
 static int128_t ip_string_to_integer(const char *ipstr, int family);
 static int128_t ip_bytes_to_integer(uint8_t *bytes, int family);
@@ -73,8 +185,25 @@ static const char *increment_data_reference_count(MMDBW_tree_s *tree,
                                                   const char *const key);
 static void
 set_stored_data_in_tree(MMDBW_tree_s *tree, const char *const key, SV *data_sv);
+static void pack_data_in_tree(MMDBW_data_hash_s *data, SV *data_sv);
+static void encode_data_in_tree(MMDBW_tree_s *tree,
+                                MMDBW_data_hash_s *data,
+                                SV *data_sv);
+static const char *copy_data_key(MMDBW_tree_s *tree, const char *const key);
 static void decrement_data_reference_count(MMDBW_tree_s *tree,
                                            const char *const key);
+static void free_data(MMDBW_tree_s *tree, MMDBW_data_hash_s *data);
+static void mark_data(MMDBW_tree_s *tree, MMDBW_record_s *record);
+static void maybe_sweep_data(MMDBW_tree_s *tree);
+static SV *call_data_transform(MMDBW_tree_s *tree,
+                               SV *transform,
+                               const char *const key);
+static SV *copy_of_data_for_key(MMDBW_tree_s *tree, const char *const key);
+static void map_record_data(MMDBW_tree_s *tree,
+                            MMDBW_hash_table_s *mapped_data,
+                            MMDBW_record_s *record,
+                            int current_bit);
+static void free_hash_table_on_leave(pTHX_ void *table);
 static MMDBW_network_s resolve_network(MMDBW_tree_s *tree,
                                        const char *const ipstr,
                                        uint8_t prefix_length);
@@ -107,6 +236,38 @@ insert_record_into_current_record(MMDBW_tree_s *tree,
                                   MMDBW_network_s *network,
                                   MMDBW_record_s *new_record,
                                   MMDBW_merge_strategy merge_strategy);
+static MMDBW_status
+insert_record_into_new_path(MMDBW_tree_s *tree,
+                            MMDBW_record_s *current_record,
+                            MMDBW_network_s *network,
+                            int current_bit,
+                            MMDBW_record_s *new_record,
+                            MMDBW_merge_strategy merge_strategy);
+static MMDBW_status insert_record_into_path(MMDBW_tree_s *tree,
+                                            MMDBW_record_s *current_record,
+                                            MMDBW_network_s *network,
+                                            int current_bit,
+                                            MMDBW_record_s *new_record,
+                                            MMDBW_merge_strategy merge_strategy,
+                                            bool is_internal_insert);
+static void trim_node_record(MMDBW_tree_s *tree,
+                             MMDBW_record_s *current_record);
+static void trim_path_record(MMDBW_tree_s *tree,
+                             MMDBW_record_s *current_record,
+                             int current_bit);
+static void split_path(MMDBW_tree_s *tree,
+                       MMDBW_record_s *record,
+                       int current_bit,
+                       int bits_before_split);
+static void join_path_to_next_node(MMDBW_tree_s *tree,
+                                   MMDBW_path_s *path,
+                                   int current_bit);
+static void join_node_to_next_path(MMDBW_tree_s *tree, MMDBW_record_s *record);
+static int path_bits_in_common(MMDBW_path_s *path,
+                               MMDBW_network_s *network,
+                               int current_bit,
+                               int max_bits);
+static int path_bit_value(MMDBW_path_s *path, int bit);
 static const char *maybe_merge_records(MMDBW_tree_s *tree,
                                        MMDBW_network_s *network,
                                        MMDBW_record_s *new_record,
@@ -138,6 +299,9 @@ static MMDBW_node_s *new_node_from_record(MMDBW_tree_s *tree,
 static MMDBW_status free_node_and_subnodes(MMDBW_tree_s *tree,
                                            MMDBW_node_s *node,
                                            bool remove_alias_and_fixed_nodes);
+static void free_node(MMDBW_tree_s *tree, MMDBW_node_s *node);
+static void free_path(MMDBW_tree_s *tree, MMDBW_path_s *path);
+static bool is_fixed_node(MMDBW_tree_s *tree, MMDBW_node_s *node);
 static MMDBW_status free_record_value(MMDBW_tree_s *tree,
                                       MMDBW_record_s *record,
                                       bool remove_alias_and_fixed_nodes);
@@ -146,6 +310,12 @@ static void assign_node_number(MMDBW_tree_s *tree,
                                uint128_t UNUSED(network),
                                uint8_t UNUSED(depth),
                                void *UNUSED(args));
+static void count_records_to_compact(MMDBW_tree_s *tree,
+                                     MMDBW_record_s *record,
+                                     compact_args_s *args);
+static void compact_record(MMDBW_tree_s *tree,
+                           MMDBW_record_s *record,
+                           compact_args_s *args);
 static void freeze_search_tree(MMDBW_tree_s *tree, freeze_args_s *args);
 static void freeze_node(MMDBW_tree_s *tree,
                         MMDBW_node_s *node,
@@ -159,14 +329,27 @@ static void freeze_data_record(MMDBW_tree_s *UNUSED(tree),
                                freeze_args_s *args);
 static void freeze_to_file(freeze_args_s *args, void *data, size_t size);
 static void freeze_data_to_file(freeze_args_s *args, MMDBW_tree_s *tree);
-static SV *freeze_hash(HV *hash);
+static SV *freeze_sv(SV *sv);
+static SV *thaw_sv(const char *const frozen, STRLEN frozen_size);
 static uint8_t thaw_uint8(uint8_t **buffer);
 static thawed_network_s *thaw_network(MMDBW_tree_s *tree, uint8_t **buffer);
 static uint8_t *thaw_bytes(uint8_t **buffer, size_t size);
 static uint128_t thaw_uint128(uint8_t **buffer);
 static STRLEN thaw_strlen(uint8_t **buffer);
 static const char *thaw_data_key(uint8_t **buffer);
-static HV *thaw_data_hash(SV *data_to_decode);
+static void thaw_data_into_tree(MMDBW_tree_s *tree,
+                                const char *const key,
+                                const char *const frozen,
+                                STRLEN frozen_size);
+static MMDBW_record_s *ipv4_subtree_record(MMDBW_tree_s *tree,
+                                           MMDBW_record_s *rest_record,
+                                           MMDBW_path_s *rest_path);
+static void set_ipv4_path_bytes(MMDBW_record_s *record, const bool for_ipv4);
+static void reset_ipv4_path_bytes_on_leave(pTHX_ void *record);
+static void add_ipv4_data(MMDBW_tree_s *tree,
+                          MMDBW_hash_table_s *ipv4_data_table,
+                          MMDBW_record_s *record);
+static void free_ipv4_data_table_on_leave(pTHX_ void *table);
 static void encode_node(MMDBW_tree_s *tree,
                         MMDBW_node_s *node,
                         uint128_t UNUSED(network),
@@ -177,6 +360,81 @@ check_record_sanity(MMDBW_node_s *node, MMDBW_record_s *record, char *side);
 static uint32_t record_value_as_number(MMDBW_tree_s *tree,
                                        MMDBW_record_s *record,
                                        encode_args_s *args);
+static void store_shared_data(MMDBW_tree_s *tree, encode_args_s *args);
+static void call_serializer_with_values(encode_args_s *args,
+                                        const char *const method,
+                                        AV *values);
+static void store_data_in_previous_order(MMDBW_tree_s *tree,
+                                        encode_args_s *args,
+                                        const char *const filename,
+                                        SV *data_encoder);
+static HV *data_keys_by_content(MMDBW_tree_s *tree, SV *data_encoder);
+static void mark_previous_data_offsets(previous_order_s *previous,
+                                       uint32_t node,
+                                       int depth);
+static void store_data_by_frequency(MMDBW_tree_s *tree, encode_args_s *args);
+static int compare_data_by_frequency(const void *a, const void *b);
+static uint32_t store_data_record(MMDBW_tree_s *tree,
+                                  const char *const key,
+                                  encode_args_s *args);
+static SV *serializer_buffer(SV *serializer);
+static uint32_t append_encoded_data(encode_args_s *args,
+                                    MMDBW_data_hash_s *data);
+static uint32_t store_data_with_serializer(MMDBW_tree_s *tree,
+                                           const char *const key,
+                                           encode_args_s *args);
+static void check_record_value(MMDBW_tree_s *tree, uint32_t record_value);
+static void verify_data_section(MMDBW_tree_s *tree,
+                                encode_args_s *args,
+                                SV *verify_encoder,
+                                const double sample_rate);
+static bool data_is_sampled(const char *const key, const double sample_rate);
+static SV *encode_data_for_verification(SV *encoder, SV *data_sv);
+static uint64_t expand_data(const mmdb_section_s *section,
+                            uint64_t offset,
+                            SV *expanded,
+                            const int depth);
+static uint64_t data_content_hash(MMDBW_tree_s *tree,
+                                  const char *const key,
+                                  SV *data_encoder);
+static void project_record(MMDBW_tree_s *tree,
+                           project_tree_s *projection,
+                           MMDBW_record_s *record,
+                           int current_bit);
+static void check_edition_record(MMDBW_edition_s *edition,
+                                 MMDBW_record_s *record,
+                                 MMDBW_record_s *edition_record);
+static const char *project_data(MMDBW_tree_s *tree,
+                                MMDBW_edition_s *edition,
+                                const char *const key);
+static void release_projected_data_on_leave(pTHX_ void *void_projection);
+static void check_lookups_for_node(MMDBW_tree_s *tree,
+                                   MMDBW_node_s *node,
+                                   uint128_t network,
+                                   uint8_t depth,
+                                   void *void_check);
+static void check_lookups_for_record(MMDBW_tree_s *tree,
+                                     lookup_check_s *check,
+                                     MMDBW_record_s *record,
+                                     uint128_t network,
+                                     const uint8_t prefix_length);
+static void check_lookup(MMDBW_tree_s *tree,
+                         lookup_check_s *check,
+                         const uint128_t ip);
+static bool tree_content_hash(MMDBW_tree_s *tree,
+                              lookup_check_s *check,
+                              const uint128_t ip,
+                              uint64_t *hash);
+static bool database_content_hash(MMDBW_tree_s *tree,
+                                  lookup_check_s *check,
+                                  const uint128_t ip,
+                                  uint64_t *hash);
+static void add_lookup_mismatch(MMDBW_tree_s *tree,
+                                lookup_check_s *check,
+                                const uint128_t ip,
+                                const char *const problem);
+static uint64_t content_hash(SV *content);
+static uint64_t next_random_number(uint64_t *state);
 static void iterate_tree(MMDBW_tree_s *tree,
                          MMDBW_record_s *record,
                          uint128_t network,
@@ -184,7 +442,41 @@ static void iterate_tree(MMDBW_tree_s *tree,
                          bool depth_first,
                          void *args,
                          MMDBW_iterator_callback callback);
-static SV *key_for_data(SV *data);
+static void iterate_path(MMDBW_tree_s *tree,
+                         MMDBW_path_s *path,
+                         uint128_t network,
+                         const uint8_t depth,
+                         bool depth_first,
+                         void *args,
+                         MMDBW_iterator_callback callback);
+static MMDBW_node_s *expand_path(MMDBW_path_s *path, const uint8_t depth);
+static void prefetch_record(MMDBW_record_s *record);
+static void iterate_blocks(MMDBW_tree_s *tree,
+                           block_record_s *start,
+                           void *args,
+                           MMDBW_iterator_callback callback);
+static void iterate_block(MMDBW_tree_s *tree,
+                          block_record_s *start,
+                          const uint8_t levels,
+                          block_records_s *frontier,
+                          void *args,
+                          MMDBW_iterator_callback callback);
+static void iterate_line_block(MMDBW_tree_s *tree,
+                               block_record_s *start,
+                               const uint8_t levels,
+                               block_records_s *frontier,
+                               void *args,
+                               MMDBW_iterator_callback callback);
+static void iterate_block_record(MMDBW_tree_s *tree,
+                                 block_record_s *block_record,
+                                 block_records_s *next_level,
+                                 block_records_s *frontier,
+                                 void *args,
+                                 MMDBW_iterator_callback callback);
+static void push_block_record(block_records_s *block_records,
+                              MMDBW_record_s *record,
+                              uint128_t network,
+                              const uint8_t depth);
 static const char *merge_cache_lookup(MMDBW_tree_s *tree,
                                       char *merge_cache_key);
 static void store_in_merge_cache(MMDBW_tree_s *tree,
@@ -205,7 +497,28 @@ MMDBW_tree_s *new_tree(const uint8_t ip_version,
                        uint8_t record_size,
                        MMDBW_merge_strategy merge_strategy,
                        const bool alias_ipv6,
-                       const bool remove_reserved_networks) {
+                       const bool remove_reserved_networks,
+                       const bool pack_data,
+                       const bool mark_and_sweep_data,
+                       SV *data_encoder) {
+    MMDBW_tree_s *tree =
+        new_empty_tree(ip_version, record_size, merge_strategy);
+    tree->pack_data = pack_data;
+    tree->mark_and_sweep_data = mark_and_sweep_data;
+    if (SvOK(data_encoder)) {
+        tree->data_encoder = SvREFCNT_inc_simple_NN(data_encoder);
+    }
+
+    copy_tree_skeleton(
+        tree, tree_skeleton(ip_version, alias_ipv6, remove_reserved_networks));
+    tree->ipv4_root_record = find_ipv4_root_record(tree);
+
+    return tree;
+}
+
+static MMDBW_tree_s *new_empty_tree(const uint8_t ip_version,
+                                    uint8_t record_size,
+                                    MMDBW_merge_strategy merge_strategy) {
     if (merge_strategy == MMDBW_MERGE_STRATEGY_UNKNOWN) {
         croak("Unknown merge_strategy encountered");
     }
@@ -222,12 +535,75 @@ MMDBW_tree_s *new_tree(const uint8_t ip_version,
 
     tree->record_size = record_size;
     tree->merge_strategy = merge_strategy;
-    tree->merge_cache = NULL;
-    tree->data_table = NULL;
+    hash_table_init(&(tree->merge_cache), MERGE_KEY_SIZE);
+    hash_table_init(&(tree->data_table), SHA1_KEY_LENGTH);
     tree->root_record = (MMDBW_record_s){
         .type = MMDBW_RECORD_TYPE_EMPTY,
     };
+    tree->ipv4_root_record = NULL;
     tree->node_count = 0;
+    tree->fixed_nodes = NULL;
+    tree->fixed_node_count = 0;
+    tree->compact_nodes = NULL;
+    tree->compact_node_count = 0;
+    tree->compact_paths = NULL;
+    tree->compact_path_count = 0;
+    tree->is_compact = false;
+    tree->pack_data = false;
+    tree->mark_and_sweep_data = false;
+    tree->data_sweep_threshold = MIN_DATA_SWEEP_THRESHOLD;
+    tree->data_encoder = NULL;
+
+    return tree;
+}
+
+// The fixed part of a new tree (the IPv4 root node, the aliases pointing at
+// it, and the reserved networks) only depends on the IP version and the two
+// flags, so we build it once per combination and copy it into each new tree.
+// Building it from the network strings every time dominates the cost of
+// creating small trees.
+//
+// The skeletons are built when the module is loaded, before any other thread
+// can create a tree, so they are only read afterwards and need no lock.
+static tree_skeleton_s *tree_skeletons[2][2][2];
+
+void build_tree_skeletons(void) {
+    for (int ipv6 = 0; ipv6 < 2; ipv6++) {
+        for (int alias_ipv6 = 0; alias_ipv6 < 2; alias_ipv6++) {
+            for (int remove_reserved_networks = 0;
+                 remove_reserved_networks < 2;
+                 remove_reserved_networks++) {
+                tree_skeleton_s **slot =
+                    &tree_skeletons[ipv6][alias_ipv6]
+                                   [remove_reserved_networks];
+                if (NULL == *slot) {
+                    *slot = build_tree_skeleton(ipv6 ? 6 : 4,
+                                                alias_ipv6,
+                                                remove_reserved_networks);
+                }
+            }
+        }
+    }
+}
+
+static tree_skeleton_s *tree_skeleton(const uint8_t ip_version,
+                                      const bool alias_ipv6,
+                                      const bool remove_reserved_networks) {
+    tree_skeleton_s *skeleton =
+        tree_skeletons[ip_version == 6][alias_ipv6][remove_reserved_networks];
+    if (NULL == skeleton) {
+        croak("The tree skeletons have not been built");
+    }
+
+    return skeleton;
+}
+
+static tree_skeleton_s *
+build_tree_skeleton(const uint8_t ip_version,
+                    const bool alias_ipv6,
+                    const bool remove_reserved_networks) {
+    MMDBW_tree_s *tree =
+        new_empty_tree(ip_version, 24, MMDBW_MERGE_STRATEGY_NONE);
 
     if (alias_ipv6) {
         alias_ipv4_networks(tree);
@@ -243,7 +619,126 @@ MMDBW_tree_s *new_tree(const uint8_t ip_version,
         }
     }
 
-    return tree;
+    tree_skeleton_s *skeleton = checked_malloc(sizeof(tree_skeleton_s));
+    skeleton->root_record = tree->root_record;
+    skeleton->nodes = NULL;
+    skeleton->node_count = 0;
+
+    if (MMDBW_RECORD_TYPE_NODE == tree->root_record.type ||
+        MMDBW_RECORD_TYPE_FIXED_NODE == tree->root_record.type) {
+        // The node numbers double as the index of each node in the
+        // skeleton's node array.
+        assign_node_numbers(tree);
+        skeleton->node_count = tree->node_count;
+        skeleton->nodes =
+            checked_malloc(skeleton->node_count * sizeof(MMDBW_node_s));
+        start_iteration(tree, false, (void *)skeleton, &copy_node_to_skeleton);
+        point_record_into_skeleton(skeleton, &skeleton->root_record);
+    }
+
+    free_tree(tree);
+
+    return skeleton;
+}
+
+static void copy_node_to_skeleton(MMDBW_tree_s *UNUSED(tree),
+                                  MMDBW_node_s *node,
+                                  uint128_t UNUSED(network),
+                                  uint8_t UNUSED(depth),
+                                  void *void_args) {
+    tree_skeleton_s *skeleton = (tree_skeleton_s *)void_args;
+
+    MMDBW_node_s *copy = &skeleton->nodes[node->number];
+    *copy = *node;
+    point_record_into_skeleton(skeleton, &copy->left_record);
+    point_record_into_skeleton(skeleton, &copy->right_record);
+}
+
+static void point_record_into_skeleton(tree_skeleton_s *skeleton,
+                                       MMDBW_record_s *record) {
+    if (record->type == MMDBW_RECORD_TYPE_NODE ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
+        record->type == MMDBW_RECORD_TYPE_ALIAS) {
+        record->value.node = &skeleton->nodes[record->value.node->number];
+    }
+}
+
+// Every node in the skeleton is reachable only through FIXED_NODE records, so
+// none of them can be freed before the tree itself is. That lets us copy all
+// of them into a single block with one memcpy() and then move the pointers
+// over to the new block.
+static void copy_tree_skeleton(MMDBW_tree_s *tree,
+                               tree_skeleton_s *skeleton) {
+    tree->root_record = skeleton->root_record;
+
+    if (0 == skeleton->node_count) {
+        return;
+    }
+
+    tree->fixed_node_count = skeleton->node_count;
+    tree->fixed_nodes =
+        checked_malloc(skeleton->node_count * sizeof(MMDBW_node_s));
+    memcpy(tree->fixed_nodes,
+           skeleton->nodes,
+           skeleton->node_count * sizeof(MMDBW_node_s));
+
+    move_record_to_fixed_nodes(tree, skeleton, &tree->root_record);
+    for (size_t i = 0; i < tree->fixed_node_count; i++) {
+        move_record_to_fixed_nodes(
+            tree, skeleton, &tree->fixed_nodes[i].left_record);
+        move_record_to_fixed_nodes(
+            tree, skeleton, &tree->fixed_nodes[i].right_record);
+    }
+}
+
+static void move_record_to_fixed_nodes(MMDBW_tree_s *tree,
+                                       tree_skeleton_s *skeleton,
+                                       MMDBW_record_s *record) {
+    if (record->type == MMDBW_RECORD_TYPE_NODE ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
+        record->type == MMDBW_RECORD_TYPE_ALIAS) {
+        record->value.node =
+            tree->fixed_nodes + (record->value.node - skeleton->nodes);
+    }
+}
+
+// We can only start from the ::/96 record if it is a fixed node, as those are
+// never replaced, merged away, or freed before the tree is. It is when the
+// tree aliases IPv6 networks to IPv4, as every node down to it is fixed.
+static MMDBW_record_s *find_ipv4_root_record(MMDBW_tree_s *tree) {
+    if (tree->ip_version != 6) {
+        return NULL;
+    }
+
+    MMDBW_record_s *record = &tree->root_record;
+    for (int i = 0; i < 96; i++) {
+        if (record->type != MMDBW_RECORD_TYPE_FIXED_NODE) {
+            return NULL;
+        }
+        record = &record->value.node->left_record;
+    }
+
+    return record->type == MMDBW_RECORD_TYPE_FIXED_NODE ? record : NULL;
+}
+
+// Returns the record to start descending from to reach the network, and sets
+// `start_bit' to the depth of that record.
+static MMDBW_record_s *start_record_for_network(MMDBW_tree_s *tree,
+                                                MMDBW_network_s *network,
+                                                int *start_bit) {
+    if (NULL != tree->ipv4_root_record && network->prefix_length >= 96) {
+        int i = 0;
+        while (i < 12 && 0 == network->bytes[i]) {
+            i++;
+        }
+        if (i == 12) {
+            *start_bit = 96;
+            return tree->ipv4_root_record;
+        }
+    }
+
+    *start_bit = 0;
+    return &tree->root_record;
 }
 
 void insert_network(MMDBW_tree_s *tree,
@@ -253,6 +748,7 @@ void insert_network(MMDBW_tree_s *tree,
                     SV *data,
                     MMDBW_merge_strategy merge_strategy) {
     verify_ip(tree, ipstr);
+    maybe_sweep_data(tree);
 
     MMDBW_network_s network = resolve_network(tree, ipstr, prefix_length);
 
@@ -277,6 +773,46 @@ void insert_network(MMDBW_tree_s *tree,
     }
 }
 
+// This is insert_network() for a network that is already an integer, such as
+// one found by walking the search tree of another database. The prefix length
+// counts from the start of the tree, so an IPv4 network in an IPv6 tree has
+// a prefix length of at least 96.
+void insert_integer_network(MMDBW_tree_s *tree,
+                            const uint128_t ip,
+                            const uint8_t prefix_length,
+                            SV *key_sv,
+                            SV *data,
+                            MMDBW_merge_strategy merge_strategy) {
+    maybe_sweep_data(tree);
+
+    uint8_t bytes[tree->ip_version == 6 ? 16 : 4];
+    integer_to_ip_bytes(tree->ip_version, ip, bytes);
+    MMDBW_network_s network = {
+        .bytes = bytes,
+        .prefix_length = prefix_length,
+    };
+
+    const char *const key =
+        store_data_in_tree(tree, SvPVbyte_nolen(key_sv), data);
+    MMDBW_record_s new_record = {.type = MMDBW_RECORD_TYPE_DATA,
+                                 .value = {.key = key}};
+
+    MMDBW_status status = insert_record_for_network(
+        tree, &network, &new_record, merge_strategy, false);
+
+    decrement_data_reference_count(tree, key);
+
+    if (MMDBW_SUCCESS != status) {
+        char ip_string[INET6_ADDRSTRLEN];
+        integer_to_ip_string(
+            tree->ip_version, ip, ip_string, sizeof(ip_string));
+        croak("%s (when inserting %s/%" PRIu8 ")",
+              status_error_message(status),
+              ip_string,
+              prefix_length);
+    }
+}
+
 static void verify_ip(MMDBW_tree_s *tree, const char *ipstr) {
     if (tree->ip_version == 4 && strchr(ipstr, ':')) {
         croak("You cannot insert an IPv6 address (%s) into an IPv4 tree.",
@@ -292,6 +828,7 @@ void insert_range(MMDBW_tree_s *tree,
                   MMDBW_merge_strategy merge_strategy) {
     verify_ip(tree, start_ipstr);
     verify_ip(tree, end_ipstr);
+    maybe_sweep_data(tree);
 
     uint128_t start_ip = ip_string_to_integer(start_ipstr, tree->ip_version);
     uint128_t end_ip = ip_string_to_integer(end_ipstr, tree->ip_version);
@@ -453,8 +990,7 @@ store_data_in_tree(MMDBW_tree_s *tree, const char *const key, SV *data_sv) {
 
 static const char *increment_data_reference_count(MMDBW_tree_s *tree,
                                                   const char *const key) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, SHA1_KEY_LENGTH, data);
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
 
     /* We allow this possibility as we need to create the record separately
        from updating the data when thawing */
@@ -463,28 +999,53 @@ static const char *increment_data_reference_count(MMDBW_tree_s *tree,
         data->reference_count = 0;
 
         data->data_sv = NULL;
+        data->packed_data = NULL;
+        data->packed_data_size = 0;
+        data->encoded_data = NULL;
+        data->encoded_data_size = 0;
 
-        data->key = checked_malloc(SHA1_KEY_LENGTH + 1);
-        strcpy((char *)data->key, key);
+        memcpy(data->key, key, SHA1_KEY_LENGTH);
+        data->key[SHA1_KEY_LENGTH] = '\0';
 
-        HASH_ADD_KEYPTR(hh, tree->data_table, data->key, SHA1_KEY_LENGTH, data);
+        hash_table_insert(&(tree->data_table), data->key, data);
+    }
+    if (!tree->mark_and_sweep_data) {
+        data->reference_count++;
     }
-    data->reference_count++;
 
     return data->key;
 }
 
+// Records use the key string of their data table entry, so a record can be
+// copied without a lookup. With mark and sweep, counting the records using
+// each entry is left to sweep_data().
+static const char *copy_data_key(MMDBW_tree_s *tree, const char *const key) {
+    if (tree->mark_and_sweep_data) {
+        return key;
+    }
+
+    return increment_data_reference_count(tree, key);
+}
+
 static void set_stored_data_in_tree(MMDBW_tree_s *tree,
                                     const char *const key,
                                     SV *data_sv) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, SHA1_KEY_LENGTH, data);
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
 
     if (NULL == data) {
         croak("Attempt to set unknown data record in tree");
     }
 
-    if (NULL != data->data_sv) {
+    if (NULL != data->data_sv || NULL != data->packed_data) {
+        return;
+    }
+
+    if (NULL != tree->data_encoder) {
+        encode_data_in_tree(tree, data, data_sv);
+    }
+
+    if (tree->pack_data) {
+        pack_data_in_tree(data, data_sv);
         return;
     }
 
@@ -492,10 +1053,60 @@ static void set_stored_data_in_tree(MMDBW_tree_s *tree,
     data->data_sv = data_sv;
 }
 
+// We keep packed data as Sereal. It is a fraction of the size of the Perl
+// data structure and it round trips every value we can write to a database.
+static void pack_data_in_tree(MMDBW_data_hash_s *data, SV *data_sv) {
+    SV *frozen = freeze_sv(data_sv);
+
+    STRLEN size;
+    const char *const bytes = SvPV(frozen, size);
+    data->packed_data = checked_malloc(size);
+    memcpy(data->packed_data, bytes, size);
+    data->packed_data_size = size;
+
+    SvREFCNT_dec(frozen);
+}
+
+// The encoding is done once, when a distinct value is first stored, so that
+// writing the tree only has to copy each value's bytes into the data section.
+static void encode_data_in_tree(MMDBW_tree_s *tree,
+                                MMDBW_data_hash_s *data,
+                                SV *data_sv) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    XPUSHs(data_sv);
+    PUTBACK;
+
+    int count = call_sv(tree->data_encoder, G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from the data encoder");
+    }
+
+    SV *encoded = POPs;
+    STRLEN size;
+    const char *const bytes = SvPVbyte(encoded, size);
+    data->encoded_data = checked_malloc(size);
+    memcpy(data->encoded_data, bytes, size);
+    data->encoded_data_size = size;
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+}
+
 static void decrement_data_reference_count(MMDBW_tree_s *tree,
                                            const char *const key) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, SHA1_KEY_LENGTH, data);
+    if (tree->mark_and_sweep_data) {
+        return;
+    }
+
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
 
     if (NULL == data) {
         croak("Attempt to remove data that does not exist from tree");
@@ -503,13 +1114,268 @@ static void decrement_data_reference_count(MMDBW_tree_s *tree,
 
     data->reference_count--;
     if (0 == data->reference_count) {
-        HASH_DEL(tree->data_table, data);
-        SvREFCNT_dec(data->data_sv);
-        free((char *)data->key);
-        free(data);
+        free_data(tree, data);
+    }
+}
+
+static void free_data(MMDBW_tree_s *tree, MMDBW_data_hash_s *data) {
+    hash_table_remove(&(tree->data_table), data->key);
+    SvREFCNT_dec(data->data_sv);
+    free(data->packed_data);
+    free(data->encoded_data);
+    free(data);
+}
+
+// Frees the data that no record uses and sets the reference count of the
+// rest to the number of records using it. Trees using mark and sweep do not
+// keep the counts as records change, so this is run when the data table has
+// doubled in size since it was last run, and before the tree is written or
+// frozen.
+void sweep_data(MMDBW_tree_s *tree) {
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    while (NULL != (data = hash_table_next(&(tree->data_table), &position))) {
+        data->reference_count = 0;
+    }
+
+    mark_data(tree, &(tree->root_record));
+
+    position = 0;
+    while (NULL != (data = hash_table_next(&(tree->data_table), &position))) {
+        if (0 == data->reference_count) {
+            free_data(tree, data);
+        }
+    }
+
+    size_t count = tree->data_table.count;
+    tree->data_sweep_threshold = count * 2 > MIN_DATA_SWEEP_THRESHOLD
+                                     ? count * 2
+                                     : MIN_DATA_SWEEP_THRESHOLD;
+}
+
+static void mark_data(MMDBW_tree_s *tree, MMDBW_record_s *record) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            mark_data(tree, &(record->value.node->left_record));
+            mark_data(tree, &(record->value.node->right_record));
+            break;
+        case MMDBW_RECORD_TYPE_PATH:
+            mark_data(tree, &(record->value.path->record));
+            break;
+        case MMDBW_RECORD_TYPE_DATA: {
+            MMDBW_data_hash_s *data =
+                hash_table_find(&(tree->data_table), record->value.key);
+            if (NULL == data) {
+                croak("Record points to data that does not exist in tree");
+            }
+            data->reference_count++;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void maybe_sweep_data(MMDBW_tree_s *tree) {
+    if (tree->mark_and_sweep_data &&
+        tree->data_table.count >= tree->data_sweep_threshold) {
+        sweep_data(tree);
+    }
+}
+
+// Replaces each distinct value in the tree with what the transform returns for
+// it. The transform is called once per value in the data table rather than
+// once per network. Records whose data the transform maps to undef become
+// empty, and sibling records that end up with the same data are merged, as
+// they are when inserting.
+void map_data(MMDBW_tree_s *tree, SV *transform) {
+    if (tree->mark_and_sweep_data) {
+        sweep_data(tree);
+    }
+
+    const size_t count = tree->data_table.count;
+
+    ENTER;
+
+    // The transform is called for every value before the tree is changed,
+    // so a transform that dies leaves the tree as it was.
+    MMDBW_data_hash_s **entries;
+    Newx(entries, count ? count : 1, MMDBW_data_hash_s *);
+    SAVEFREEPV(entries);
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    for (size_t i = 0;
+         NULL != (data = hash_table_next(&(tree->data_table), &position));
+         i++) {
+        entries[i] = data;
+    }
+
+    AV *results = (AV *)sv_2mortal((SV *)newAV());
+    av_extend(results, count);
+    for (size_t i = 0; i < count; i++) {
+        av_store(
+            results, i, call_data_transform(tree, transform, entries[i]->key));
+    }
+
+    mapped_data_s *mapped;
+    Newxz(mapped, count ? count : 1, mapped_data_s);
+    SAVEFREEPV(mapped);
+    MMDBW_hash_table_s mapped_data;
+    hash_table_init(&mapped_data, SHA1_KEY_LENGTH);
+    SAVEDESTRUCTOR_X(free_hash_table_on_leave, &mapped_data);
+
+    for (size_t i = 0; i < count; i++) {
+        memcpy(mapped[i].key, entries[i]->key, SHA1_KEY_LENGTH);
+        SV *result = *av_fetch(results, i, 0);
+        if (SvOK(result)) {
+            AV *key_and_data = (AV *)SvRV(result);
+            // This holds a reference to the new data until every record has
+            // been changed, so it is not freed when the old data using the
+            // same key is.
+            mapped[i].new_key = store_data_in_tree(
+                tree,
+                SvPVbyte_nolen(*av_fetch(key_and_data, 0, 0)),
+                *av_fetch(key_and_data, 1, 0));
+        }
+        hash_table_insert(&mapped_data, mapped[i].key, &mapped[i]);
+    }
+
+    tree->is_compact = false;
+    map_record_data(tree, &mapped_data, &(tree->root_record), 0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (NULL != mapped[i].new_key) {
+            decrement_data_reference_count(tree, mapped[i].new_key);
+        }
+    }
+
+    LEAVE;
+
+    if (tree->mark_and_sweep_data) {
+        sweep_data(tree);
+    }
+}
+
+// Returns a new RV to an array of the key and data the transform returned for
+// the data, or a new undef SV if it returned undef.
+static SV *call_data_transform(MMDBW_tree_s *tree,
+                               SV *transform,
+                               const char *const key) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    /* Copying the data calls into Perl, so we need to do it before we start
+       pushing onto the stack. */
+    SV *copy = copy_of_data_for_key(tree, key);
+    SPAGAIN;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 1);
+    PUSHs(copy);
+    PUTBACK;
+
+    int count = call_sv(transform, G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from the map_data transform");
+    }
+
+    // Hashing the data calls into Perl too, so the stack is put back first.
+    SV *data = POPs;
+    SvREFCNT_inc_simple_void_NN(data);
+    sv_2mortal(data);
+    PUTBACK;
+
+    SV *result = newSV(0);
+    if (SvOK(data)) {
+        AV *key_and_data = newAV();
+        sv_setsv(result, sv_2mortal(newRV_noinc((SV *)key_and_data)));
+        av_push(key_and_data, key_for_data(data));
+        av_push(key_and_data, newSVsv(data));
+    }
+
+    FREETMPS;
+    LEAVE;
+
+    return result;
+}
+
+// Returns a mortal deep copy of the data, so a transform that changes the data
+// it is given can't change the tree. Packed data is already a copy once it is
+// thawed; other data is copied by a Sereal round trip, as packing does.
+static SV *copy_of_data_for_key(MMDBW_tree_s *tree, const char *const key) {
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
+    if (NULL == data || NULL == data->data_sv) {
+        return data_for_key(tree, key);
+    }
+
+    SV *frozen = freeze_sv(data->data_sv);
+    STRLEN size;
+    const char *const bytes = SvPV(frozen, size);
+    SV *copy = sv_2mortal(thaw_sv(bytes, size));
+    SvREFCNT_dec(frozen);
+
+    return copy;
+}
+
+// Points each data record at its mapped data, then trims the records above
+// it the same way insert_record_into_next_node() does.
+static void map_record_data(MMDBW_tree_s *tree,
+                            MMDBW_hash_table_s *mapped_data,
+                            MMDBW_record_s *record,
+                            int current_bit) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_DATA: {
+            mapped_data_s *mapped =
+                hash_table_find(mapped_data, record->value.key);
+            if (NULL == mapped) {
+                croak("Record points to data that does not exist in tree");
+            }
+            const char *const key = record->value.key;
+            if (key == mapped->new_key) {
+                return;
+            }
+            if (NULL == mapped->new_key) {
+                record->type = MMDBW_RECORD_TYPE_EMPTY;
+                record->value.node = NULL;
+            } else {
+                record->value.key = copy_data_key(tree, mapped->new_key);
+            }
+            decrement_data_reference_count(tree, key);
+            return;
+        }
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE: {
+            MMDBW_node_s *node = record->value.node;
+            map_record_data(
+                tree, mapped_data, &(node->left_record), current_bit + 1);
+            map_record_data(
+                tree, mapped_data, &(node->right_record), current_bit + 1);
+            trim_node_record(tree, record);
+            return;
+        }
+        case MMDBW_RECORD_TYPE_PATH: {
+            MMDBW_path_s *path = record->value.path;
+            map_record_data(tree,
+                            mapped_data,
+                            &(path->record),
+                            current_bit + path->length);
+            trim_path_record(tree, record, current_bit);
+            return;
+        }
+        default:
+            return;
     }
 }
 
+static void free_hash_table_on_leave(pTHX_ void *table) {
+    hash_table_free((MMDBW_hash_table_s *)table);
+}
+
 static MMDBW_network_s resolve_network(MMDBW_tree_s *tree,
                                        const char *const ipstr,
                                        uint8_t prefix_length) {
@@ -766,10 +1632,16 @@ insert_record_for_network(MMDBW_tree_s *tree,
         merge_strategy = tree->merge_strategy;
     }
 
+    tree->is_compact = false;
+
+    int start_bit;
+    MMDBW_record_s *start_record =
+        start_record_for_network(tree, network, &start_bit);
+
     return insert_record_into_next_node(tree,
-                                        &(tree->root_record),
+                                        start_record,
                                         network,
-                                        0,
+                                        start_bit,
                                         new_record,
                                         merge_strategy,
                                         is_internal_insert);
@@ -788,7 +1660,8 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
     if (current_bit >= network->prefix_length &&
         (current_record->type == MMDBW_RECORD_TYPE_EMPTY ||
          current_record->type == MMDBW_RECORD_TYPE_DATA ||
-         (current_record->type == MMDBW_RECORD_TYPE_NODE &&
+         ((current_record->type == MMDBW_RECORD_TYPE_NODE ||
+           current_record->type == MMDBW_RECORD_TYPE_PATH) &&
           merge_strategy == MMDBW_MERGE_STRATEGY_NONE))) {
         return insert_record_into_current_record(
             tree, current_record, network, new_record, merge_strategy);
@@ -820,6 +1693,29 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
         return MMDBW_FIXED_NODE_OVERWRITE_ATTEMPT_ERROR;
     }
 
+    if (current_record->type == MMDBW_RECORD_TYPE_PATH) {
+        return insert_record_into_path(tree,
+                                       current_record,
+                                       network,
+                                       current_bit,
+                                       new_record,
+                                       merge_strategy,
+                                       is_internal_insert);
+    }
+
+    // Rather than creating a node for each bit between here and the network,
+    // we create a single path record.
+    if (current_record->type == MMDBW_RECORD_TYPE_EMPTY &&
+        new_record->type == MMDBW_RECORD_TYPE_DATA &&
+        merge_strategy != MMDBW_MERGE_STRATEGY_ADD_ONLY_IF_PARENT_EXISTS) {
+        return insert_record_into_new_path(tree,
+                                           current_record,
+                                           network,
+                                           current_bit,
+                                           new_record,
+                                           merge_strategy);
+    }
+
     // Figure out the next node.
     MMDBW_node_s *next_node = NULL;
     switch (current_record->type) {
@@ -871,6 +1767,9 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
             next_node = current_record->value.node;
             break;
         }
+        case MMDBW_RECORD_TYPE_PATH:
+            // Handled above.
+            return MMDBW_INSERT_INVALID_RECORD_TYPE_ERROR;
     }
 
     // If we are inserting an alias, a fixed node, or a fixed empty record, we
@@ -918,20 +1817,31 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
 
     // We inserted the new record into the right and/or left record of the next
     // node. We now need to trim the tree upwards by merging identical records.
-    // Basically what we do here is take care of the case where the record
-    // we're at points at another node, and the records in that node are both
-    // the same. In that case, we delete the node we point at and take its
-    // value on ourselves.
-
-    if (next_node->left_record.type == next_node->right_record.type &&
-        // We don't allow merging into aliases or fixed nodes
-        current_record->type == MMDBW_RECORD_TYPE_NODE) {
+    trim_node_record(tree, current_record);
+
+    return MMDBW_SUCCESS;
+}
+
+// Called after the records of the node the record points at have changed.
+// Basically what we do here is take care of the case where the record we're
+// at points at another node, and the records in that node are both the same.
+// In that case, we delete the node we point at and take its value on
+// ourselves.
+static void trim_node_record(MMDBW_tree_s *tree,
+                             MMDBW_record_s *current_record) {
+    // We don't allow merging into aliases or fixed nodes
+    if (current_record->type != MMDBW_RECORD_TYPE_NODE) {
+        return;
+    }
+
+    MMDBW_node_s *next_node = current_record->value.node;
+    if (next_node->left_record.type == next_node->right_record.type) {
         switch (next_node->left_record.type) {
             case MMDBW_RECORD_TYPE_EMPTY: {
                 MMDBW_status status =
                     free_node_and_subnodes(tree, next_node, false);
                 if (status != MMDBW_SUCCESS) {
-                    return MMDBW_SUCCESS;
+                    return;
                 }
                 current_record->type = MMDBW_RECORD_TYPE_EMPTY;
                 break;
@@ -943,12 +1853,12 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
                            next_node->right_record.value.key)) {
                     break;
                 }
-                const char *key = increment_data_reference_count(
-                    tree, next_node->left_record.value.key);
+                const char *key =
+                    copy_data_key(tree, next_node->left_record.value.key);
                 MMDBW_status status =
                     free_node_and_subnodes(tree, next_node, false);
                 if (status != MMDBW_SUCCESS) {
-                    return MMDBW_SUCCESS;
+                    return;
                 }
                 current_record->type = MMDBW_RECORD_TYPE_DATA;
                 current_record->value.key = key;
@@ -957,32 +1867,279 @@ insert_record_into_next_node(MMDBW_tree_s *tree,
             case MMDBW_RECORD_TYPE_ALIAS:
             case MMDBW_RECORD_TYPE_FIXED_NODE:
             case MMDBW_RECORD_TYPE_FIXED_EMPTY:
-            case MMDBW_RECORD_TYPE_NODE: {
+            case MMDBW_RECORD_TYPE_NODE:
+            case MMDBW_RECORD_TYPE_PATH: {
                 // Do nothing in these cases. We don't trim immutable nodes.
                 break;
             }
         }
     }
-    return MMDBW_SUCCESS;
+
+    if (current_record->type == MMDBW_RECORD_TYPE_NODE) {
+        join_node_to_next_path(tree, current_record);
+    }
 }
 
 static MMDBW_status
-insert_record_into_current_record(MMDBW_tree_s *tree,
-                                  MMDBW_record_s *current_record,
-                                  MMDBW_network_s *network,
-                                  MMDBW_record_s *new_record,
-                                  MMDBW_merge_strategy merge_strategy) {
-    // We only get called when we have a current_record with these record
-    // types. There was previously logic for other types, but that was
-    // confusing.
-    if (current_record->type != MMDBW_RECORD_TYPE_EMPTY &&
-        current_record->type != MMDBW_RECORD_TYPE_DATA &&
-        current_record->type != MMDBW_RECORD_TYPE_NODE) {
-        return MMDBW_INSERT_INVALID_RECORD_TYPE_ERROR;
+insert_record_into_new_path(MMDBW_tree_s *tree,
+                            MMDBW_record_s *current_record,
+                            MMDBW_network_s *network,
+                            int current_bit,
+                            MMDBW_record_s *new_record,
+                            MMDBW_merge_strategy merge_strategy) {
+    MMDBW_path_s *path = checked_malloc(sizeof(MMDBW_path_s));
+    memcpy(path->bytes, network->bytes, tree->ip_version == 6 ? 16 : 4);
+    path->length = network->prefix_length - current_bit;
+    path->number = 0;
+    path->record.type = MMDBW_RECORD_TYPE_EMPTY;
+
+    MMDBW_status status = insert_record_into_current_record(
+        tree, &(path->record), network, new_record, merge_strategy);
+    if (status != MMDBW_SUCCESS) {
+        free(path);
+        return status;
     }
 
-    if (current_record->type == MMDBW_RECORD_TYPE_EMPTY &&
-        merge_strategy == MMDBW_MERGE_STRATEGY_ADD_ONLY_IF_PARENT_EXISTS) {
+    current_record->type = MMDBW_RECORD_TYPE_PATH;
+    current_record->value.path = path;
+
+    return MMDBW_SUCCESS;
+}
+
+static MMDBW_status insert_record_into_path(MMDBW_tree_s *tree,
+                                            MMDBW_record_s *current_record,
+                                            MMDBW_network_s *network,
+                                            int current_bit,
+                                            MMDBW_record_s *new_record,
+                                            MMDBW_merge_strategy merge_strategy,
+                                            bool is_internal_insert) {
+    MMDBW_path_s *path = current_record->value.path;
+
+    // Fixed records need every node above them to be fixed, so we never
+    // insert them through a path. Splitting it before its first bit turns it
+    // into a node.
+    int bits_in_common = 0;
+    int remaining_bits = network->prefix_length - current_bit;
+    if (remaining_bits > 0 && new_record->type != MMDBW_RECORD_TYPE_ALIAS &&
+        new_record->type != MMDBW_RECORD_TYPE_FIXED_NODE &&
+        new_record->type != MMDBW_RECORD_TYPE_FIXED_EMPTY) {
+        bits_in_common = path_bits_in_common(
+            path,
+            network,
+            current_bit,
+            remaining_bits < path->length ? remaining_bits : path->length);
+    }
+
+    // The network leaves the path or ends partway along it. We split the
+    // path there so that there is a node to insert into.
+    if (bits_in_common < path->length) {
+        split_path(tree, current_record, current_bit, bits_in_common);
+        return insert_record_into_next_node(tree,
+                                            current_record,
+                                            network,
+                                            current_bit,
+                                            new_record,
+                                            merge_strategy,
+                                            is_internal_insert);
+    }
+
+    MMDBW_status status =
+        insert_record_into_next_node(tree,
+                                     &(path->record),
+                                     network,
+                                     current_bit + path->length,
+                                     new_record,
+                                     merge_strategy,
+                                     is_internal_insert);
+    if (status != MMDBW_SUCCESS) {
+        return status;
+    }
+
+    trim_path_record(tree, current_record, current_bit);
+
+    return MMDBW_SUCCESS;
+}
+
+// Called after the record at the end of the path in the record has changed.
+// As with a node whose records are both empty, a path to an empty record is
+// trimmed.
+static void trim_path_record(MMDBW_tree_s *tree,
+                             MMDBW_record_s *current_record,
+                             int current_bit) {
+    MMDBW_path_s *path = current_record->value.path;
+
+    if (path->record.type == MMDBW_RECORD_TYPE_EMPTY) {
+        free_path(tree, path);
+        current_record->type = MMDBW_RECORD_TYPE_EMPTY;
+        current_record->value.node = NULL;
+        return;
+    }
+
+    if (path->record.type == MMDBW_RECORD_TYPE_NODE) {
+        join_path_to_next_node(tree, path, current_bit + path->length);
+    } else if (path->record.type == MMDBW_RECORD_TYPE_PATH) {
+        // The node at the end of the path was joined to the path after it.
+        MMDBW_path_s *next_path = path->record.value.path;
+        memcpy(path->bytes, next_path->bytes, sizeof(path->bytes));
+        path->length += next_path->length;
+        path->record = next_path->record;
+        free_path(tree, next_path);
+    }
+}
+
+// Replaces the path in the record with the first bits of the path, if any,
+// followed by a node where the rest of the path goes one way and the other
+// record is empty.
+static void split_path(MMDBW_tree_s *tree,
+                       MMDBW_record_s *record,
+                       int current_bit,
+                       int bits_before_split) {
+    MMDBW_path_s *path = record->value.path;
+    MMDBW_node_s *node = new_node();
+
+    MMDBW_record_s *rest =
+        path_bit_value(path, current_bit + bits_before_split)
+            ? &(node->right_record)
+            : &(node->left_record);
+    const int rest_length = path->length - bits_before_split - 1;
+
+    if (bits_before_split > 0) {
+        MMDBW_path_s *first = checked_malloc(sizeof(MMDBW_path_s));
+        memcpy(first->bytes, path->bytes, sizeof(first->bytes));
+        first->length = bits_before_split;
+        first->number = 0;
+        first->record.type = MMDBW_RECORD_TYPE_NODE;
+        first->record.value.node = node;
+        record->value.path = first;
+    } else {
+        record->type = MMDBW_RECORD_TYPE_NODE;
+        record->value.node = node;
+    }
+
+    if (rest_length > 0) {
+        path->length = rest_length;
+        rest->type = MMDBW_RECORD_TYPE_PATH;
+        rest->value.path = path;
+    } else {
+        *rest = path->record;
+        free_path(tree, path);
+    }
+}
+
+// If the node at the end of the path has an empty record, the node becomes
+// part of the path. This undoes split_path() once a network inserted beside
+// the path is removed.
+static void join_path_to_next_node(MMDBW_tree_s *tree,
+                                   MMDBW_path_s *path,
+                                   int current_bit) {
+    MMDBW_node_s *node = path->record.value.node;
+
+    MMDBW_record_s *rest;
+    if (node->left_record.type == MMDBW_RECORD_TYPE_EMPTY) {
+        rest = &(node->right_record);
+    } else if (node->right_record.type == MMDBW_RECORD_TYPE_EMPTY) {
+        rest = &(node->left_record);
+    } else {
+        return;
+    }
+
+    if (rest->type == MMDBW_RECORD_TYPE_PATH) {
+        // Every bit of the next path's address up to where it ends is on our
+        // path, so we can take its address as our own.
+        MMDBW_path_s *next_path = rest->value.path;
+        memcpy(path->bytes, next_path->bytes, sizeof(path->bytes));
+        path->length += 1 + next_path->length;
+        path->record = next_path->record;
+        free_path(tree, next_path);
+    } else if (rest->type == MMDBW_RECORD_TYPE_DATA ||
+               rest->type == MMDBW_RECORD_TYPE_NODE) {
+        const uint8_t mask = 1U << (~current_bit & 7);
+        if (rest == &(node->right_record)) {
+            path->bytes[current_bit >> 3] |= mask;
+        } else {
+            path->bytes[current_bit >> 3] &= ~mask;
+        }
+        path->length++;
+        path->record = *rest;
+    } else {
+        return;
+    }
+
+    free_node(tree, node);
+}
+
+// If one record of the node in the record is empty and the other is a path,
+// the record becomes a path that starts one bit earlier.
+static void join_node_to_next_path(MMDBW_tree_s *tree,
+                                   MMDBW_record_s *record) {
+    MMDBW_node_s *node = record->value.node;
+
+    MMDBW_record_s *rest;
+    if (node->left_record.type == MMDBW_RECORD_TYPE_EMPTY &&
+        node->right_record.type == MMDBW_RECORD_TYPE_PATH) {
+        rest = &(node->right_record);
+    } else if (node->right_record.type == MMDBW_RECORD_TYPE_EMPTY &&
+               node->left_record.type == MMDBW_RECORD_TYPE_PATH) {
+        rest = &(node->left_record);
+    } else {
+        return;
+    }
+
+    // The path's address is within the record, so its bit for the node is
+    // already set.
+    MMDBW_path_s *path = rest->value.path;
+    path->length++;
+    record->type = MMDBW_RECORD_TYPE_PATH;
+    record->value.path = path;
+
+    free_node(tree, node);
+}
+
+// Returns the number of bits from current_bit on, up to max_bits, where the
+// network and the path agree.
+static int path_bits_in_common(MMDBW_path_s *path,
+                               MMDBW_network_s *network,
+                               int current_bit,
+                               int max_bits) {
+    int bits = 0;
+    while (bits < max_bits) {
+        int bit = current_bit + bits;
+        if ((bit & 7) == 0 && max_bits - bits >= 8 &&
+            path->bytes[bit >> 3] == network->bytes[bit >> 3]) {
+            bits += 8;
+            continue;
+        }
+        if (path_bit_value(path, bit) != !!network_bit_value(network, bit)) {
+            break;
+        }
+        bits++;
+    }
+
+    return bits;
+}
+
+static int path_bit_value(MMDBW_path_s *path, int bit) {
+    return (path->bytes[bit >> 3] >> (~bit & 7)) & 1;
+}
+
+static MMDBW_status
+insert_record_into_current_record(MMDBW_tree_s *tree,
+                                  MMDBW_record_s *current_record,
+                                  MMDBW_network_s *network,
+                                  MMDBW_record_s *new_record,
+                                  MMDBW_merge_strategy merge_strategy) {
+    // We only get called when we have a current_record with these record
+    // types. There was previously logic for other types, but that was
+    // confusing.
+    if (current_record->type != MMDBW_RECORD_TYPE_EMPTY &&
+        current_record->type != MMDBW_RECORD_TYPE_DATA &&
+        current_record->type != MMDBW_RECORD_TYPE_NODE &&
+        current_record->type != MMDBW_RECORD_TYPE_PATH) {
+        return MMDBW_INSERT_INVALID_RECORD_TYPE_ERROR;
+    }
+
+    if (current_record->type == MMDBW_RECORD_TYPE_EMPTY &&
+        merge_strategy == MMDBW_MERGE_STRATEGY_ADD_ONLY_IF_PARENT_EXISTS) {
         // We do not create a new record when using "only if parent exists"
         return MMDBW_SUCCESS;
     }
@@ -998,7 +2155,7 @@ insert_record_into_current_record(MMDBW_tree_s *tree,
     // Update the record to match the new one. Replace what's there.
     current_record->type = new_record->type;
     if (new_record->type == MMDBW_RECORD_TYPE_DATA) {
-        const char *const key = increment_data_reference_count(
+        const char *const key = copy_data_key(
             tree, merged_key == NULL ? new_record->value.key : merged_key);
         current_record->value.key = key;
     } else if (new_record->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
@@ -1055,6 +2212,11 @@ static const char *maybe_merge_records(MMDBW_tree_s *tree,
         return new_key;
     }
 
+    /* Packed data is inflated into mortal SVs, which we free as soon as we
+       are done merging them. */
+    ENTER;
+    SAVETMPS;
+
     SV *merged = merge_hashes_for_keys(tree,
                                        new_record->value.key,
                                        record_to_set->value.key,
@@ -1069,6 +2231,9 @@ static const char *maybe_merge_records(MMDBW_tree_s *tree,
     /* The ref count was incremented in store_data_in_tree */
     SvREFCNT_dec(merged);
 
+    FREETMPS;
+    LEAVE;
+
     store_in_merge_cache(tree, merge_cache_key, new_key);
 
     return new_key;
@@ -1266,7 +2431,8 @@ SV *lookup_ip_address(MMDBW_tree_s *tree, const char *const ipstr) {
 
     if (record_for_address->type == MMDBW_RECORD_TYPE_NODE ||
         record_for_address->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
-        record_for_address->type == MMDBW_RECORD_TYPE_ALIAS) {
+        record_for_address->type == MMDBW_RECORD_TYPE_ALIAS ||
+        record_for_address->type == MMDBW_RECORD_TYPE_PATH) {
         croak("WTF - found a node or alias record for an address lookup - "
               "%s" PRIu8,
               ipstr);
@@ -1281,14 +2447,34 @@ SV *lookup_ip_address(MMDBW_tree_s *tree, const char *const ipstr) {
     return newSVsv(data_for_key(tree, record_for_address->value.key));
 }
 
+// The record returned for networks that leave a path.
+static MMDBW_record_s empty_record = {.type = MMDBW_RECORD_TYPE_EMPTY};
+
 static MMDBW_status find_record_for_network(MMDBW_tree_s *tree,
                                             MMDBW_network_s *network,
                                             MMDBW_record_s **record) {
-    *record = &(tree->root_record);
+    int start_bit;
+    *record = start_record_for_network(tree, network, &start_bit);
 
-    for (int current_bit = 0; current_bit < network->prefix_length;
+    for (int current_bit = start_bit; current_bit < network->prefix_length;
          current_bit++) {
 
+        if ((*record)->type == MMDBW_RECORD_TYPE_PATH) {
+            MMDBW_path_s *path = (*record)->value.path;
+            // The network ends partway along the path.
+            if (network->prefix_length - current_bit < path->length) {
+                break;
+            }
+            if (path_bits_in_common(path, network, current_bit, path->length) <
+                path->length) {
+                *record = &empty_record;
+                break;
+            }
+            *record = &(path->record);
+            current_bit += path->length - 1;
+            continue;
+        }
+
         MMDBW_node_s *node;
         if ((*record)->type == MMDBW_RECORD_TYPE_NODE ||
             (*record)->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
@@ -1314,7 +2500,7 @@ static MMDBW_node_s *new_node_from_record(MMDBW_tree_s *tree,
     if (record->type == MMDBW_RECORD_TYPE_DATA) {
         /* We only need to increment the reference count once as we are
            replacing the parent record */
-        increment_data_reference_count(tree, record->value.key);
+        copy_data_key(tree, record->value.key);
 
         node->left_record.type = MMDBW_RECORD_TYPE_DATA;
         node->left_record.value.key = record->value.key;
@@ -1350,10 +2536,36 @@ static MMDBW_status free_node_and_subnodes(MMDBW_tree_s *tree,
         return status;
     }
 
-    free(node);
+    free_node(tree, node);
     return MMDBW_SUCCESS;
 }
 
+static void free_node(MMDBW_tree_s *tree, MMDBW_node_s *node) {
+    // Nodes copied from the skeleton are freed as a single block along with
+    // the tree, as are nodes moved by compact_tree().
+    if (is_fixed_node(tree, node) ||
+        (node >= tree->compact_nodes &&
+         node < tree->compact_nodes + tree->compact_node_count)) {
+        return;
+    }
+
+    free(node);
+}
+
+static bool is_fixed_node(MMDBW_tree_s *tree, MMDBW_node_s *node) {
+    return node >= tree->fixed_nodes &&
+           node < tree->fixed_nodes + tree->fixed_node_count;
+}
+
+static void free_path(MMDBW_tree_s *tree, MMDBW_path_s *path) {
+    if (path >= tree->compact_paths &&
+        path < tree->compact_paths + tree->compact_path_count) {
+        return;
+    }
+
+    free(path);
+}
+
 static MMDBW_status free_record_value(MMDBW_tree_s *tree,
                                       MMDBW_record_s *record,
                                       bool remove_alias_and_fixed_nodes) {
@@ -1373,6 +2585,14 @@ static MMDBW_status free_record_value(MMDBW_tree_s *tree,
             tree, record->value.node, remove_alias_and_fixed_nodes);
     }
 
+    if (record->type == MMDBW_RECORD_TYPE_PATH) {
+        MMDBW_path_s *path = record->value.path;
+        MMDBW_status status = free_record_value(
+            tree, &(path->record), remove_alias_and_fixed_nodes);
+        free_path(tree, path);
+        return status;
+    }
+
     if (record->type == MMDBW_RECORD_TYPE_DATA) {
         decrement_data_reference_count(tree, record->value.key);
     }
@@ -1401,6 +2621,79 @@ static void assign_node_number(MMDBW_tree_s *tree,
     return;
 }
 
+// Nodes and paths are allocated one at a time as networks are inserted, so
+// after a large number of inserts and removals they are scattered across the
+// heap. This moves them into two blocks in the order that the tree is
+// iterated, which turns writing the tree into a mostly sequential scan of
+// memory. Nodes copied from the skeleton stay where they are, as alias
+// records point at them.
+void compact_tree(MMDBW_tree_s *tree) {
+    if (tree->is_compact) {
+        return;
+    }
+
+    compact_args_s args = {0};
+    count_records_to_compact(tree, &(tree->root_record), &args);
+
+    args.nodes = args.node_count
+                     ? checked_malloc(args.node_count * sizeof(MMDBW_node_s))
+                     : NULL;
+    args.paths = args.path_count
+                     ? checked_malloc(args.path_count * sizeof(MMDBW_path_s))
+                     : NULL;
+    args.node_count = args.path_count = 0;
+
+    compact_record(tree, &(tree->root_record), &args);
+
+    free(tree->compact_nodes);
+    free(tree->compact_paths);
+    tree->compact_nodes = args.nodes;
+    tree->compact_node_count = args.node_count;
+    tree->compact_paths = args.paths;
+    tree->compact_path_count = args.path_count;
+    tree->is_compact = true;
+}
+
+static void count_records_to_compact(MMDBW_tree_s *tree,
+                                     MMDBW_record_s *record,
+                                     compact_args_s *args) {
+    if (record->type == MMDBW_RECORD_TYPE_NODE ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        MMDBW_node_s *node = record->value.node;
+        if (!is_fixed_node(tree, node)) {
+            args->node_count++;
+        }
+        count_records_to_compact(tree, &(node->left_record), args);
+        count_records_to_compact(tree, &(node->right_record), args);
+    } else if (record->type == MMDBW_RECORD_TYPE_PATH) {
+        args->path_count++;
+        count_records_to_compact(tree, &(record->value.path->record), args);
+    }
+}
+
+static void compact_record(MMDBW_tree_s *tree,
+                           MMDBW_record_s *record,
+                           compact_args_s *args) {
+    if (record->type == MMDBW_RECORD_TYPE_NODE ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        MMDBW_node_s *node = record->value.node;
+        if (!is_fixed_node(tree, node)) {
+            MMDBW_node_s *moved = &(args->nodes[args->node_count++]);
+            *moved = *node;
+            free_node(tree, node);
+            record->value.node = node = moved;
+        }
+        compact_record(tree, &(node->left_record), args);
+        compact_record(tree, &(node->right_record), args);
+    } else if (record->type == MMDBW_RECORD_TYPE_PATH) {
+        MMDBW_path_s *moved = &(args->paths[args->path_count++]);
+        *moved = *(record->value.path);
+        free_path(tree, record->value.path);
+        record->value.path = moved;
+        compact_record(tree, &(moved->record), args);
+    }
+}
+
 /* 16 bytes for an IP address, 1 byte for the prefix length */
 #define FROZEN_RECORD_MAX_SIZE (16 + 1 + SHA1_KEY_LENGTH)
 #define FROZEN_NODE_MAX_SIZE (FROZEN_RECORD_MAX_SIZE * 2)
@@ -1422,6 +2715,10 @@ void freeze_tree(MMDBW_tree_s *tree,
         croak("Could not open file %s: %s", filename, strerror(errno));
     }
 
+    if (tree->mark_and_sweep_data) {
+        sweep_data(tree);
+    }
+
     freeze_args_s args = {
         .file = file,
         .filename = filename,
@@ -1453,7 +2750,8 @@ static void freeze_search_tree(MMDBW_tree_s *tree, freeze_args_s *args) {
     }
 
     if (tree->root_record.type == MMDBW_RECORD_TYPE_NODE ||
-        tree->root_record.type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+        tree->root_record.type == MMDBW_RECORD_TYPE_FIXED_NODE ||
+        tree->root_record.type == MMDBW_RECORD_TYPE_PATH) {
         start_iteration(tree, false, (void *)args, &freeze_node);
         return;
     }
@@ -1502,38 +2800,42 @@ static void freeze_to_file(freeze_args_s *args, void *data, size_t size) {
     checked_fwrite(args->file, args->filename, data, size);
 }
 
+// Each value is frozen as a separate Sereal document, so only one value is
+// inflated at a time. The values of a tree that packs its data are already
+// frozen and are written as they are.
 static void freeze_data_to_file(freeze_args_s *args, MMDBW_tree_s *tree) {
-    HV *data_hash = newHV();
+    STRLEN count = tree->data_table.count;
+    freeze_to_file(args, &count, sizeof(STRLEN));
+
+    MMDBW_data_hash_s *item;
+    size_t position = 0;
+    while (NULL != (item = hash_table_next(&(tree->data_table), &position))) {
+        freeze_to_file(args, item->key, SHA1_KEY_LENGTH);
+
+        if (NULL != item->packed_data) {
+            STRLEN size = item->packed_data_size;
+            freeze_to_file(args, &size, sizeof(STRLEN));
+            freeze_to_file(args, item->packed_data, size);
+            continue;
+        }
 
-    MMDBW_data_hash_s *item, *tmp;
-    HASH_ITER(hh, tree->data_table, item, tmp) {
-        SvREFCNT_inc_simple_void_NN(item->data_sv);
-        (void)hv_store(data_hash, item->key, SHA1_KEY_LENGTH, item->data_sv, 0);
+        SV *frozen = freeze_sv(item->data_sv);
+        STRLEN size;
+        char *frozen_chars = SvPV(frozen, size);
+        freeze_to_file(args, &size, sizeof(STRLEN));
+        freeze_to_file(args, frozen_chars, size);
+        SvREFCNT_dec(frozen);
     }
-
-    SV *frozen_data = freeze_hash(data_hash);
-    STRLEN frozen_data_size;
-    char *frozen_data_chars = SvPV(frozen_data, frozen_data_size);
-
-    checked_fwrite(
-        args->file, args->filename, &frozen_data_size, sizeof(STRLEN));
-    checked_fwrite(
-        args->file, args->filename, frozen_data_chars, frozen_data_size);
-
-    SvREFCNT_dec(frozen_data);
-    SvREFCNT_dec((SV *)data_hash);
 }
 
-static SV *freeze_hash(HV *hash) {
+static SV *freeze_sv(SV *sv) {
     dSP;
     ENTER;
     SAVETMPS;
 
-    SV *hashref = sv_2mortal(newRV_inc((SV *)hash));
-
     PUSHMARK(SP);
     EXTEND(SP, 1);
-    PUSHs(hashref);
+    PUSHs(sv);
     PUTBACK;
 
     int count = call_pv("Sereal::Encoder::encode_sereal", G_SCALAR);
@@ -1567,7 +2869,10 @@ MMDBW_tree_s *thaw_tree(char *filename,
                         uint8_t record_size,
                         MMDBW_merge_strategy merge_strategy,
                         const bool alias_ipv6,
-                        const bool remove_reserved_networks) {
+                        const bool remove_reserved_networks,
+                        const bool pack_data,
+                        const bool mark_and_sweep_data,
+                        SV *data_encoder) {
 #ifdef WIN32
     int fd = open(filename, O_RDONLY);
 #else
@@ -1593,10 +2898,23 @@ MMDBW_tree_s *thaw_tree(char *filename,
                                   record_size,
                                   merge_strategy,
                                   alias_ipv6,
-                                  remove_reserved_networks);
+                                  remove_reserved_networks,
+                                  pack_data,
+                                  mark_and_sweep_data,
+                                  data_encoder);
 
     thawed_network_s *thawed;
     while (NULL != (thawed = thaw_network(tree, &buffer))) {
+        // The record must use the data table's copy of the key, as inserts
+        // do not look it up when the tree uses mark and sweep.
+        const char *key = NULL;
+        if (thawed->record->type == MMDBW_RECORD_TYPE_DATA) {
+            key = increment_data_reference_count(tree,
+                                                 thawed->record->value.key);
+            free((char *)thawed->record->value.key);
+            thawed->record->value.key = key;
+        }
+
         // We should never need to merge when thawing a tree.
         MMDBW_status status =
             insert_record_for_network(tree,
@@ -1604,11 +2922,11 @@ MMDBW_tree_s *thaw_tree(char *filename,
                                       thawed->record,
                                       MMDBW_MERGE_STRATEGY_NONE,
                                       true);
+        if (NULL != key) {
+            decrement_data_reference_count(tree, key);
+        }
         free_network(thawed->network);
         free(thawed->network);
-        if (thawed->record->type == MMDBW_RECORD_TYPE_DATA) {
-            free((char *)thawed->record->value.key);
-        }
         free(thawed->record);
         free(thawed);
         if (status != MMDBW_SUCCESS) {
@@ -1616,23 +2934,38 @@ MMDBW_tree_s *thaw_tree(char *filename,
         }
     }
 
-    STRLEN frozen_data_size = thaw_strlen(&buffer);
+    STRLEN data_count = thaw_strlen(&buffer);
+    for (STRLEN i = 0; i < data_count; i++) {
+        const char *const key = (const char *)buffer;
+        buffer += SHA1_KEY_LENGTH;
+        STRLEN frozen_size = thaw_strlen(&buffer);
+        thaw_data_into_tree(tree, key, (const char *)buffer, frozen_size);
+        buffer += frozen_size;
+    }
 
-    /* per perlapi newSVpvn copies the string */
-    SV *data_to_decode = sv_2mortal(newSVpvn((char *)buffer, frozen_data_size));
-    HV *data_hash = thaw_data_hash(data_to_decode);
+    return tree;
+}
 
-    hv_iterinit(data_hash);
-    char *key;
-    I32 keylen;
-    SV *value;
-    while (NULL != (value = hv_iternextsv(data_hash, &key, &keylen))) {
-        set_stored_data_in_tree(tree, key, value);
+// A tree that packs its data keeps the frozen value as it is, unless it also
+// encodes its data as it is stored, which needs the thawed value.
+static void thaw_data_into_tree(MMDBW_tree_s *tree,
+                                const char *const key,
+                                const char *const frozen,
+                                STRLEN frozen_size) {
+    if (tree->pack_data && NULL == tree->data_encoder) {
+        MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
+        if (NULL == data) {
+            croak("Attempt to set unknown data record in tree");
+        }
+        data->packed_data = checked_malloc(frozen_size);
+        memcpy(data->packed_data, frozen, frozen_size);
+        data->packed_data_size = frozen_size;
+        return;
     }
 
-    SvREFCNT_dec((SV *)data_hash);
-
-    return tree;
+    SV *data_sv = thaw_sv(frozen, frozen_size);
+    set_stored_data_in_tree(tree, key, data_sv);
+    SvREFCNT_dec(data_sv);
 }
 
 static uint8_t thaw_uint8(uint8_t **buffer) {
@@ -1725,14 +3058,14 @@ static const char *thaw_data_key(uint8_t **buffer) {
     return (const char *)value;
 }
 
-static HV *thaw_data_hash(SV *data_to_decode) {
+static SV *thaw_sv(const char *const frozen, STRLEN frozen_size) {
     dSP;
     ENTER;
     SAVETMPS;
 
     PUSHMARK(SP);
     EXTEND(SP, 1);
-    PUSHs(data_to_decode);
+    mPUSHp(frozen, frozen_size);
     PUTBACK;
 
     int count = call_pv("Sereal::Decoder::decode_sereal", G_SCALAR);
@@ -1743,26 +3076,35 @@ static HV *thaw_data_hash(SV *data_to_decode) {
         croak("Expected 1 item back from Sereal::Decoder::decode_sereal call");
     }
 
-    SV *thawed = POPs;
-    if (!SvROK(thawed)) {
-        croak("The Sereal::Decoder::decode_sereal sub returned an SV which is "
-              "not SvROK!");
-    }
-
-    SV *data_hash = SvREFCNT_inc_simple_NN(SvRV(thawed));
+    SV *thawed = newSVsv(POPs);
 
     PUTBACK;
     FREETMPS;
     LEAVE;
 
-    return (HV *)data_hash;
+    return thawed;
 }
 
 void write_search_tree(MMDBW_tree_s *tree,
                        SV *output,
                        SV *root_data_type,
-                       SV *serializer) {
-    assign_node_numbers(tree);
+                       SV *serializer,
+                       const bool optimize_pointer_sizes,
+                       const bool order_data_by_frequency,
+                       const bool blocked_node_layout,
+                       SV *previous_database,
+                       const double verify_sample_rate,
+                       SV *data_encoder) {
+    if (tree->mark_and_sweep_data) {
+        sweep_data(tree);
+    }
+    compact_tree(tree);
+    if (blocked_node_layout) {
+        tree->node_count = 0;
+        start_blocked_iteration(tree, (void *)NULL, &assign_node_number);
+    } else {
+        assign_node_numbers(tree);
+    }
 
     /* This is a gross way to get around the fact that with C function
      * pointers we can't easily pass different params to different
@@ -1770,9 +3112,37 @@ void write_search_tree(MMDBW_tree_s *tree,
     encode_args_s args = {.output_io = IoOFP(sv_2io(output)),
                           .root_data_type = root_data_type,
                           .serializer = serializer,
+                          .serializer_buffer = NULL,
                           .data_pointer_cache = newHV()};
 
-    start_iteration(tree, false, (void *)&args, &encode_node);
+    if (NULL != tree->data_encoder) {
+        args.serializer_buffer = serializer_buffer(serializer);
+    }
+
+    // Eagerly serialized data is never encoded with pointers, so there is
+    // nothing to gain from this for such trees.
+    if (optimize_pointer_sizes && NULL == tree->data_encoder) {
+        store_shared_data(tree, &args);
+    }
+
+    if (SvOK(previous_database)) {
+        store_data_in_previous_order(
+            tree, &args, SvPV_nolen(previous_database), data_encoder);
+    }
+
+    if (order_data_by_frequency) {
+        store_data_by_frequency(tree, &args);
+    }
+
+    if (blocked_node_layout) {
+        start_blocked_iteration(tree, (void *)&args, &encode_node);
+    } else {
+        start_iteration(tree, false, (void *)&args, &encode_node);
+    }
+
+    if (verify_sample_rate > 0) {
+        verify_data_section(tree, &args, data_encoder, verify_sample_rate);
+    }
 
     /* When the hash is _freed_, Perl decrements the ref count for each value
      * so we don't need to mess with them. */
@@ -1781,6 +3151,215 @@ void write_search_tree(MMDBW_tree_s *tree,
     return;
 }
 
+// Writes the search tree of an IPv4 database from the ::/96 subtree of an
+// IPv6 tree, without copying the tree. The subtree is written as if it were
+// the whole of an IPv4 tree, with a data table of its own that holds only the
+// data of the IPv4 networks. Returns the node count of the IPv4 search tree.
+//
+// This is not read-only for the IPv6 tree. Like write_tree(), it sweeps and
+// compacts the tree first. The nodes and paths below ::/96 are then numbered
+// for the IPv4 tree, so the IPv6 tree's own numbering is no longer valid.
+// Anything that needs it, such as iterating or writing the IPv6 tree or its
+// node count, numbers the nodes again first.
+uint32_t write_ipv4_search_tree(MMDBW_tree_s *tree,
+                                SV *output,
+                                SV *root_data_type,
+                                SV *serializer,
+                                const bool optimize_pointer_sizes,
+                                const bool order_data_by_frequency,
+                                const bool blocked_node_layout,
+                                const double verify_sample_rate,
+                                SV *data_encoder) {
+    if (tree->ip_version != 6) {
+        croak("Only an IPv6 tree has an IPv4 subtree to write");
+    }
+
+    // These are done for the whole tree first. Sweeping only the IPv4 tree
+    // would free the data of the IPv6 networks, and compacting it would free
+    // the nodes outside of it.
+    if (tree->mark_and_sweep_data) {
+        sweep_data(tree);
+    }
+    compact_tree(tree);
+
+    MMDBW_record_s rest_record;
+    MMDBW_path_s rest_path;
+    MMDBW_record_s *record =
+        ipv4_subtree_record(tree, &rest_record, &rest_path);
+    if (NULL == record || (MMDBW_RECORD_TYPE_NODE != record->type &&
+                           MMDBW_RECORD_TYPE_FIXED_NODE != record->type &&
+                           MMDBW_RECORD_TYPE_PATH != record->type)) {
+        croak("The tree has no IPv4 networks to write");
+    }
+
+    MMDBW_tree_s ipv4_tree = *tree;
+    ipv4_tree.ip_version = 4;
+    ipv4_tree.root_record = *record;
+    ipv4_tree.ipv4_root_record = NULL;
+    ipv4_tree.mark_and_sweep_data = false;
+    ipv4_tree.is_compact = true;
+
+    ENTER;
+    // The data table is walked to store shared data, to order the data by
+    // frequency and to verify it, and the IPv6 tree's table would bring the
+    // data of the IPv6 networks into the IPv4 database.
+    hash_table_init(&(ipv4_tree.data_table), SHA1_KEY_LENGTH);
+    SAVEDESTRUCTOR_X(free_ipv4_data_table_on_leave, &(ipv4_tree.data_table));
+    add_ipv4_data(tree, &(ipv4_tree.data_table), record);
+
+    set_ipv4_path_bytes(record, true);
+    SAVEDESTRUCTOR_X(reset_ipv4_path_bytes_on_leave, record);
+
+    write_search_tree(&ipv4_tree,
+                      output,
+                      root_data_type,
+                      serializer,
+                      optimize_pointer_sizes,
+                      order_data_by_frequency,
+                      blocked_node_layout,
+                      &PL_sv_undef,
+                      verify_sample_rate,
+                      data_encoder);
+
+    LEAVE;
+
+    return ipv4_tree.node_count;
+}
+
+// Returns the record for ::/96, or NULL if the tree has nothing there. If a
+// path runs through ::/96, the tree has no record there, so the rest of the
+// path is copied into rest_path and rest_record is returned pointing at it.
+// The copy shares the record at the end of the path, and the tree is not
+// changed.
+static MMDBW_record_s *ipv4_subtree_record(MMDBW_tree_s *tree,
+                                           MMDBW_record_s *rest_record,
+                                           MMDBW_path_s *rest_path) {
+    if (NULL != tree->ipv4_root_record) {
+        return tree->ipv4_root_record;
+    }
+
+    MMDBW_record_s *record = &tree->root_record;
+    int current_bit = 0;
+    while (current_bit < 96) {
+        if (MMDBW_RECORD_TYPE_NODE == record->type ||
+            MMDBW_RECORD_TYPE_FIXED_NODE == record->type) {
+            record = &(record->value.node->left_record);
+            current_bit++;
+            continue;
+        }
+        if (MMDBW_RECORD_TYPE_PATH != record->type) {
+            // The record covers all of ::/96.
+            return record;
+        }
+
+        MMDBW_path_s *path = record->value.path;
+        int end_bit = current_bit + path->length;
+        for (int bit = current_bit; bit < 96 && bit < end_bit; bit++) {
+            if (path_bit_value(path, bit)) {
+                // The path leads away from ::/96, so it has no networks.
+                return NULL;
+            }
+        }
+        if (end_bit > 96) {
+            *rest_path = *path;
+            rest_path->length = end_bit - 96;
+            rest_path->number = 0;
+            rest_record->type = MMDBW_RECORD_TYPE_PATH;
+            rest_record->value.path = rest_path;
+            return rest_record;
+        }
+        record = &(path->record);
+        current_bit = end_bit;
+    }
+
+    return record;
+}
+
+// A path keeps the address of the network at its end, and its bits are read
+// by their depth from the root, which is 96 less in the IPv4 tree than in the
+// IPv6 one. For the write, the IPv4 address in the last four bytes of each
+// path below ::/96 is copied to the first four. Only the bits after ::/96 are
+// read for these paths in the IPv6 tree, and those bytes are all zero for the
+// addresses in it, so they are zeroed again afterwards.
+static void set_ipv4_path_bytes(MMDBW_record_s *record, const bool for_ipv4) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            set_ipv4_path_bytes(&(record->value.node->left_record), for_ipv4);
+            set_ipv4_path_bytes(&(record->value.node->right_record), for_ipv4);
+            break;
+        case MMDBW_RECORD_TYPE_PATH: {
+            MMDBW_path_s *path = record->value.path;
+            if (for_ipv4) {
+                memcpy(path->bytes, &(path->bytes[12]), 4);
+            } else {
+                memset(path->bytes, 0, 4);
+            }
+            set_ipv4_path_bytes(&(path->record), for_ipv4);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void reset_ipv4_path_bytes_on_leave(pTHX_ void *record) {
+    set_ipv4_path_bytes((MMDBW_record_s *)record, false);
+}
+
+// Adds the data of the records below the record to the IPv4 data table. The
+// entries are copies of the IPv6 tree's entries that share their data, so
+// they are freed without it. Their reference counts are those of the IPv4
+// records alone.
+static void add_ipv4_data(MMDBW_tree_s *tree,
+                          MMDBW_hash_table_s *ipv4_data_table,
+                          MMDBW_record_s *record) {
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE:
+            add_ipv4_data(
+                tree, ipv4_data_table, &(record->value.node->left_record));
+            add_ipv4_data(
+                tree, ipv4_data_table, &(record->value.node->right_record));
+            break;
+        case MMDBW_RECORD_TYPE_PATH:
+            add_ipv4_data(
+                tree, ipv4_data_table, &(record->value.path->record));
+            break;
+        case MMDBW_RECORD_TYPE_DATA: {
+            MMDBW_data_hash_s *data =
+                hash_table_find(ipv4_data_table, record->value.key);
+            if (NULL == data) {
+                MMDBW_data_hash_s *ipv6_data =
+                    hash_table_find(&(tree->data_table), record->value.key);
+                if (NULL == ipv6_data) {
+                    croak("Record points to data that does not exist in "
+                          "tree");
+                }
+                data = checked_malloc(sizeof(MMDBW_data_hash_s));
+                *data = *ipv6_data;
+                data->reference_count = 0;
+                hash_table_insert(ipv4_data_table, data->key, data);
+            }
+            data->reference_count++;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void free_ipv4_data_table_on_leave(pTHX_ void *table) {
+    MMDBW_hash_table_s *data_table = (MMDBW_hash_table_s *)table;
+
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    while (NULL != (data = hash_table_next(data_table, &position))) {
+        free(data);
+    }
+    hash_table_free(data_table);
+}
+
 static void encode_node(MMDBW_tree_s *tree,
                         MMDBW_node_s *node,
                         uint128_t UNUSED(network),
@@ -1888,76 +3467,1108 @@ static uint32_t record_value_as_number(MMDBW_tree_s *tree,
             record_value = record->value.node->number;
             break;
         }
+        case MMDBW_RECORD_TYPE_PATH: {
+            record_value = record->value.path->number;
+            break;
+        }
         case MMDBW_RECORD_TYPE_DATA: {
-            SV **cache_record = hv_fetch(args->data_pointer_cache,
-                                         record->value.key,
-                                         SHA1_KEY_LENGTH,
-                                         0);
-            if (cache_record) {
-                /* It is ok to return this without the size check below as it
-                   would have already croaked when it was inserted if it was too
-                   big. */
-                return SvIV(*cache_record);
-            }
+            /* The value is checked against the record size when the data is
+               stored. */
+            return store_data_record(tree, record->value.key, args);
+        }
+    }
 
-            SV *data = newSVsv(data_for_key(tree, record->value.key));
-            if (!SvOK(data)) {
-                croak("No data associated with key - %s", record->value.key);
-            }
+    check_record_value(tree, record_value);
 
-            dSP;
-            ENTER;
-            SAVETMPS;
+    return record_value;
+}
 
-            PUSHMARK(SP);
-            EXTEND(SP, 5);
-            PUSHs(args->serializer);
-            PUSHs(args->root_data_type);
-            mPUSHs(data);
-            PUSHs(&PL_sv_undef);
-            mPUSHp(record->value.key, strlen(record->value.key));
-            PUTBACK;
+// Lets the serializer store the parts of the data that are shared between
+// values before anything else, so that they are at the start of the data
+// section where pointers to them are smallest.
+//
+// The serializer counts the values in batches. The values of a tree that
+// packs its data are thawed to be counted, so each batch is freed before
+// the next one is thawed.
+static void store_shared_data(MMDBW_tree_s *tree, encode_args_s *args) {
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    bool more = true;
+    while (more) {
+        ENTER;
+        SAVETMPS;
+
+        AV *values = (AV *)sv_2mortal((SV *)newAV());
+        while (av_top_index(values) + 1 < SHARED_DATA_BATCH_SIZE) {
+            data = hash_table_next(&(tree->data_table), &position);
+            if (NULL == data) {
+                more = false;
+                break;
+            }
+            av_push(values, newSVsv(data_for_key(tree, data->key)));
+        }
 
-            int count = call_method("store_data", G_SCALAR);
+        if (av_top_index(values) >= 0) {
+            call_serializer_with_values(args, "count_shared_values", values);
+        }
 
-            SPAGAIN;
+        FREETMPS;
+        LEAVE;
+    }
 
-            if (count != 1) {
-                croak("Expected 1 item back from ->store_data() call");
-            }
+    call_serializer_with_values(args, "store_shared_values", NULL);
+}
 
-            SV *rval = POPs;
-            if (!(SvIOK(rval) || SvUOK(rval))) {
-                croak("The serializer's store_data() method returned an SV "
-                      "which is not SvIOK or SvUOK!");
-            }
-            uint32_t position = (uint32_t)SvUV(rval);
+// Calls a method of the serializer with the root data type and an array
+// reference to the values, or with no arguments when values is NULL.
+static void call_serializer_with_values(encode_args_s *args,
+                                        const char *const method,
+                                        AV *values) {
+    dSP;
+    ENTER;
+    SAVETMPS;
 
-            PUTBACK;
-            FREETMPS;
-            LEAVE;
+    PUSHMARK(SP);
+    EXTEND(SP, 3);
+    PUSHs(args->serializer);
+    if (NULL != values) {
+        PUSHs(args->root_data_type);
+        mPUSHs(newRV_inc((SV *)values));
+    }
+    PUTBACK;
 
-            record_value =
-                position + tree->node_count + DATA_SECTION_SEPARATOR_SIZE;
+    call_method(method, G_DISCARD);
 
-            SV *value = newSViv(record_value);
-            (void)hv_store(args->data_pointer_cache,
-                           record->value.key,
-                           SHA1_KEY_LENGTH,
-                           value,
-                           0);
-            break;
+    FREETMPS;
+    LEAVE;
+}
+
+// Stores the data that is also in the previous database first, in the order
+// it has there. A value stored again in the same order with the same values
+// before it has the same encoding at the same offset, so a binary delta
+// between the two databases grows with what changed rather than with the
+// size of the data section. New data is stored after it, as the tree is
+// walked.
+//
+// Data is matched by a hash of its encoding, with the database's pointers
+// followed, so data does not need to have the same Perl representation in
+// both builds. A value that matches nothing in the tree is dropped.
+static void store_data_in_previous_order(MMDBW_tree_s *tree,
+                                         encode_args_s *args,
+                                         const char *const filename,
+                                         SV *data_encoder) {
+    ENTER;
+    SAVETMPS;
+
+    HV *keys_by_content = data_keys_by_content(tree, data_encoder);
+
+    previous_order_s previous = {.filename = filename};
+    open_mmdb(&previous.mmdb, filename);
+
+    // This unmaps the database on LEAVE, including when we croak.
+    SAVEDESTRUCTOR_X(close_mmdb_on_leave, &previous.mmdb);
+
+    Newxz(previous.reached_nodes, previous.mmdb.node_count / 8 + 1, uint8_t);
+    SAVEFREEPV(previous.reached_nodes);
+    Newxz(previous.data_offsets,
+          previous.mmdb.data_section_size / 8 + 1,
+          uint8_t);
+    SAVEFREEPV(previous.data_offsets);
+
+    mmdb_section_s data_section = {
+        .filename = filename,
+        .name = "data section",
+        .bytes = previous.mmdb.data_section,
+        .size = previous.mmdb.data_section_size,
+    };
+
+    mark_previous_data_offsets(&previous, 0, 0);
+
+    for (size_t offset = 0; offset < previous.mmdb.data_section_size;
+         offset++) {
+        if (!(previous.data_offsets[offset >> 3] & (1 << (offset & 7)))) {
+            continue;
+        }
+
+        ENTER;
+        SAVETMPS;
+
+        SV *expanded = sv_2mortal(newSVpvs(""));
+        expand_data(&data_section, offset, expanded, 0);
+        const uint64_t hash = content_hash(expanded);
+
+        SV **key =
+            hv_fetch(keys_by_content, (const char *)&hash, sizeof(hash), 0);
+        if (NULL != key) {
+            store_data_record(tree, SvPVX(*key), args);
+        }
+
+        FREETMPS;
+        LEAVE;
+    }
+
+    FREETMPS;
+    LEAVE;
+}
+
+// Returns a mortal HV mapping the content hash of each value in the data
+// table to its key.
+static HV *data_keys_by_content(MMDBW_tree_s *tree, SV *data_encoder) {
+    HV *keys_by_content = (HV *)sv_2mortal((SV *)newHV());
+
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    while (NULL != (data = hash_table_next(&(tree->data_table), &position))) {
+        const uint64_t hash = data_content_hash(tree, data->key, data_encoder);
+        (void)hv_store(keys_by_content,
+                       (const char *)&hash,
+                       sizeof(hash),
+                       newSVpvn(data->key, SHA1_KEY_LENGTH),
+                       0);
+    }
+
+    return keys_by_content;
+}
+
+// The depth is the number of bits of the address used to reach the node.
+static void mark_previous_data_offsets(previous_order_s *previous,
+                                       uint32_t node,
+                                       int depth) {
+    const MMDBW_mmdb_s *const mmdb = &previous->mmdb;
+
+    const uint8_t bit = 1 << (node & 7);
+    if (previous->reached_nodes[node >> 3] & bit) {
+        return;
+    }
+    previous->reached_nodes[node >> 3] |= bit;
+
+    for (int right = 0; right <= 1; right++) {
+        const uint32_t value = mmdb_record_value(mmdb, node, right);
+
+        if (value < mmdb->node_count) {
+            if (depth + 1 >= (mmdb->ip_version == 6 ? 128 : 32)) {
+                croak("The search tree in %s is deeper than its IP version "
+                      "allows",
+                      previous->filename);
+            }
+            mark_previous_data_offsets(previous, value, depth + 1);
+            continue;
+        }
+        if (value == mmdb->node_count) {
+            continue;
+        }
+
+        const uint64_t offset = (uint64_t)value - mmdb->node_count -
+                                DATA_SECTION_SEPARATOR_SIZE;
+        if (value - mmdb->node_count < DATA_SECTION_SEPARATOR_SIZE ||
+            offset >= mmdb->data_section_size) {
+            croak("The database %s has an invalid record value (%" PRIu32
+                  ")",
+                  previous->filename,
+                  value);
+        }
+        previous->data_offsets[offset >> 3] |= 1 << (offset & 7);
+    }
+}
+
+// Stores the data in the order of how many records refer to it, most first,
+// before the search tree is walked. Readers touch the data of the most common
+// records far more often, so this keeps the hot part of the data section (and
+// the sub-structures stored along with it) on as few pages as possible.
+static void store_data_by_frequency(MMDBW_tree_s *tree, encode_args_s *args) {
+    size_t count = tree->data_table.count;
+    if (0 == count) {
+        return;
+    }
+
+    MMDBW_data_hash_s **data = checked_malloc(count * sizeof(*data));
+
+    size_t i = 0;
+    MMDBW_data_hash_s *entry;
+    size_t position = 0;
+    while (NULL != (entry = hash_table_next(&(tree->data_table), &position))) {
+        data[i++] = entry;
+    }
+
+    qsort(data, count, sizeof(*data), compare_data_by_frequency);
+
+    for (i = 0; i < count; i++) {
+        store_data_record(tree, data[i]->key, args);
+    }
+
+    free(data);
+}
+
+static int compare_data_by_frequency(const void *a, const void *b) {
+    const MMDBW_data_hash_s *const data_a = *(MMDBW_data_hash_s *const *)a;
+    const MMDBW_data_hash_s *const data_b = *(MMDBW_data_hash_s *const *)b;
+
+    if (data_a->reference_count != data_b->reference_count) {
+        return data_a->reference_count > data_b->reference_count ? -1 : 1;
+    }
+
+    // Fall back to the key so that the output does not depend on the order
+    // of the hash.
+    return strcmp(data_a->key, data_b->key);
+}
+
+static uint32_t store_data_record(MMDBW_tree_s *tree,
+                                  const char *const key,
+                                  encode_args_s *args) {
+    SV **cache_record =
+        hv_fetch(args->data_pointer_cache, key, SHA1_KEY_LENGTH, 0);
+    if (cache_record) {
+        /* It is ok to return this without the size check below as it would
+           have already croaked when it was inserted if it was too big. */
+        return SvIV(*cache_record);
+    }
+
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
+
+    uint32_t position = NULL != data && NULL != data->encoded_data
+                            ? append_encoded_data(args, data)
+                            : store_data_with_serializer(tree, key, args);
+
+    uint32_t record_value =
+        position + tree->node_count + DATA_SECTION_SEPARATOR_SIZE;
+    check_record_value(tree, record_value);
+
+    SV *value = newSViv(record_value);
+    (void)hv_store(args->data_pointer_cache, key, SHA1_KEY_LENGTH, value, 0);
+
+    return record_value;
+}
+
+static SV *serializer_buffer(SV *serializer) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    XPUSHs(serializer);
+    PUTBACK;
+
+    int count = call_method("buffer", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from ->buffer() call");
+    }
+
+    SV *buffer_ref = POPs;
+    if (!SvROK(buffer_ref)) {
+        croak("The serializer's buffer() method did not return a reference");
+    }
+    SV *buffer = SvRV(buffer_ref);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    /* The serializer holds on to the buffer for as long as we write. */
+    return buffer;
+}
+
+// The position is the buffer's length in bytes, which is what the Perl
+// serializer uses for the values it stores itself.
+static uint32_t append_encoded_data(encode_args_s *args,
+                                    MMDBW_data_hash_s *data) {
+    SV *buffer = args->serializer_buffer;
+    if (!SvOK(buffer)) {
+        sv_setpvs(buffer, "");
+    }
+    sv_utf8_downgrade(buffer, false);
+
+    STRLEN position = SvCUR(buffer);
+    if (position > UINT32_MAX) {
+        croak("The data section is too large to store more data");
+    }
+
+    sv_catpvn(buffer, data->encoded_data, data->encoded_data_size);
+
+    return (uint32_t)position;
+}
+
+static uint32_t store_data_with_serializer(MMDBW_tree_s *tree,
+                                           const char *const key,
+                                           encode_args_s *args) {
+    /* Getting the data may call into Perl to inflate packed data, so we need
+       to do it before we set up the stack. */
+    SV *data = newSVsv(data_for_key(tree, key));
+    if (!SvOK(data)) {
+        SvREFCNT_dec(data);
+        croak("No data associated with key - %s", key);
+    }
+
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    PUSHMARK(SP);
+    EXTEND(SP, 5);
+    PUSHs(args->serializer);
+    PUSHs(args->root_data_type);
+    mPUSHs(data);
+    PUSHs(&PL_sv_undef);
+    mPUSHp(key, strlen(key));
+    PUTBACK;
+
+    int count = call_method("store_data", G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from ->store_data() call");
+    }
+
+    SV *rval = POPs;
+    if (!(SvIOK(rval) || SvUOK(rval))) {
+        croak("The serializer's store_data() method returned an SV "
+              "which is not SvIOK or SvUOK!");
+    }
+    uint32_t position = (uint32_t)SvUV(rval);
+
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    return position;
+}
+
+// Checks that the data each record points to in the data section decodes to
+// the data stored in the tree. We compare bytes rather than decoding into Perl
+// data structures: the data the serializer stored, with every pointer in it
+// replaced by the value it points to, must be identical to the value encoded
+// on its own without deduplication.
+static void verify_data_section(MMDBW_tree_s *tree,
+                                encode_args_s *args,
+                                SV *verify_encoder,
+                                const double sample_rate) {
+    if (NULL == args->serializer_buffer) {
+        args->serializer_buffer = serializer_buffer(args->serializer);
+    }
+
+    STRLEN data_section_size;
+    const uint8_t *const data_section =
+        (uint8_t *)SvPVbyte(args->serializer_buffer, data_section_size);
+    mmdb_section_s section = {
+        .filename = "the database being written",
+        .name = "data section",
+        .bytes = data_section,
+        .size = data_section_size,
+    };
+
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    while (NULL != (data = hash_table_next(&(tree->data_table), &position))) {
+        if (!data_is_sampled(data->key, sample_rate)) {
+            continue;
+        }
+
+        SV **cache_record = hv_fetch(
+            args->data_pointer_cache, data->key, SHA1_KEY_LENGTH, 0);
+        if (NULL == cache_record) {
+            croak("Data verification failed: no record points to the data "
+                  "for key %s",
+                  data->key);
+        }
+
+        uint32_t record_value = (uint32_t)SvUV(*cache_record);
+        if (record_value <
+            tree->node_count + DATA_SECTION_SEPARATOR_SIZE) {
+            croak("Data verification failed: record value %" PRIu32
+                  " for key %s is not in the data section",
+                  record_value,
+                  data->key);
+        }
+
+        ENTER;
+        SAVETMPS;
+
+        SV *expanded = sv_2mortal(newSVpvs(""));
+        expand_data(&section,
+                    record_value - tree->node_count -
+                        DATA_SECTION_SEPARATOR_SIZE,
+                    expanded,
+                    0);
+
+        SV *expected = NULL;
+        if (NULL != data->encoded_data) {
+            expected = sv_2mortal(
+                newSVpvn(data->encoded_data, data->encoded_data_size));
+        } else {
+            expected = encode_data_for_verification(
+                verify_encoder, data_for_key(tree, data->key));
+        }
+
+        if (SvCUR(expanded) != SvCUR(expected) ||
+            memcmp(SvPVX(expanded), SvPVX(expected), SvCUR(expected))) {
+            croak("Data verification failed: the data section does not "
+                  "contain the data for key %s",
+                  data->key);
+        }
+
+        FREETMPS;
+        LEAVE;
+    }
+}
+
+// Sampling is by key so that the same data is checked on every run.
+static bool data_is_sampled(const char *const key, const double sample_rate) {
+    if (sample_rate >= 1) {
+        return true;
+    }
+
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (const char *c = key; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619U;
+    }
+
+    return hash < sample_rate * UINT32_MAX;
+}
+
+// The returned SV is mortal.
+static SV *encode_data_for_verification(SV *encoder, SV *data_sv) {
+    if (!SvOK(encoder)) {
+        croak("No encoder was given to verify the data section");
+    }
+
+    dSP;
+
+    PUSHMARK(SP);
+    XPUSHs(data_sv);
+    PUTBACK;
+
+    int count = call_sv(encoder, G_SCALAR);
+
+    SPAGAIN;
+
+    if (count != 1) {
+        croak("Expected 1 item back from the data encoder");
+    }
+
+    SV *encoded = newSVsv(POPs);
+
+    PUTBACK;
+
+    return sv_2mortal(encoded);
+}
+
+// Appends the value at the offset to `expanded', following any pointers, and
+// returns the offset after the value.
+static uint64_t expand_data(const mmdb_section_s *section,
+                            uint64_t offset,
+                            SV *expanded,
+                            const int depth) {
+    // Maps and arrays can only nest this deep if a pointer loops back to a
+    // value containing it.
+    if (depth > 512) {
+        mmdb_data_error(section, offset, "values are nested too deeply");
+    }
+
+    MMDBW_mmdb_entry_s entry;
+    if (!mmdb_decode_control(section->bytes, section->size, offset, &entry)) {
+        mmdb_data_error(section, offset, "invalid control byte");
+    }
+
+    if (MMDBW_TYPE_POINTER == entry.type) {
+        if (entry.size < section->size &&
+            MMDBW_TYPE_POINTER == section->bytes[entry.size] >> 5) {
+            mmdb_data_error(section, offset, "a pointer to another pointer");
+        }
+        expand_data(section, entry.size, expanded, depth + 1);
+        return entry.payload;
+    }
+
+    sv_catpvn(expanded,
+              (const char *)&section->bytes[offset],
+              entry.payload - offset);
+
+    switch (entry.type) {
+        case MMDBW_TYPE_MAP:
+            for (uint64_t i = 0; i < entry.size * 2; i++) {
+                entry.payload =
+                    expand_data(section, entry.payload, expanded, depth + 1);
+            }
+            return entry.payload;
+        case MMDBW_TYPE_ARRAY:
+            for (uint64_t i = 0; i < entry.size; i++) {
+                entry.payload =
+                    expand_data(section, entry.payload, expanded, depth + 1);
+            }
+            return entry.payload;
+        case MMDBW_TYPE_BOOLEAN:
+            // The value of a boolean is its size.
+            return entry.payload;
+        case MMDBW_TYPE_UTF8_STRING:
+        case MMDBW_TYPE_DOUBLE:
+        case MMDBW_TYPE_BYTES:
+        case MMDBW_TYPE_UINT16:
+        case MMDBW_TYPE_UINT32:
+        case MMDBW_TYPE_INT32:
+        case MMDBW_TYPE_UINT64:
+        case MMDBW_TYPE_UINT128:
+        case MMDBW_TYPE_FLOAT:
+            if (entry.size > section->size - entry.payload) {
+                mmdb_data_error(
+                    section, offset, "the value runs past the end");
+            }
+            sv_catpvn(expanded,
+                      (const char *)&section->bytes[entry.payload],
+                      entry.size);
+            return entry.payload + entry.size;
+        default:
+            mmdb_data_error(section, offset, "invalid type");
+    }
+}
+
+// Builds each edition's tree from the tree, with the data returned by the
+// edition's projection. Each distinct value is projected once per edition
+// before any edition is changed. The editions are then built by a single walk
+// of the tree that copies its nodes and paths into every edition at once,
+// rather than inserting each network. The records above a record whose
+// projected data is left out or is the same as its sibling's are trimmed as
+// they are when inserting, so the editions are the same as if each network
+// had been inserted.
+void project_tree(MMDBW_tree_s *tree,
+                  MMDBW_edition_s *editions,
+                  const size_t edition_count) {
+    for (size_t i = 0; i < edition_count; i++) {
+        if (editions[i].tree->ip_version != tree->ip_version) {
+            croak("Edition %zu is for IPv%" PRIu8 " but the tree is for "
+                  "IPv%" PRIu8,
+                  editions[i].number,
+                  editions[i].tree->ip_version,
+                  tree->ip_version);
+        }
+    }
+
+    if (tree->mark_and_sweep_data) {
+        sweep_data(tree);
+    }
+
+    ENTER;
+
+    const size_t entry_size =
+        sizeof(projected_data_s) + edition_count * sizeof(const char *);
+    char *entries;
+    Newxz(entries,
+          (tree->data_table.count ? tree->data_table.count : 1) * entry_size,
+          char);
+    SAVEFREEPV(entries);
+    MMDBW_hash_table_s projected_data;
+    hash_table_init(&projected_data, SHA1_KEY_LENGTH);
+    SAVEDESTRUCTOR_X(free_hash_table_on_leave, &projected_data);
+
+    MMDBW_record_s **records;
+    Newx(records,
+         ((tree->ip_version == 6 ? 128 : 32) + 1) *
+             (edition_count ? edition_count : 1),
+         MMDBW_record_s *);
+    SAVEFREEPV(records);
+
+    project_tree_s projection = {
+        .editions = editions,
+        .edition_count = edition_count,
+        .projected_data = &projected_data,
+        .entries = entries,
+        .entry_size = entry_size,
+        .entry_count = 0,
+        .records = records,
+    };
+    SAVEDESTRUCTOR_X(release_projected_data_on_leave, &projection);
+
+    // Every value is projected before any edition is changed, so a
+    // projection that dies leaves the editions empty.
+    MMDBW_data_hash_s *data;
+    size_t position = 0;
+    while (NULL != (data = hash_table_next(&(tree->data_table), &position))) {
+        projected_data_s *entry =
+            (projected_data_s *)(entries + projection.entry_count * entry_size);
+        memcpy(entry->key, data->key, SHA1_KEY_LENGTH);
+        // The entry is counted first so the data already stored for it is
+        // released if a later edition's projection dies.
+        projection.entry_count++;
+        for (size_t i = 0; i < edition_count; i++) {
+            entry->edition_keys[i] =
+                project_data(tree, &editions[i], data->key);
+        }
+        hash_table_insert(&projected_data, entry->key, entry);
+    }
+
+    for (size_t i = 0; i < edition_count; i++) {
+        editions[i].tree->is_compact = false;
+        records[i] = &(editions[i].tree->root_record);
+    }
+    project_record(tree, &projection, &(tree->root_record), 0);
+
+    LEAVE;
+}
+
+// Copies the record into the edition records at the same place, which are at
+// `current_bit' in the projection's records, then trims the edition records.
+static void project_record(MMDBW_tree_s *tree,
+                           project_tree_s *projection,
+                           MMDBW_record_s *record,
+                           int current_bit) {
+    const size_t edition_count = projection->edition_count;
+    MMDBW_record_s **edition_records =
+        &(projection->records[current_bit * edition_count]);
+
+    for (size_t i = 0; i < edition_count; i++) {
+        check_edition_record(
+            &(projection->editions[i]), record, edition_records[i]);
+    }
+
+    switch (record->type) {
+        case MMDBW_RECORD_TYPE_DATA: {
+            projected_data_s *entry =
+                hash_table_find(projection->projected_data, record->value.key);
+            if (NULL == entry) {
+                croak("Record points to data that does not exist in tree");
+            }
+            for (size_t i = 0; i < edition_count; i++) {
+                if (NULL == entry->edition_keys[i]) {
+                    continue;
+                }
+                edition_records[i]->type = MMDBW_RECORD_TYPE_DATA;
+                edition_records[i]->value.key = copy_data_key(
+                    projection->editions[i].tree, entry->edition_keys[i]);
+            }
+            return;
+        }
+        case MMDBW_RECORD_TYPE_NODE:
+        case MMDBW_RECORD_TYPE_FIXED_NODE: {
+            MMDBW_node_s *node = record->value.node;
+            MMDBW_record_s **child_records =
+                &(edition_records[edition_count]);
+
+            for (size_t i = 0; i < edition_count; i++) {
+                if (MMDBW_RECORD_TYPE_EMPTY == edition_records[i]->type) {
+                    edition_records[i]->type = MMDBW_RECORD_TYPE_NODE;
+                    edition_records[i]->value.node = new_node();
+                }
+                child_records[i] =
+                    &(edition_records[i]->value.node->left_record);
+            }
+            project_record(
+                tree, projection, &(node->left_record), current_bit + 1);
+
+            for (size_t i = 0; i < edition_count; i++) {
+                child_records[i] =
+                    &(edition_records[i]->value.node->right_record);
+            }
+            project_record(
+                tree, projection, &(node->right_record), current_bit + 1);
+
+            for (size_t i = 0; i < edition_count; i++) {
+                trim_node_record(projection->editions[i].tree,
+                                 edition_records[i]);
+            }
+            return;
+        }
+        case MMDBW_RECORD_TYPE_PATH: {
+            MMDBW_path_s *path = record->value.path;
+            MMDBW_record_s **end_records =
+                &(projection->records[(current_bit + path->length) *
+                                      edition_count]);
+
+            for (size_t i = 0; i < edition_count; i++) {
+                MMDBW_path_s *edition_path =
+                    checked_malloc(sizeof(MMDBW_path_s));
+                memcpy(edition_path->bytes, path->bytes, sizeof(path->bytes));
+                edition_path->length = path->length;
+                edition_path->number = 0;
+                edition_path->record.type = MMDBW_RECORD_TYPE_EMPTY;
+                edition_path->record.value.node = NULL;
+
+                edition_records[i]->type = MMDBW_RECORD_TYPE_PATH;
+                edition_records[i]->value.path = edition_path;
+                end_records[i] = &(edition_path->record);
+            }
+            project_record(
+                tree, projection, &(path->record), current_bit + path->length);
+
+            for (size_t i = 0; i < edition_count; i++) {
+                trim_path_record(projection->editions[i].tree,
+                                 edition_records[i],
+                                 current_bit);
+            }
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+// The editions are created with the same fixed networks as the tree, so where
+// the tree has a fixed record the edition must have the same one, and
+// anywhere else the edition record is still empty.
+static void check_edition_record(MMDBW_edition_s *edition,
+                                 MMDBW_record_s *record,
+                                 MMDBW_record_s *edition_record) {
+    const bool is_fixed = MMDBW_RECORD_TYPE_FIXED_NODE == record->type ||
+                          MMDBW_RECORD_TYPE_FIXED_EMPTY == record->type ||
+                          MMDBW_RECORD_TYPE_ALIAS == record->type;
+    if (is_fixed ? edition_record->type == record->type
+                 : edition_record->type == MMDBW_RECORD_TYPE_EMPTY) {
+        return;
+    }
+
+    croak("Edition %zu does not have the same fixed networks as the tree. "
+          "Its alias_ipv6_to_ipv4 and remove_reserved_networks settings must "
+          "be the same as the tree's.",
+          edition->number);
+}
+
+// Stores the data the edition's projection returns for the data key in the
+// edition's tree and returns its key there, or NULL if the edition leaves the
+// data out. The stored data holds a reference until the projection is done.
+static const char *project_data(MMDBW_tree_s *tree,
+                                MMDBW_edition_s *edition,
+                                const char *const key) {
+    dSP;
+    ENTER;
+    SAVETMPS;
+
+    /* Getting the data may call into Perl to inflate packed data, so we need
+       to do it before we start pushing onto the stack. */
+    SV *data = data_for_key(tree, key);
+    SPAGAIN;
+
+    if (SvOK(edition->projection)) {
+        PUSHMARK(SP);
+        EXTEND(SP, 1);
+        PUSHs(data);
+        PUTBACK;
+
+        int count = call_sv(edition->projection, G_SCALAR);
+
+        SPAGAIN;
+
+        if (count != 1) {
+            croak("Expected 1 item back from the projection call");
+        }
+
+        // Hashing and storing the data may call into Perl too, so the stack
+        // is put back first.
+        data = POPs;
+        SvREFCNT_inc_simple_void_NN(data);
+        sv_2mortal(data);
+        PUTBACK;
+    }
+
+    const char *edition_key = NULL;
+    if (!SvOK(edition->projection)) {
+        edition_key = store_data_in_tree(edition->tree, key, data);
+    } else if (SvOK(data)) {
+        SV *key_sv = sv_2mortal(key_for_data(data));
+        edition_key = store_data_in_tree(edition->tree,
+                                         SvPVbyte_nolen(key_sv),
+                                         sv_2mortal(newSVsv(data)));
+    }
+
+    FREETMPS;
+    LEAVE;
+
+    return edition_key;
+}
+
+// Drops the reference project_tree() holds to each edition's projected data,
+// whether it finished or a projection died.
+static void release_projected_data_on_leave(pTHX_ void *void_projection) {
+    project_tree_s *projection = (project_tree_s *)void_projection;
+
+    for (size_t i = 0; i < projection->entry_count; i++) {
+        projected_data_s *entry =
+            (projected_data_s *)(projection->entries +
+                                 i * projection->entry_size);
+        for (size_t j = 0; j < projection->edition_count; j++) {
+            if (NULL != entry->edition_keys[j]) {
+                decrement_data_reference_count(projection->editions[j].tree,
+                                               entry->edition_keys[j]);
+            }
+        }
+    }
+}
+
+// Looks up addresses in both the tree and the database written from it and
+// compares the data they find by a hash of its content. The addresses checked
+// are the first and last address of every data network in the tree and the
+// addresses just outside them, plus `random_count' random addresses. The
+// returned AV is mortal and holds a description of each address where they
+// differ.
+AV *check_lookups(MMDBW_tree_s *tree,
+                  const char *const filename,
+                  const uint64_t random_count,
+                  uint64_t seed,
+                  SV *data_encoder) {
+    lookup_check_s check = {
+        .data_encoder = data_encoder,
+        .tree_hashes = (HV *)sv_2mortal((SV *)newHV()),
+        .database_hashes = (HV *)sv_2mortal((SV *)newHV()),
+        .mismatches = (AV *)sv_2mortal((SV *)newAV()),
+    };
+
+    open_mmdb(&check.mmdb, filename);
+
+    // This unmaps the database on LEAVE, including when we croak.
+    ENTER;
+    SAVEDESTRUCTOR_X(close_mmdb_on_leave, &check.mmdb);
+
+    if (check.mmdb.ip_version != tree->ip_version) {
+        croak("The database %s is for IPv%" PRIu16 " but the tree is for "
+              "IPv%" PRIu8,
+              filename,
+              check.mmdb.ip_version,
+              tree->ip_version);
+    }
+
+    check.data_section = (mmdb_section_s){
+        .filename = filename,
+        .name = "data section",
+        .bytes = check.mmdb.data_section,
+        .size = check.mmdb.data_section_size,
+    };
+
+    if (MMDBW_RECORD_TYPE_NODE == tree->root_record.type ||
+        MMDBW_RECORD_TYPE_FIXED_NODE == tree->root_record.type ||
+        MMDBW_RECORD_TYPE_PATH == tree->root_record.type) {
+        start_iteration(tree, false, (void *)&check, &check_lookups_for_node);
+    }
+
+    // A zero seed would make the generator return zero forever.
+    seed = seed ? seed : 1;
+    for (uint64_t i = 0; i < random_count; i++) {
+        uint128_t ip = ((uint128_t)next_random_number(&seed) << 64) |
+                       next_random_number(&seed);
+        // Most IPv6 space is empty, so every other address in an IPv6 tree
+        // is in the IPv4 space instead.
+        if (tree->ip_version == 4 || (i & 1)) {
+            ip &= 0xFFFFFFFF;
         }
+        check_lookup(tree, &check, ip);
+    }
+
+    LEAVE;
+
+    return check.mismatches;
+}
+
+static void check_lookups_for_node(MMDBW_tree_s *tree,
+                                   MMDBW_node_s *node,
+                                   uint128_t network,
+                                   uint8_t depth,
+                                   void *void_check) {
+    lookup_check_s *check = (lookup_check_s *)void_check;
+
+    check_lookups_for_record(
+        tree, check, &node->left_record, network, depth + 1);
+    check_lookups_for_record(tree,
+                             check,
+                             &node->right_record,
+                             flip_network_bit(tree, network, depth),
+                             depth + 1);
+}
+
+static void check_lookups_for_record(MMDBW_tree_s *tree,
+                                     lookup_check_s *check,
+                                     MMDBW_record_s *record,
+                                     uint128_t network,
+                                     const uint8_t prefix_length) {
+    if (MMDBW_RECORD_TYPE_DATA != record->type) {
+        return;
+    }
+
+    const int host_bits = tree_depth0(tree) + 1 - prefix_length;
+    const uint128_t last =
+        network |
+        (host_bits == 128 ? ~(uint128_t)0 : ((uint128_t)1 << host_bits) - 1);
+    const uint128_t max_ip =
+        tree->ip_version == 6 ? ~(uint128_t)0 : (uint128_t)0xFFFFFFFF;
+
+    check_lookup(tree, check, network);
+    check_lookup(tree, check, last);
+    if (network > 0) {
+        check_lookup(tree, check, network - 1);
+    }
+    if (last < max_ip) {
+        check_lookup(tree, check, last + 1);
+    }
+}
+
+static void check_lookup(MMDBW_tree_s *tree,
+                         lookup_check_s *check,
+                         const uint128_t ip) {
+    uint64_t tree_hash = 0, database_hash = 0;
+    bool in_tree = tree_content_hash(tree, check, ip, &tree_hash);
+    bool in_database = database_content_hash(tree, check, ip, &database_hash);
+
+    if (in_tree && !in_database) {
+        add_lookup_mismatch(
+            tree, check, ip, "data in the tree but none in the database");
+    } else if (!in_tree && in_database) {
+        add_lookup_mismatch(
+            tree, check, ip, "data in the database but none in the tree");
+    } else if (tree_hash != database_hash) {
+        add_lookup_mismatch(
+            tree, check, ip, "different data in the tree and the database");
+    }
+}
+
+// Returns false if the tree has no data for the address.
+static bool tree_content_hash(MMDBW_tree_s *tree,
+                              lookup_check_s *check,
+                              const uint128_t ip,
+                              uint64_t *hash) {
+    uint8_t bytes[16];
+    integer_to_ip_bytes(tree->ip_version, ip, bytes);
+    MMDBW_network_s network = {
+        .bytes = bytes,
+        .prefix_length = tree_depth0(tree) + 1,
+    };
+
+    MMDBW_record_s *record;
+    MMDBW_status status = find_record_for_network(tree, &network, &record);
+    if (MMDBW_SUCCESS != status) {
+        croak("Received an unexpected NULL when checking lookups: %s",
+              status_error_message(status));
+    }
+
+    if (MMDBW_RECORD_TYPE_DATA != record->type) {
+        return false;
+    }
+
+    const char *const key = record->value.key;
+    SV **cached = hv_fetch(check->tree_hashes, key, SHA1_KEY_LENGTH, 0);
+    if (NULL != cached) {
+        *hash = SvUV(*cached);
+        return true;
+    }
+
+    *hash = data_content_hash(tree, key, check->data_encoder);
+
+    (void)hv_store(check->tree_hashes, key, SHA1_KEY_LENGTH, newSVuv(*hash), 0);
+
+    return true;
+}
+
+// Returns false if the database has no data for the address.
+static bool database_content_hash(MMDBW_tree_s *tree,
+                                  lookup_check_s *check,
+                                  const uint128_t ip,
+                                  uint64_t *hash) {
+    MMDBW_mmdb_s *mmdb = &check->mmdb;
+
+    uint8_t bytes[16];
+    integer_to_ip_bytes(tree->ip_version, ip, bytes);
+    const uint32_t value = mmdb_lookup(mmdb, bytes, tree_depth0(tree) + 1);
+
+    if (value == mmdb->node_count) {
+        return false;
+    }
+    if (value < mmdb->node_count ||
+        value - mmdb->node_count < DATA_SECTION_SEPARATOR_SIZE) {
+        croak("The database has an invalid record value (%" PRIu32 ")",
+              value);
+    }
+
+    SV **cached = hv_fetch(
+        check->database_hashes, (const char *)&value, sizeof(value), 0);
+    if (NULL != cached) {
+        *hash = SvUV(*cached);
+        return true;
+    }
+
+    ENTER;
+    SAVETMPS;
+
+    SV *expanded = sv_2mortal(newSVpvs(""));
+    expand_data(&check->data_section,
+                value - mmdb->node_count - DATA_SECTION_SEPARATOR_SIZE,
+                expanded,
+                0);
+    *hash = content_hash(expanded);
+
+    FREETMPS;
+    LEAVE;
+
+    (void)hv_store(check->database_hashes,
+                   (const char *)&value,
+                   sizeof(value),
+                   newSVuv(*hash),
+                   0);
+
+    return true;
+}
+
+static void add_lookup_mismatch(MMDBW_tree_s *tree,
+                                lookup_check_s *check,
+                                const uint128_t ip,
+                                const char *const problem) {
+    char ip_string[INET6_ADDRSTRLEN];
+    integer_to_ip_string(tree->ip_version, ip, ip_string, sizeof(ip_string));
+
+    av_push(check->mismatches, newSVpvf("%s: %s", ip_string, problem));
+}
+
+// FNV-1a
+// Returns the content hash of the data's encoding without pointers, as it
+// would be found by following the pointers in a database.
+static uint64_t data_content_hash(MMDBW_tree_s *tree,
+                                  const char *const key,
+                                  SV *data_encoder) {
+    ENTER;
+    SAVETMPS;
+
+    uint64_t hash;
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
+    if (NULL != data && NULL != data->encoded_data) {
+        hash = content_hash(sv_2mortal(
+            newSVpvn(data->encoded_data, data->encoded_data_size)));
+    } else {
+        hash = content_hash(encode_data_for_verification(
+            data_encoder, data_for_key(tree, key)));
     }
 
+    FREETMPS;
+    LEAVE;
+
+    return hash;
+}
+
+static uint64_t content_hash(SV *content) {
+    STRLEN size;
+    const uint8_t *const bytes = (const uint8_t *)SvPVbyte(content, size);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (STRLEN i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// xorshift64*
+static uint64_t next_random_number(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 2685821657736338717ULL;
+}
+
+static void check_record_value(MMDBW_tree_s *tree, uint32_t record_value) {
     if (record_value > max_record_value(tree)) {
         croak("Node value of %" PRIu32 " exceeds the record size of %" PRIu8
               " bits",
               record_value,
               tree->record_size);
     }
-
-    return record_value;
 }
 
 uint32_t max_record_value(MMDBW_tree_s *tree) {
@@ -1976,7 +4587,8 @@ void start_iteration(MMDBW_tree_s *tree,
     // and changing that is a rabbit hole that I don't want to go down
     // currently. (I stuck my head in and regretted it.)
     if (MMDBW_RECORD_TYPE_NODE != tree->root_record.type &&
-        MMDBW_RECORD_TYPE_FIXED_NODE != tree->root_record.type) {
+        MMDBW_RECORD_TYPE_FIXED_NODE != tree->root_record.type &&
+        MMDBW_RECORD_TYPE_PATH != tree->root_record.type) {
         croak("Iteration is not currently allowed in trees with no nodes. "
               "Record type: %s",
               record_type_name(tree->root_record.type));
@@ -2004,10 +4616,25 @@ static void iterate_tree(MMDBW_tree_s *tree,
               ip);
     }
 
+    if (record->type == MMDBW_RECORD_TYPE_PATH) {
+        iterate_path(tree,
+                     record->value.path,
+                     network,
+                     depth,
+                     depth_first,
+                     args,
+                     callback);
+        return;
+    }
+
     if (record->type == MMDBW_RECORD_TYPE_NODE ||
         record->type == MMDBW_RECORD_TYPE_FIXED_NODE) {
         MMDBW_node_s *node = record->value.node;
 
+        // Start loading the children while the callback runs.
+        prefetch_record(&node->left_record);
+        prefetch_record(&node->right_record);
+
         if (!depth_first) {
             callback(tree, node, network, depth, args);
         }
@@ -2034,12 +4661,242 @@ static void iterate_tree(MMDBW_tree_s *tree,
     }
 }
 
+// The callback expects nodes, so we expand the path into a chain of nodes
+// just for the iteration. They are numbered consecutively from the path's
+// number, which is how assign_node_number() numbers them.
+static void iterate_path(MMDBW_tree_s *tree,
+                         MMDBW_path_s *path,
+                         uint128_t network,
+                         const uint8_t depth,
+                         bool depth_first,
+                         void *args,
+                         MMDBW_iterator_callback callback) {
+    MMDBW_node_s *nodes = expand_path(path, depth);
+
+    MMDBW_record_s first = {.type = MMDBW_RECORD_TYPE_NODE,
+                            .value.node = nodes};
+    iterate_tree(tree, &first, network, depth, depth_first, args, callback);
+
+    path->number = nodes[0].number;
+    free(nodes);
+}
+
+// Returns a malloc'd chain of nodes standing for the path, which starts at
+// the given depth.
+static MMDBW_node_s *expand_path(MMDBW_path_s *path, const uint8_t depth) {
+    MMDBW_node_s *nodes = checked_malloc(path->length * sizeof(MMDBW_node_s));
+
+    for (int i = 0; i < path->length; i++) {
+        nodes[i].number = path->number + i;
+        nodes[i].left_record.type = MMDBW_RECORD_TYPE_EMPTY;
+        nodes[i].right_record.type = MMDBW_RECORD_TYPE_EMPTY;
+
+        MMDBW_record_s *next = path_bit_value(path, depth + i)
+                                   ? &(nodes[i].right_record)
+                                   : &(nodes[i].left_record);
+        if (i + 1 < path->length) {
+            next->type = MMDBW_RECORD_TYPE_NODE;
+            next->value.node = &nodes[i + 1];
+        } else {
+            *next = path->record;
+        }
+    }
+
+    return nodes;
+}
+
+static void prefetch_record(MMDBW_record_s *record) {
+    if (record->type == MMDBW_RECORD_TYPE_NODE ||
+        record->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
+        record->type == MMDBW_RECORD_TYPE_PATH) {
+        PREFETCH(record->value.node);
+    }
+}
+
+// Like start_iteration(), but calls the callback for the nodes in the order
+// of a blocked, van Emde Boas style layout rather than in preorder. The tree
+// is cut into blocks of NODE_BLOCK_LEVELS levels, and each block is cut in
+// half by level recursively until the pieces fit in a cache line. The top
+// half of each block comes first, followed by each of the subtrees below it.
+// A lookup then touches one block per NODE_BLOCK_LEVELS levels of the tree
+// rather than one for almost every node.
+//
+// A path is always called for as a whole, so a block containing the start of
+// a path may be deeper than NODE_BLOCK_LEVELS. As with preorder, every node
+// is called for after its parent.
+void start_blocked_iteration(MMDBW_tree_s *tree,
+                             void *args,
+                             MMDBW_iterator_callback callback) {
+    if (MMDBW_RECORD_TYPE_NODE != tree->root_record.type &&
+        MMDBW_RECORD_TYPE_FIXED_NODE != tree->root_record.type &&
+        MMDBW_RECORD_TYPE_PATH != tree->root_record.type) {
+        croak("Iteration is not currently allowed in trees with no nodes. "
+              "Record type: %s",
+              record_type_name(tree->root_record.type));
+    }
+
+    block_record_s root = {
+        .record = &(tree->root_record), .network = 0, .depth = 0};
+    iterate_blocks(tree, &root, args, callback);
+
+    return;
+}
+
+static void iterate_blocks(MMDBW_tree_s *tree,
+                           block_record_s *start,
+                           void *args,
+                           MMDBW_iterator_callback callback) {
+    block_records_s frontier = {0};
+    iterate_block(tree, start, NODE_BLOCK_LEVELS, &frontier, args, callback);
+
+    for (size_t i = 0; i < frontier.count; i++) {
+        iterate_blocks(tree, &(frontier.records[i]), args, callback);
+    }
+
+    free(frontier.records);
+}
+
+// Calls the callback for the nodes in the given number of levels starting at
+// start, and adds the records below them to the frontier.
+static void iterate_block(MMDBW_tree_s *tree,
+                          block_record_s *start,
+                          const uint8_t levels,
+                          block_records_s *frontier,
+                          void *args,
+                          MMDBW_iterator_callback callback) {
+    if (levels <= NODE_LINE_LEVELS) {
+        iterate_line_block(tree, start, levels, frontier, args, callback);
+        return;
+    }
+
+    uint8_t top_levels = levels / 2;
+    block_records_s bottoms = {0};
+    iterate_block(tree, start, top_levels, &bottoms, args, callback);
+
+    for (size_t i = 0; i < bottoms.count; i++) {
+        iterate_block(tree,
+                      &(bottoms.records[i]),
+                      levels - top_levels,
+                      frontier,
+                      args,
+                      callback);
+    }
+
+    free(bottoms.records);
+}
+
+static void iterate_line_block(MMDBW_tree_s *tree,
+                               block_record_s *start,
+                               const uint8_t levels,
+                               block_records_s *frontier,
+                               void *args,
+                               MMDBW_iterator_callback callback) {
+    block_records_s level = {0};
+    block_records_s next_level = {0};
+    push_block_record(&level, start->record, start->network, start->depth);
+
+    for (uint8_t i = 0; i < levels && level.count > 0; i++) {
+        for (size_t j = 0; j < level.count; j++) {
+            iterate_block_record(tree,
+                                 &(level.records[j]),
+                                 &next_level,
+                                 frontier,
+                                 args,
+                                 callback);
+        }
+
+        block_records_s done = level;
+        level = next_level;
+        next_level = done;
+        next_level.count = 0;
+    }
+
+    for (size_t j = 0; j < level.count; j++) {
+        push_block_record(frontier,
+                          level.records[j].record,
+                          level.records[j].network,
+                          level.records[j].depth);
+    }
+
+    free(level.records);
+    free(next_level.records);
+}
+
+static void iterate_block_record(MMDBW_tree_s *tree,
+                                 block_record_s *block_record,
+                                 block_records_s *next_level,
+                                 block_records_s *frontier,
+                                 void *args,
+                                 MMDBW_iterator_callback callback) {
+    MMDBW_record_s *record = block_record->record;
+    uint128_t network = block_record->network;
+    uint8_t depth = block_record->depth;
+
+    if (record->type == MMDBW_RECORD_TYPE_PATH) {
+        MMDBW_path_s *path = record->value.path;
+        MMDBW_node_s *nodes = expand_path(path, depth);
+
+        for (int i = 0; i < path->length; i++) {
+            callback(tree, &nodes[i], network, depth + i, args);
+            if (path_bit_value(path, depth + i)) {
+                network = flip_network_bit(tree, network, depth + i);
+            }
+        }
+
+        path->number = nodes[0].number;
+        free(nodes);
+
+        if (path->record.type == MMDBW_RECORD_TYPE_NODE ||
+            path->record.type == MMDBW_RECORD_TYPE_FIXED_NODE) {
+            push_block_record(
+                frontier, &(path->record), network, depth + path->length);
+        }
+        return;
+    }
+
+    MMDBW_node_s *node = record->value.node;
+    callback(tree, node, network, depth, args);
+
+    MMDBW_record_s *children[2] = {&(node->left_record),
+                                   &(node->right_record)};
+    uint128_t networks[2] = {network, flip_network_bit(tree, network, depth)};
+    for (int i = 0; i < 2; i++) {
+        if (children[i]->type == MMDBW_RECORD_TYPE_NODE ||
+            children[i]->type == MMDBW_RECORD_TYPE_FIXED_NODE ||
+            children[i]->type == MMDBW_RECORD_TYPE_PATH) {
+            push_block_record(next_level, children[i], networks[i], depth + 1);
+        }
+    }
+}
+
+static void push_block_record(block_records_s *block_records,
+                              MMDBW_record_s *record,
+                              uint128_t network,
+                              const uint8_t depth) {
+    if (block_records->count == block_records->size) {
+        size_t size = block_records->size ? block_records->size * 2 : 16;
+        block_record_s *records = checked_malloc(size * sizeof(block_record_s));
+        if (block_records->count > 0) {
+            memcpy(records,
+                   block_records->records,
+                   block_records->count * sizeof(block_record_s));
+        }
+        free(block_records->records);
+        block_records->records = records;
+        block_records->size = size;
+    }
+
+    block_records->records[block_records->count++] =
+        (block_record_s){.record = record, .network = network, .depth = depth};
+}
+
 uint128_t
 flip_network_bit(MMDBW_tree_s *tree, uint128_t network, uint8_t depth) {
     return network | ((uint128_t)1 << (tree_depth0(tree) - depth));
 }
 
-static SV *key_for_data(SV *data) {
+// The returned SV has a reference count the caller owns.
+SV *key_for_data(SV *data) {
     dSP;
     ENTER;
     SAVETMPS;
@@ -2068,21 +4925,26 @@ static SV *key_for_data(SV *data) {
     return key;
 }
 
+// Packed data is inflated into a mortal SV, so callers that hold on to the
+// returned SV past the current FREETMPS need to take their own reference.
 SV *data_for_key(MMDBW_tree_s *tree, const char *const key) {
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, key, strlen(key), data);
+    MMDBW_data_hash_s *data = hash_table_find(&(tree->data_table), key);
 
-    if (NULL != data) {
-        return data->data_sv;
-    } else {
+    if (NULL == data) {
         return &PL_sv_undef;
     }
+
+    if (NULL != data->packed_data) {
+        return sv_2mortal(thaw_sv(data->packed_data, data->packed_data_size));
+    }
+
+    return data->data_sv;
 }
 
 static const char *merge_cache_lookup(MMDBW_tree_s *tree,
                                       char *merge_cache_key) {
-    MMDBW_merge_cache_s *cache = NULL;
-    HASH_FIND(hh, tree->merge_cache, merge_cache_key, MERGE_KEY_SIZE, cache);
+    MMDBW_merge_cache_s *cache =
+        hash_table_find(&(tree->merge_cache), merge_cache_key);
 
     if (!cache) {
         return NULL;
@@ -2090,51 +4952,60 @@ static const char *merge_cache_lookup(MMDBW_tree_s *tree,
 
     // We have to check that the value has not been removed from the data
     // table
-    MMDBW_data_hash_s *data = NULL;
-    HASH_FIND(hh, tree->data_table, cache->value, SHA1_KEY_LENGTH, data);
-    if (data != NULL) {
+    if (NULL != hash_table_find(&(tree->data_table), cache->value)) {
         return cache->value;
     }
 
     // Item has been removed from data table. Remove the cached merge too.
-    HASH_DEL(tree->merge_cache, cache);
+    hash_table_remove(&(tree->merge_cache), cache->key);
+    free(cache);
     return NULL;
 }
 
 static void store_in_merge_cache(MMDBW_tree_s *tree,
                                  char *merge_cache_key,
                                  const char *const new_key) {
-    MMDBW_merge_cache_s *data = checked_malloc(sizeof(MMDBW_merge_cache_s));
-    data->value = checked_malloc(SHA1_KEY_LENGTH + 1);
-    strncpy((char *)data->value, new_key, SHA1_KEY_LENGTH + 1);
-
-    data->key = checked_malloc(MERGE_KEY_SIZE + 1);
-    strncpy((char *)data->key, merge_cache_key, MERGE_KEY_SIZE + 1);
+    MMDBW_merge_cache_s *cache = checked_malloc(sizeof(MMDBW_merge_cache_s));
+    memcpy(cache->value, new_key, SHA1_KEY_LENGTH + 1);
+    memcpy(cache->key, merge_cache_key, MERGE_KEY_SIZE + 1);
 
-    HASH_ADD_KEYPTR(hh, tree->merge_cache, data->key, MERGE_KEY_SIZE, data);
+    hash_table_insert(&(tree->merge_cache), cache->key, cache);
 }
 
 void free_tree(MMDBW_tree_s *tree) {
     free_record_value(tree, &tree->root_record, true);
+    free(tree->fixed_nodes);
+    free(tree->compact_nodes);
+    free(tree->compact_paths);
     free_merge_cache(tree);
 
-    int hash_count = HASH_COUNT(tree->data_table);
+    if (tree->mark_and_sweep_data) {
+        MMDBW_data_hash_s *data;
+        size_t position = 0;
+        while (NULL !=
+               (data = hash_table_next(&(tree->data_table), &position))) {
+            free_data(tree, data);
+        }
+    }
+
+    size_t hash_count = tree->data_table.count;
     if (0 != hash_count) {
-        croak("%d elements left in data table after freeing all nodes!",
+        croak("%zu elements left in data table after freeing all nodes!",
               hash_count);
     }
+    hash_table_free(&(tree->data_table));
 
+    SvREFCNT_dec(tree->data_encoder);
     free(tree);
 }
 
 void free_merge_cache(MMDBW_tree_s *tree) {
-    MMDBW_merge_cache_s *cache, *tmp = NULL;
-    HASH_ITER(hh, tree->merge_cache, cache, tmp) {
-        HASH_DEL(tree->merge_cache, cache);
-        free((void *)cache->key);
-        free((void *)cache->value);
+    MMDBW_merge_cache_s *cache;
+    size_t position = 0;
+    while (NULL != (cache = hash_table_next(&(tree->merge_cache), &position))) {
         free(cache);
     }
+    hash_table_free(&(tree->merge_cache));
 }
 
 static void *checked_malloc(size_t size) {
@@ -2212,6 +5083,8 @@ static const char *record_type_name(MMDBW_record_type type) {
             return "fixed_node";
         case MMDBW_RECORD_TYPE_ALIAS:
             return "alias";
+        case MMDBW_RECORD_TYPE_PATH:
+            return "path";
     }
     return "unknown type";
 }
@@ -4,7 +4,6 @@
 #include "XSUB.h"
 #include <stdbool.h>
 #include <stdint.h>
-#include <uthash.h>
 
 #ifdef INT64_T
 #define HAVE_INT64
@@ -50,6 +49,12 @@ typedef uint128_t uint128_t_a8 __attribute__((aligned(8)));
 #include "perl_math_int128.h"
 #include "perl_math_int64.h"
 
+#include "hash_table.h"
+
+#define SHA1_KEY_LENGTH (27)
+
+#define MERGE_KEY_SIZE (57)
+
 typedef enum {
     MMDBW_SUCCESS,
     MMDBW_INSERT_INTO_ALIAS_NODE_ERROR,
@@ -82,6 +87,10 @@ typedef enum {
     // children.
     MMDBW_RECORD_TYPE_FIXED_NODE,
     MMDBW_RECORD_TYPE_ALIAS,
+    // A path record stands for a run of nodes that each have one empty
+    // record, such as those above a network inserted into an empty part of
+    // the tree. The nodes only exist while the tree is being iterated.
+    MMDBW_RECORD_TYPE_PATH,
 } MMDBW_record_type;
 
 typedef enum {
@@ -97,10 +106,23 @@ typedef struct MMDBW_record_s {
         // Data records have a key into the tree's data table, a hash.
         const char *key;
         struct MMDBW_node_s *node;
+        struct MMDBW_path_s *path;
     } value;
     MMDBW_record_type type;
 } MMDBW_record_s;
 
+typedef struct MMDBW_path_s {
+    // An address within the network at the end of the path. Only the bits
+    // between the record holding the path and the end of the path are used.
+    uint8_t bytes[16];
+    // The number of nodes the path stands for. This is at least one.
+    uint8_t length;
+    // The number of the first node in the path, once nodes are numbered.
+    uint32_t number;
+    // The record at the end of the path. This is never empty or a path.
+    MMDBW_record_s record;
+} MMDBW_path_s;
+
 typedef struct MMDBW_node_s {
     MMDBW_record_s left_record;
     MMDBW_record_s right_record;
@@ -108,26 +130,60 @@ typedef struct MMDBW_node_s {
 } MMDBW_node_s;
 
 typedef struct MMDBW_data_hash_s {
+    // Only one of data_sv and packed_data is set, depending on whether the
+    // tree packs its data.
     SV *data_sv;
-    const char *key;
+    char *packed_data;
+    STRLEN packed_data_size;
+    // The value's MMDB encoding when the tree serializes its data as it is
+    // stored. The encoding never contains pointers, so it can be copied to
+    // any position in the data section.
+    char *encoded_data;
+    STRLEN encoded_data_size;
+    // Records with this data point at this key.
+    char key[SHA1_KEY_LENGTH + 1];
     uint32_t reference_count;
-    UT_hash_handle hh;
 } MMDBW_data_hash_s;
 
 typedef struct MMDBW_merge_cache_s {
-    const char *key;
-    const char *value;
-    UT_hash_handle hh;
+    char key[MERGE_KEY_SIZE + 1];
+    char value[SHA1_KEY_LENGTH + 1];
 } MMDBW_merge_cache_s;
 
 typedef struct MMDBW_tree_s {
     uint8_t ip_version;
     uint8_t record_size;
     MMDBW_merge_strategy merge_strategy;
-    MMDBW_data_hash_s *data_table;
-    MMDBW_merge_cache_s *merge_cache;
+    // MMDBW_data_hash_s entries by key.
+    MMDBW_hash_table_s data_table;
+    // MMDBW_merge_cache_s entries by key.
+    MMDBW_hash_table_s merge_cache;
     MMDBW_record_s root_record;
+    // The fixed node record for ::/96 in an IPv6 tree, or NULL if the tree
+    // does not have one. Inserts and lookups of networks within ::/96 start
+    // here rather than walking 96 levels down from the root.
+    MMDBW_record_s *ipv4_root_record;
     uint32_t node_count;
+    // Nodes copied from the shared skeleton of fixed networks when the tree
+    // was created. They are allocated as one block.
+    MMDBW_node_s *fixed_nodes;
+    size_t fixed_node_count;
+    // Nodes and paths moved by compact_tree(), in the order the tree is
+    // iterated. Like the fixed nodes, they are freed as a block.
+    MMDBW_node_s *compact_nodes;
+    size_t compact_node_count;
+    MMDBW_path_s *compact_paths;
+    size_t compact_path_count;
+    // Whether anything has been inserted since the tree was compacted.
+    bool is_compact;
+    bool pack_data;
+    // Whether unused data is found by sweep_data() rather than by counting
+    // the records using each value as they change.
+    bool mark_and_sweep_data;
+    size_t data_sweep_threshold;
+    // A code ref returning the MMDB encoding of a data value, or NULL if the
+    // data is only encoded when the tree is written.
+    SV *data_encoder;
 } MMDBW_tree_s;
 
 typedef struct MMDBW_network_s {
@@ -135,17 +191,31 @@ typedef struct MMDBW_network_s {
     const uint8_t prefix_length;
 } MMDBW_network_s;
 
+// An edition of a tree for project_tree(). The projection is undef to keep the
+// data as it is, or a code ref that returns the data for the edition, or undef
+// to leave the network out of it. The number is the edition's position in the
+// editions passed to write_trees(), for errors.
+typedef struct MMDBW_edition_s {
+    MMDBW_tree_s *tree;
+    SV *projection;
+    size_t number;
+} MMDBW_edition_s;
+
 typedef void(MMDBW_iterator_callback)(MMDBW_tree_s *tree,
                                       MMDBW_node_s *node,
                                       uint128_t network,
                                       uint8_t depth,
                                       void *args);
 
+extern void build_tree_skeletons(void);
 extern MMDBW_tree_s *new_tree(const uint8_t ip_version,
                               uint8_t record_size,
                               MMDBW_merge_strategy merge_strategy,
                               const bool alias_ipv6,
-                              const bool remove_reserved_networks);
+                              const bool remove_reserved_networks,
+                              const bool pack_data,
+                              const bool mark_and_sweep_data,
+                              SV *data_encoder);
 extern void insert_network(MMDBW_tree_s *tree,
                            const char *ipstr,
                            const uint8_t prefix_length,
@@ -158,6 +228,27 @@ extern void insert_range(MMDBW_tree_s *tree,
                          SV *key_sv,
                          SV *data_sv,
                          MMDBW_merge_strategy merge_strategy);
+extern void insert_integer_network(MMDBW_tree_s *tree,
+                                   const uint128_t ip,
+                                   const uint8_t prefix_length,
+                                   SV *key_sv,
+                                   SV *data,
+                                   MMDBW_merge_strategy merge_strategy);
+extern void insert_from_jsonl(MMDBW_tree_s *tree,
+                              const char *const filename,
+                              const char *const network_field,
+                              MMDBW_merge_strategy merge_strategy);
+extern void insert_from_csv(MMDBW_tree_s *tree,
+                            const char *const filename,
+                            const char *const network_column,
+                            const char *const first_ip_column,
+                            const char *const last_ip_column,
+                            const char *const id_column,
+                            HV *data_by_id,
+                            MMDBW_merge_strategy merge_strategy);
+extern void insert_from_mmdb(MMDBW_tree_s *tree, const char *const filename);
+extern SV *read_mmdb_metadata(const char *const filename);
+extern bool mmdb_has_ipv4_aliases(const char *const filename);
 extern void remove_network(MMDBW_tree_s *tree,
                            const char *ipstr,
                            const uint8_t prefix_length);
@@ -169,6 +260,9 @@ extern SV *merge_hashes_for_keys(MMDBW_tree_s *tree,
 extern SV *lookup_ip_address(MMDBW_tree_s *tree, const char *const ipstr);
 extern MMDBW_node_s *new_node();
 extern void assign_node_numbers(MMDBW_tree_s *tree);
+extern void compact_tree(MMDBW_tree_s *tree);
+extern void sweep_data(MMDBW_tree_s *tree);
+extern void map_data(MMDBW_tree_s *tree, SV *transform);
 extern void freeze_tree(MMDBW_tree_s *tree,
                         char *filename,
                         char *frozen_params,
@@ -179,18 +273,48 @@ extern MMDBW_tree_s *thaw_tree(char *filename,
                                uint8_t record_size,
                                MMDBW_merge_strategy merge_strategy,
                                const bool alias_ipv6,
-                               const bool remove_reserved_networks);
+                               const bool remove_reserved_networks,
+                               const bool pack_data,
+                               const bool mark_and_sweep_data,
+                               SV *data_encoder);
 extern void write_search_tree(MMDBW_tree_s *tree,
                               SV *output,
                               SV *root_data_type,
-                              SV *serializer);
+                              SV *serializer,
+                              const bool optimize_pointer_sizes,
+                              const bool order_data_by_frequency,
+                              const bool blocked_node_layout,
+                              SV *previous_database,
+                              const double verify_sample_rate,
+                              SV *data_encoder);
+extern uint32_t write_ipv4_search_tree(MMDBW_tree_s *tree,
+                                       SV *output,
+                                       SV *root_data_type,
+                                       SV *serializer,
+                                       const bool optimize_pointer_sizes,
+                                       const bool order_data_by_frequency,
+                                       const bool blocked_node_layout,
+                                       const double verify_sample_rate,
+                                       SV *data_encoder);
+extern AV *check_lookups(MMDBW_tree_s *tree,
+                         const char *const filename,
+                         const uint64_t random_count,
+                         uint64_t seed,
+                         SV *data_encoder);
+extern void project_tree(MMDBW_tree_s *tree,
+                         MMDBW_edition_s *editions,
+                         const size_t edition_count);
 extern uint32_t max_record_value(MMDBW_tree_s *tree);
 extern void start_iteration(MMDBW_tree_s *tree,
                             bool depth_first,
                             void *args,
                             MMDBW_iterator_callback callback);
+extern void start_blocked_iteration(MMDBW_tree_s *tree,
+                                    void *args,
+                                    MMDBW_iterator_callback callback);
 extern uint128_t
 flip_network_bit(MMDBW_tree_s *tree, uint128_t network, uint8_t depth);
+extern SV *key_for_data(SV *data);
 extern SV *data_for_key(MMDBW_tree_s *tree, const char *const key);
 extern void free_tree(MMDBW_tree_s *tree);
 extern void free_merge_cache(MMDBW_tree_s *tree);
@@ -0,0 +1,694 @@
+#include "EXTERN.h"
+#include "perl.h"
+#include "reader.h"
+#include "validate.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Without pthreads, the validation is done on the calling thread.
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Maps and arrays can only nest this deep if a pointer loops back to a value
+// containing it.
+#define MAX_DATA_DEPTH (512)
+
+#define MAX_THREADS (64)
+
+// The IPv4-mapped, Teredo, and 6to4 networks, which the writer points at the
+// IPv4 subtree when aliasing IPv6 to IPv4.
+#define IPV4_ALIAS_COUNT (3)
+
+typedef struct record_position_s {
+    int64_t node;
+    int right;
+} record_position_s;
+
+typedef struct database_s {
+    MMDBW_mmdb_s mmdb;
+    // The root of the IPv4 subtree at ::/96 in an IPv6 database and its
+    // parent on the ::/96 path, or -1.
+    int64_t ipv4_root;
+    int64_t ipv4_root_parent;
+    // The records of the alias networks, when the database is aliased. These
+    // are the only records other than the one at ::/96 that may point to the
+    // IPv4 root.
+    record_position_s ipv4_aliases[IPV4_ALIAS_COUNT];
+    int ipv4_alias_count;
+    // One bit per node, set when the node is reached.
+    uint8_t *reached_nodes;
+} database_s;
+
+typedef struct offsets_s {
+    uint32_t *offsets;
+    size_t count;
+    size_t capacity;
+} offsets_s;
+
+typedef struct subtree_s {
+    uint32_t node;
+    int depth;
+} subtree_s;
+
+typedef struct validation_s {
+    database_s *db;
+    subtree_s *subtrees;
+    size_t subtree_count;
+    size_t subtree_capacity;
+    size_t next_subtree;
+    uint32_t *data_offsets;
+    size_t data_offset_count;
+    size_t next_data_offset;
+#ifndef _WIN32
+    pthread_mutex_t error_lock;
+#endif
+    volatile int failed;
+    char error[256];
+} validation_s;
+
+typedef struct worker_s {
+    validation_s *validation;
+    // The depth at which subtrees are handed off to the threads, or -1 when
+    // the worker walks the whole subtree itself.
+    int split_depth;
+    offsets_s data_offsets;
+} worker_s;
+
+static void find_ipv4_root(database_s *db);
+static void find_ipv4_aliases(database_s *db);
+static bool may_point_to_ipv4_root(database_s *db,
+                                   uint32_t node,
+                                   const int right);
+static int default_thread_count(void);
+static void *walk_subtrees(void *void_worker);
+static void walk_node(worker_s *worker, uint32_t node, int depth);
+static void check_record(worker_s *worker,
+                         uint32_t node,
+                         const int right,
+                         const int depth);
+static bool mark_node_reached(database_s *db, uint32_t node);
+static size_t next_index(volatile size_t *index);
+static void add_subtree(validation_s *validation, uint32_t node, int depth);
+static void add_data_offset(offsets_s *offsets, uint32_t offset);
+static void collect_data_offsets(validation_s *validation,
+                                 worker_s *workers,
+                                 const int worker_count);
+static int compare_offsets(const void *a, const void *b);
+static void *validate_data_offsets(void *void_worker);
+static int validate_value(validation_s *validation,
+                          uint64_t offset,
+                          const int depth,
+                          uint64_t *next);
+static void fail(validation_s *validation, const char *const format, ...);
+static void run_workers(worker_s *workers,
+                        const int worker_count,
+                        void *(*start_routine)(void *));
+static void *checked_calloc(size_t count, size_t size);
+
+void validate_database(const char *const filename, int thread_count) {
+    database_s db = {.ipv4_root = -1, .ipv4_root_parent = -1};
+    open_mmdb(&db.mmdb, filename);
+
+    validation_s validation = {.db = &db};
+#ifndef _WIN32
+    pthread_mutex_init(&validation.error_lock, NULL);
+#endif
+
+    if (thread_count <= 0) {
+        thread_count = default_thread_count();
+    }
+    if (thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+
+    db.reached_nodes = checked_calloc(db.mmdb.node_count / 8 + 1, 1);
+    find_ipv4_root(&db);
+    find_ipv4_aliases(&db);
+
+    // We walk the top of the tree here and leave the subtrees below the split
+    // depth to the threads. We aim for several subtrees per thread, as the
+    // subtrees are rarely the same size.
+    int split_depth = 0;
+    while ((1 << split_depth) < thread_count * 8 &&
+           split_depth < (db.mmdb.ip_version == 6 ? 128 : 32)) {
+        split_depth++;
+    }
+
+    worker_s *workers = checked_calloc(thread_count + 1, sizeof(worker_s));
+    for (int i = 0; i <= thread_count; i++) {
+        workers[i].validation = &validation;
+        workers[i].split_depth = -1;
+    }
+
+    worker_s *top = &workers[thread_count];
+    top->split_depth = split_depth;
+    if (split_depth == 0) {
+        add_subtree(&validation, 0, 0);
+    } else {
+        walk_node(top, 0, 0);
+    }
+
+    if (!validation.failed) {
+        run_workers(workers, thread_count, walk_subtrees);
+    }
+
+    if (!validation.failed) {
+        collect_data_offsets(&validation, workers, thread_count + 1);
+        run_workers(workers, thread_count, validate_data_offsets);
+    }
+
+    for (int i = 0; i <= thread_count; i++) {
+        free(workers[i].data_offsets.offsets);
+    }
+    free(workers);
+    free(validation.subtrees);
+    free(validation.data_offsets);
+    free(db.reached_nodes);
+    close_mmdb(&db.mmdb);
+#ifndef _WIN32
+    pthread_mutex_destroy(&validation.error_lock);
+#endif
+
+    if (validation.failed) {
+        croak("%s is not a valid MaxMind DB file: %s",
+              filename,
+              validation.error);
+    }
+}
+
+// In an IPv6 database, the IPv4 space is the subtree at ::/96. The writer
+// points the IPv4-mapped and 6to4 networks at the root of that subtree, so
+// that is the only node that may be reached by more than one record.
+static void find_ipv4_root(database_s *db) {
+    if (db->mmdb.ip_version != 6) {
+        return;
+    }
+
+    uint32_t parent = 0;
+    uint32_t node = 0;
+    for (int i = 0; i < 96; i++) {
+        uint32_t value = mmdb_record_value(&db->mmdb, node, 0);
+        if (value >= db->mmdb.node_count) {
+            return;
+        }
+        parent = node;
+        node = value;
+    }
+
+    db->ipv4_root = node;
+    db->ipv4_root_parent = parent;
+}
+
+// The database is aliased if the IPv4-mapped network points at the IPv4 root,
+// as in a database written with alias_ipv6_to_ipv4. Only then may the other
+// alias networks point there as well.
+static void find_ipv4_aliases(database_s *db) {
+    static const struct {
+        uint8_t address[16];
+        int prefix_length;
+    } aliases[IPV4_ALIAS_COUNT] = {
+        {.address = {[10] = 0xff, [11] = 0xff}, .prefix_length = 96},
+        {.address = {0x20, 0x01}, .prefix_length = 32},
+        {.address = {0x20, 0x02}, .prefix_length = 16},
+    };
+
+    if (db->ipv4_root < 0) {
+        return;
+    }
+
+    for (int i = 0; i < IPV4_ALIAS_COUNT; i++) {
+        const int last_bit = aliases[i].prefix_length - 1;
+        uint32_t node = mmdb_lookup(&db->mmdb, aliases[i].address, last_bit);
+        const int right =
+            (aliases[i].address[last_bit >> 3] >> (7 - (last_bit & 7))) & 1;
+
+        bool is_alias =
+            node < db->mmdb.node_count &&
+            (int64_t)mmdb_record_value(&db->mmdb, node, right) ==
+                db->ipv4_root;
+        if (!is_alias) {
+            if (0 == i) {
+                return;
+            }
+            continue;
+        }
+
+        db->ipv4_aliases[db->ipv4_alias_count++] =
+            (record_position_s){.node = node, .right = right};
+    }
+}
+
+// Besides the alias records, only the record at ::/96 may point to the IPv4
+// root.
+static bool may_point_to_ipv4_root(database_s *db,
+                                   uint32_t node,
+                                   const int right) {
+    if ((int64_t)node == db->ipv4_root_parent && 0 == right) {
+        return true;
+    }
+
+    for (int i = 0; i < db->ipv4_alias_count; i++) {
+        if (db->ipv4_aliases[i].node == (int64_t)node &&
+            db->ipv4_aliases[i].right == right) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int default_thread_count(void) {
+#ifndef _WIN32
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+#else
+    return 1;
+#endif
+}
+
+static void *walk_subtrees(void *void_worker) {
+    worker_s *worker = void_worker;
+    validation_s *validation = worker->validation;
+
+    size_t i;
+    while (!validation->failed &&
+           (i = next_index(&validation->next_subtree)) <
+               validation->subtree_count) {
+        subtree_s *subtree = &validation->subtrees[i];
+        walk_node(worker, subtree->node, subtree->depth);
+    }
+
+    return NULL;
+}
+
+static void walk_node(worker_s *worker, uint32_t node, int depth) {
+    validation_s *validation = worker->validation;
+    if (validation->failed) {
+        return;
+    }
+
+    if (!mark_node_reached(validation->db, node)) {
+        fail(validation, "node %" PRIu32 " is reached more than once", node);
+        return;
+    }
+
+    check_record(worker, node, 0, depth + 1);
+    check_record(worker, node, 1, depth + 1);
+}
+
+// The depth is the number of bits of the address used to reach the record.
+static void check_record(worker_s *worker,
+                         uint32_t node,
+                         const int right,
+                         const int depth) {
+    validation_s *validation = worker->validation;
+    database_s *db = validation->db;
+    uint32_t value = mmdb_record_value(&db->mmdb, node, right);
+    const char *const side = right ? "right" : "left";
+
+    if (value < db->mmdb.node_count) {
+        // Any other record reaching a node twice is caught when the node is
+        // marked as reached.
+        if ((int64_t)value == db->ipv4_root) {
+            if (!may_point_to_ipv4_root(db, node, right)) {
+                fail(validation,
+                     "the %s record of node %" PRIu32
+                     " points to the IPv4 root node %" PRIu32
+                     " but is not an IPv4 alias, which is a cycle",
+                     side,
+                     node,
+                     value);
+                return;
+            }
+            // The alias records point to the subtree walked from ::/96.
+            if ((int64_t)node != db->ipv4_root_parent || 0 != right) {
+                return;
+            }
+        }
+        if (depth >= (db->mmdb.ip_version == 6 ? 128 : 32)) {
+            fail(validation,
+                 "the %s record of node %" PRIu32
+                 " is at the last bit of the address but points to node "
+                 "%" PRIu32,
+                 side,
+                 node,
+                 value);
+            return;
+        }
+
+        if (depth == worker->split_depth) {
+            add_subtree(validation, value, depth);
+        } else {
+            walk_node(worker, value, depth);
+        }
+        return;
+    }
+
+    if (value == db->mmdb.node_count) {
+        return;
+    }
+
+    uint64_t offset =
+        (uint64_t)value - db->mmdb.node_count - DATA_SECTION_SEPARATOR_SIZE;
+    if (value - db->mmdb.node_count < DATA_SECTION_SEPARATOR_SIZE ||
+        offset >= db->mmdb.data_section_size) {
+        fail(validation,
+             "the %s record of node %" PRIu32 " has the value %" PRIu32
+             ", which is outside the data section",
+             side,
+             node,
+             value);
+        return;
+    }
+
+    add_data_offset(&worker->data_offsets, offset);
+}
+
+// Returns false if the node had already been reached.
+static bool mark_node_reached(database_s *db, uint32_t node) {
+    const uint8_t bit = 1 << (node & 7);
+#ifndef _WIN32
+    return !(__sync_fetch_and_or(&db->reached_nodes[node >> 3], bit) & bit);
+#else
+    const uint8_t reached = db->reached_nodes[node >> 3];
+    db->reached_nodes[node >> 3] |= bit;
+    return !(reached & bit);
+#endif
+}
+
+// Returns the next subtree or data offset for a worker to validate.
+static size_t next_index(volatile size_t *index) {
+#ifndef _WIN32
+    return __sync_fetch_and_add(index, 1);
+#else
+    return (*index)++;
+#endif
+}
+
+// This is only called from the thread walking the top of the tree.
+static void add_subtree(validation_s *validation, uint32_t node, int depth) {
+    if (validation->subtree_count == validation->subtree_capacity) {
+        validation->subtree_capacity =
+            validation->subtree_capacity ? validation->subtree_capacity * 2
+                                         : 64;
+        validation->subtrees =
+            realloc(validation->subtrees,
+                    validation->subtree_capacity * sizeof(subtree_s));
+        if (NULL == validation->subtrees) {
+            abort();
+        }
+    }
+
+    validation->subtrees[validation->subtree_count++] =
+        (subtree_s){.node = node, .depth = depth};
+}
+
+static void add_data_offset(offsets_s *offsets, uint32_t offset) {
+    // Neighboring records very often point to the same data.
+    if (offsets->count && offsets->offsets[offsets->count - 1] == offset) {
+        return;
+    }
+
+    if (offsets->count == offsets->capacity) {
+        offsets->capacity = offsets->capacity ? offsets->capacity * 2 : 1024;
+        offsets->offsets =
+            realloc(offsets->offsets, offsets->capacity * sizeof(uint32_t));
+        if (NULL == offsets->offsets) {
+            abort();
+        }
+    }
+
+    offsets->offsets[offsets->count++] = offset;
+}
+
+// Each distinct data offset only needs to be validated once, no matter how
+// many records point to it.
+static void collect_data_offsets(validation_s *validation,
+                                 worker_s *workers,
+                                 const int worker_count) {
+    size_t count = 0;
+    for (int i = 0; i < worker_count; i++) {
+        count += workers[i].data_offsets.count;
+    }
+    if (0 == count) {
+        return;
+    }
+
+    uint32_t *offsets = checked_calloc(count, sizeof(uint32_t));
+    size_t i = 0;
+    for (int w = 0; w < worker_count; w++) {
+        memcpy(&offsets[i],
+               workers[w].data_offsets.offsets,
+               workers[w].data_offsets.count * sizeof(uint32_t));
+        i += workers[w].data_offsets.count;
+    }
+
+    qsort(offsets, count, sizeof(uint32_t), compare_offsets);
+
+    size_t unique = 0;
+    for (i = 0; i < count; i++) {
+        if (0 == unique || offsets[unique - 1] != offsets[i]) {
+            offsets[unique++] = offsets[i];
+        }
+    }
+
+    validation->data_offsets = offsets;
+    validation->data_offset_count = unique;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const uint32_t offset_a = *(const uint32_t *)a;
+    const uint32_t offset_b = *(const uint32_t *)b;
+
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+static void *validate_data_offsets(void *void_worker) {
+    worker_s *worker = void_worker;
+    validation_s *validation = worker->validation;
+
+    size_t i;
+    while (!validation->failed &&
+           (i = next_index(&validation->next_data_offset)) <
+               validation->data_offset_count) {
+        uint64_t next;
+        validate_value(validation, validation->data_offsets[i], 0, &next);
+    }
+
+    return NULL;
+}
+
+// Returns the type of the value at the offset, after following a pointer, or
+// -1 if it is not valid. `next' is set to the offset after the value.
+static int validate_value(validation_s *validation,
+                          uint64_t offset,
+                          const int depth,
+                          uint64_t *next) {
+    database_s *db = validation->db;
+    const uint8_t *const data = db->mmdb.data_section;
+    const size_t size = db->mmdb.data_section_size;
+
+    if (depth > MAX_DATA_DEPTH) {
+        fail(validation,
+             "the data at offset %" PRIu64 " is nested too deeply",
+             offset);
+        return -1;
+    }
+
+    MMDBW_mmdb_entry_s entry;
+    if (!mmdb_decode_control(data, size, offset, &entry)) {
+        fail(validation,
+             "there is no valid control byte at data section offset %" PRIu64,
+             offset);
+        return -1;
+    }
+
+    if (MMDBW_TYPE_POINTER == entry.type) {
+        *next = entry.payload;
+        if (entry.size >= size) {
+            fail(validation,
+                 "the pointer at data section offset %" PRIu64
+                 " points outside the data section",
+                 offset);
+            return -1;
+        }
+        if (MMDBW_TYPE_POINTER == data[entry.size] >> 5) {
+            fail(validation,
+                 "the pointer at data section offset %" PRIu64
+                 " points to another pointer",
+                 offset);
+            return -1;
+        }
+
+        uint64_t unused;
+        return validate_value(validation, entry.size, depth + 1, &unused);
+    }
+
+    uint64_t max_size = 0;
+    switch (entry.type) {
+        case MMDBW_TYPE_MAP:
+            *next = entry.payload;
+            for (uint64_t i = 0; i < entry.size; i++) {
+                int key_type =
+                    validate_value(validation, *next, depth + 1, next);
+                if (key_type < 0) {
+                    return -1;
+                }
+                if (MMDBW_TYPE_UTF8_STRING != key_type) {
+                    fail(validation,
+                         "the map at data section offset %" PRIu64
+                         " has a key that is not a string",
+                         offset);
+                    return -1;
+                }
+                if (validate_value(validation, *next, depth + 1, next) < 0) {
+                    return -1;
+                }
+            }
+            return entry.type;
+        case MMDBW_TYPE_ARRAY:
+            *next = entry.payload;
+            for (uint64_t i = 0; i < entry.size; i++) {
+                if (validate_value(validation, *next, depth + 1, next) < 0) {
+                    return -1;
+                }
+            }
+            return entry.type;
+        case MMDBW_TYPE_BOOLEAN:
+            *next = entry.payload;
+            if (entry.size > 1) {
+                fail(validation,
+                     "the boolean at data section offset %" PRIu64
+                     " has the value %" PRIu64,
+                     offset,
+                     entry.size);
+                return -1;
+            }
+            return entry.type;
+        case MMDBW_TYPE_UTF8_STRING:
+        case MMDBW_TYPE_BYTES:
+            max_size = size;
+            break;
+        case MMDBW_TYPE_DOUBLE:
+        case MMDBW_TYPE_FLOAT:
+            max_size = MMDBW_TYPE_DOUBLE == entry.type ? 8 : 4;
+            if (entry.size != max_size) {
+                fail(validation,
+                     "the %s at data section offset %" PRIu64
+                     " is %" PRIu64 " bytes long",
+                     MMDBW_TYPE_DOUBLE == entry.type ? "double" : "float",
+                     offset,
+                     entry.size);
+                return -1;
+            }
+            break;
+        case MMDBW_TYPE_UINT16:
+            max_size = 2;
+            break;
+        case MMDBW_TYPE_UINT32:
+        case MMDBW_TYPE_INT32:
+            max_size = 4;
+            break;
+        case MMDBW_TYPE_UINT64:
+            max_size = 8;
+            break;
+        case MMDBW_TYPE_UINT128:
+            max_size = 16;
+            break;
+        default:
+            fail(validation,
+                 "the data at data section offset %" PRIu64
+                 " has the invalid type %d",
+                 offset,
+                 entry.type);
+            return -1;
+    }
+
+    if (entry.size > max_size) {
+        fail(validation,
+             "the number at data section offset %" PRIu64
+             " is %" PRIu64 " bytes long",
+             offset,
+             entry.size);
+        return -1;
+    }
+    if (entry.payload + entry.size > size) {
+        fail(validation,
+             "the data at data section offset %" PRIu64
+             " runs past the end of the data section",
+             offset);
+        return -1;
+    }
+
+    *next = entry.payload + entry.size;
+    return entry.type;
+}
+
+// Only the first failure is kept.
+static void fail(validation_s *validation, const char *const format, ...) {
+#ifndef _WIN32
+    pthread_mutex_lock(&validation->error_lock);
+#endif
+    if (!validation->failed) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(validation->error, sizeof(validation->error), format, args);
+        va_end(args);
+        validation->failed = 1;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&validation->error_lock);
+#endif
+}
+
+// With a single worker we do the work on the calling thread.
+static void run_workers(worker_s *workers,
+                        const int worker_count,
+                        void *(*start_routine)(void *)) {
+#ifdef _WIN32
+    // The workers take their work from the shared lists, so one worker does
+    // all of it.
+    (void)worker_count;
+    start_routine(&workers[0]);
+#else
+    if (1 == worker_count) {
+        start_routine(&workers[0]);
+        return;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    for (; started < worker_count; started++) {
+        if (pthread_create(
+                &threads[started], NULL, start_routine, &workers[started])) {
+            break;
+        }
+    }
+
+    // If we could not start any threads, we still want the work done.
+    if (0 == started) {
+        start_routine(&workers[0]);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+}
+
+static void *checked_calloc(size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    if (!ptr) {
+        abort();
+    }
+
+    return ptr;
+}
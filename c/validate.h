@@ -0,0 +1,9 @@
+#ifndef MMDBW_VALIDATE_H
+#define MMDBW_VALIDATE_H
+
+// Checks the structure of a finished MaxMind DB file, croaking with a
+// description of the first problem found. A thread_count of 0 uses one
+// thread per online CPU.
+extern void validate_database(const char *const filename, int thread_count);
+
+#endif
@@ -33,6 +33,11 @@ my $mb = Module::Build->new(
 );
 
 $mb->extra_compiler_flags( _cc_flags($mb) );
+# The database validator only uses threads where it has pthreads.
+$mb->extra_linker_flags(
+    ( $^O =~ /Win32/ ? () : '-lpthread' ),
+    @{ $mb->extra_linker_flags || [] },
+);
 
 $mb->create_build_script();
 
@@ -45,10 +45,20 @@ has buffer => (
 );
 
 has _map_key_type_callback => (
+    is        => 'ro',
+    isa       => 'CodeRef',
+    init_arg  => 'map_key_type_callback',
+    predicate => '_has_map_key_type_callback',
+);
+
+# Types for map keys that are known up front. These are checked before the
+# callback, so a schema covering all of the keys means we never call back into
+# user code while encoding.
+has _map_key_types => (
     is       => 'ro',
-    isa      => 'CodeRef',
-    init_arg => 'map_key_type_callback',
-    required => 1,
+    isa      => 'HashRef',
+    init_arg => 'map_key_types',
+    default  => sub { {} },
 );
 
 # This is settable so we can more easily test the encoding portion of the code
@@ -73,6 +83,24 @@ has _cache => (
     },
 );
 
+# How often each cacheable value passed to count_shared_values() would be
+# stored, and the values seen more than once, keyed like the cache.
+has _shared_counts => (
+    is       => 'ro',
+    isa      => 'HashRef',
+    init_arg => undef,
+    lazy     => 1,
+    default  => sub { {} },
+);
+
+has _shared_values => (
+    is       => 'ro',
+    isa      => 'HashRef',
+    init_arg => undef,
+    lazy     => 1,
+    default  => sub { {} },
+);
+
 has _decoder => (
     is       => 'ro',
     isa      => 'MaxMind::DB::Reader::Decoder',
@@ -83,6 +111,54 @@ has _decoder => (
 
 my $MinimumCacheableSize = 4;
 
+my %MapKeyTypes = map { $_ => 1 } qw(
+    array
+    boolean
+    bytes
+    double
+    float
+    int32
+    map
+    uint128
+    uint16
+    uint32
+    uint64
+    utf8_string
+);
+
+sub BUILD {
+    my $self = shift;
+
+    # The encoding code reads these directly from the object, so the lazy
+    # defaults need to be in place before anything is stored.
+    $self->buffer();
+    $self->_cache();
+
+    my $types = $self->_map_key_types();
+
+    confess 'You must provide a map_key_type_callback or map_key_types'
+        unless $self->_has_map_key_type_callback() || %{$types};
+
+    for my $key ( sort keys %{$types} ) {
+        my ( $type, $array_value_type )
+            = ref $types->{$key} eq 'ARRAY'
+            ? @{ $types->{$key} }
+            : $types->{$key};
+
+        my $valid
+            = defined $type
+            && $MapKeyTypes{$type}
+            && ( $type eq 'array'
+            ? defined $array_value_type && $MapKeyTypes{$array_value_type}
+            : !defined $array_value_type );
+
+        confess qq{Invalid type for map key "$key" in map_key_types}
+            unless $valid;
+    }
+
+    return;
+}
+
 sub store_data {
     my $self         = shift;
     my $type         = shift;
@@ -98,15 +174,18 @@ sub store_data {
     $self->_debug_string( 'Storing type', $type )
         if DEBUG;
 
-    return $self->_store_data( $type, $data, $member_type )
-        unless $self->_should_cache_value( $type, $data );
+    return _store_data( $self, $type, $data, $member_type )
+        unless _should_cache_value( $self, $type, $data );
 
-    $key_for_data //= key_for_data($data);
+    $key_for_data
+        = ref $data
+        ? $key_for_data // key_for_data($data)
+        : _key_for_scalar( $type, $data );
 
     $self->_debug_string( 'Cache key', $key_for_data )
         if DEBUG;
 
-    my $position = $self->_position_for_data($key_for_data);
+    my $position = $self->{_cache}{$key_for_data};
 
     if ( defined $position ) {
         if (DEBUG) {
@@ -114,19 +193,144 @@ sub store_data {
             $self->_debug_string( 'Storing pointer to',     $position );
         }
 
-        return $self->_store_data( pointer => $position );
+        return _store_data( $self, pointer => $position );
     }
     else {
         my $stored_position
-            = $self->_store_data( $type, $data, $member_type );
+            = _store_data( $self, $type, $data, $member_type );
         $self->_debug_string( 'Stored data at position', $stored_position )
             if DEBUG;
-        $self->_save_position( $key_for_data => $stored_position );
+        $self->{_cache}{$key_for_data} = $stored_position;
 
         return $stored_position;
     }
 }
 
+# Counts how often each value nested in the given distinct top-level values
+# would otherwise be pointed to from the data section. This can be called
+# several times with batches of values, so the caller does not need to have
+# them all in memory at once. Only the values seen more than once are kept
+# until store_shared_values() is called.
+#
+# Each value is only walked once, as anything nested in a value we have
+# already seen will be stored as a pointer to that value.
+sub count_shared_values {
+    my $self   = shift;
+    my $type   = shift;
+    my $values = shift;
+
+    my $counts = $self->_shared_counts();
+    my $shared = $self->_shared_values();
+    $self->_count_references( $type, $_, undef, $counts, $shared )
+        for @{$values};
+
+    return;
+}
+
+# Stores the values that would otherwise be pointed to from more than one place
+# in the data section, most pointed to first. Pointers to low positions are
+# smaller (1 byte for the first 2KB, 2 bytes for the first 512KB), so this
+# shrinks the data section when it is called before anything else is stored.
+#
+# The values are those counted by count_shared_values(). Passing a type and an
+# array of values counts them first.
+sub store_shared_values {
+    my $self = shift;
+
+    $self->count_shared_values(@_) if @_;
+
+    my $counts = $self->_shared_counts();
+    my $shared = $self->_shared_values();
+
+    my @shared = sort { $counts->{$b} <=> $counts->{$a} || $a cmp $b }
+        keys %{$shared};
+
+    $self->store_data( @{ $shared->{$_} }, $_ ) for @shared;
+
+    %{$counts} = ();
+    %{$shared} = ();
+
+    return;
+}
+
+sub _count_references {
+    my $self        = shift;
+    my $type        = shift;
+    my $data        = shift;
+    my $member_type = shift;
+    my $counts      = shift;
+    my $shared      = shift;
+
+    if ( $self->_should_cache_value( $type, $data ) ) {
+        my $key
+            = ref $data
+            ? key_for_data($data)
+            : _key_for_scalar( $type, $data );
+        my $count = $counts->{$key}++;
+        $shared->{$key} = [ $type, $data, $member_type ] if $count == 1;
+        return if $count;
+    }
+
+    if ( $type eq 'map' ) {
+        for my $k ( keys %{$data} ) {
+            $self->_count_references(
+                utf8_string => $k, undef, $counts,
+                $shared
+            );
+
+            my $value_type = $self->_type_for_key( $k, $data->{$k} );
+            my $array_value_type;
+            if ( ref $value_type ) {
+                ( $value_type, $array_value_type ) = @{$value_type};
+            }
+
+            $self->_count_references(
+                $value_type, $data->{$k}, $array_value_type, $counts,
+                $shared
+            );
+        }
+    }
+    elsif ( $type eq 'array' ) {
+        $self->_count_references( $member_type, $_, undef, $counts, $shared )
+            for @{$data};
+    }
+
+    return;
+}
+
+# Most of what we cache is map keys and other strings, so hashing them with
+# key_for_data() would be most of the cost of storing a record. A scalar is
+# instead keyed by its type and its value, which the Perl hash holding the
+# cache compares directly. The type is needed because the same value has a
+# different encoding as, say, a utf8_string and a double. These keys cannot
+# collide with those from key_for_data(), as base64 never contains a "\0".
+sub _key_for_scalar {
+    return "$_[0]\0$_[1]";
+}
+
+# Returns the encoding of the data on its own rather than storing it in the
+# buffer. This requires that deduplication be disabled, as a pointer in the
+# encoding would not point at anything once the bytes are copied elsewhere.
+sub encode_data {
+    my $self        = shift;
+    my $type        = shift;
+    my $data        = shift;
+    my $member_type = shift;
+
+    confess 'Cannot encode data on its own when deduplicating data'
+        if $self->_deduplicate_data();
+
+    confess 'Cannot store an undef as data'
+        unless defined $data;
+
+    my $buffer = $self->{buffer};
+    ${$buffer} = q{};
+
+    _store_data( $self, $type, $data, $member_type );
+
+    return ${$buffer};
+}
+
 if (VERIFY) {
     around store_data => sub {
         my $orig        = shift;
@@ -162,7 +366,7 @@ sub _should_cache_value {
     my $type = shift;
     my $data = shift;
 
-    return 0 unless $self->_deduplicate_data();
+    return 0 unless $self->{_deduplicate_data};
 
     if ( $NeverCache{$type} ) {
         $self->_debug_string( 'Never cache type', $type )
@@ -198,6 +402,12 @@ sub _should_cache_value {
     }
 }
 
+# The encoders for each type, which are filled in below once they have been
+# defined. Everything called for each value that is stored is called as a
+# plain sub rather than as a method, and reads the object's attributes
+# directly, as this is the innermost loop when writing a tree.
+my %Encoders;
+
 sub _store_data {
     my $self        = shift;
     my $type        = shift;
@@ -205,10 +415,11 @@ sub _store_data {
     my $member_type = shift;
 
     ## no critic (ProhibitCallsToUnexportedSubs)
-    my $current_position = bytes::length ${ $self->buffer() };
+    my $current_position = bytes::length ${ $self->{buffer} };
 
-    my $method = '_encode_' . $type;
-    $self->$method( $data, $member_type );
+    my $encoder = $Encoders{$type}
+        or confess "Cannot store data of unknown type $type";
+    $encoder->( $self, $data, $member_type );
 
     # We don't add 1 byte because the first byte we can point to is byte 0
     # (not 1).
@@ -237,24 +448,45 @@ push @pointer_thresholds,
     offset => 0,
     };
 
+sub _pack_1_byte_pointer {
+    return pack( n => $_[1] );
+}
+
+sub _pack_2_byte_pointer {
+    return substr( pack( N => $_[1] ), 1, 3 );
+}
+
+sub _pack_3_byte_pointer {
+    return pack( N => $_[1] );
+}
+
+sub _pack_4_byte_pointer {
+    return pack( N => $_[1] );
+}
+
+my @PointerPackers = (
+    \&_pack_1_byte_pointer,
+    \&_pack_2_byte_pointer,
+    \&_pack_3_byte_pointer,
+    \&_pack_4_byte_pointer,
+);
+
 ## no critic (ProhibitUnusedPrivateSubroutines)
 sub _encode_pointer {
     my $self  = shift;
     my $value = shift;
 
-    $self->_require_x_bits_unsigned_integer( 32, $value );
+    _require_x_bits_unsigned_integer( $self, 32, $value );
 
     my $ctrl_byte
-        = ord( $self->_control_bytes( $TypeNameToNum{pointer}, 0 ) );
+        = ord( _control_bytes( $self, $TypeNameToNum{pointer}, 0 ) );
 
     my @value_bytes;
     for my $n ( 0 .. 3 ) {
         if ( $value < $pointer_thresholds[$n]{cutoff} ) {
-
-            my $pack_method = '_pack_' . ( $n + 1 ) . '_byte_pointer';
             @value_bytes = split //,
-                $self->$pack_method(
-                $value - $pointer_thresholds[$n]{offset} );
+                $PointerPackers[$n]
+                ->( $self, $value - $pointer_thresholds[$n]{offset} );
 
             if ( $n == 3 ) {
                 $ctrl_byte |= ( 3 << 3 );
@@ -267,23 +499,7 @@ sub _encode_pointer {
         }
     }
 
-    $self->_write_encoded_data( pack( 'C', $ctrl_byte ), @value_bytes );
-}
-
-sub _pack_1_byte_pointer {
-    return pack( n => $_[1] );
-}
-
-sub _pack_2_byte_pointer {
-    return substr( pack( N => $_[1] ), 1, 3 );
-}
-
-sub _pack_3_byte_pointer {
-    return pack( N => $_[1] );
-}
-
-sub _pack_4_byte_pointer {
-    return pack( N => $_[1] );
+    _write_encoded_data( $self, pack( 'C', $ctrl_byte ), @value_bytes );
 }
 
 sub _encode_utf8_string {
@@ -291,15 +507,26 @@ sub _encode_utf8_string {
 
     my $string = shift;
 
-    $self->_simple_encode(
-        utf8_string => encode( 'UTF-8', $string, FB_CROAK ) );
+    # Encode is slow, and a string without the UTF-8 flag only holds Latin-1
+    # characters, which are always valid. utf8::encode() gives the same bytes
+    # for those.
+    my $encoded;
+    if ( is_utf8($string) ) {
+        $encoded = encode( 'UTF-8', $string, FB_CROAK );
+    }
+    else {
+        utf8::encode( $encoded = $string );
+    }
+
+    _simple_encode( $self, utf8_string => $encoded );
 }
 
 sub _encode_double {
     my $self = shift;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes( $TypeNameToNum{double}, 8, ),
+    _write_encoded_data(
+        $self,
+        _control_bytes( $self, $TypeNameToNum{double}, 8, ),
         pack_double_be(shift)
     );
 }
@@ -307,8 +534,9 @@ sub _encode_double {
 sub _encode_float {
     my $self = shift;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes( $TypeNameToNum{float}, 4, ),
+    _write_encoded_data(
+        $self,
+        _control_bytes( $self, $TypeNameToNum{float}, 4, ),
         pack_float_be(shift)
     );
 }
@@ -320,39 +548,41 @@ sub _encode_bytes {
     die "You attempted to store a characters string ($bytes) as bytes"
         if is_utf8($bytes);
 
-    $self->_simple_encode( bytes => $bytes );
+    _simple_encode( $self, bytes => $bytes );
 }
 
 sub _encode_uint16 {
     my $self = shift;
 
-    $self->_encode_unsigned_int( 16 => @_ );
+    _encode_unsigned_int( $self, 16 => @_ );
 }
 
 sub _encode_uint32 {
     my $self = shift;
 
-    $self->_encode_unsigned_int( 32 => @_ );
+    _encode_unsigned_int( $self, 32 => @_ );
 }
 
 sub _encode_map {
     my $self = shift;
     my $map  = shift;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes( $TypeNameToNum{map}, scalar keys %{$map} ) );
+    _write_encoded_data(
+        $self,
+        _control_bytes( $self, $TypeNameToNum{map}, scalar keys %{$map} )
+    );
 
     # We sort to make testing possible.
     for my $k ( sort keys %{$map} ) {
-        $self->store_data( utf8_string => $k );
+        store_data( $self, utf8_string => $k );
 
-        my $value_type = $self->_type_for_key( $k, $map->{$k} );
+        my $value_type = _type_for_key( $self, $k, $map->{$k} );
         my $array_value_type;
         if ( ref $value_type ) {
             ( $value_type, $array_value_type ) = @{$value_type};
         }
 
-        $self->store_data( $value_type, $map->{$k}, $array_value_type );
+        store_data( $self, $value_type, $map->{$k}, $array_value_type );
     }
 }
 
@@ -363,10 +593,12 @@ sub _encode_array {
 
     die 'No value type for array!' unless defined $value_type;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes( $TypeNameToNum{array}, scalar @{$array} ) );
+    _write_encoded_data(
+        $self,
+        _control_bytes( $self, $TypeNameToNum{array}, scalar @{$array} )
+    );
 
-    $self->store_data( $value_type, $_ ) for @{$array};
+    store_data( $self, $value_type, $_ ) for @{$array};
 }
 
 sub _type_for_key {
@@ -374,7 +606,10 @@ sub _type_for_key {
     my $key   = shift;
     my $value = shift;
 
-    my $type = $self->_map_key_type_callback->( $key, $value );
+    my $type = $self->{_map_key_types}{$key}
+        // ( $self->{_map_key_type_callback}
+        ? $self->{_map_key_type_callback}->( $key, $value )
+        : undef );
 
     die qq{Could not determine the type for map key "$key"}
         unless $type;
@@ -389,9 +624,12 @@ sub _encode_int32 {
     my $encoded_value = pack( 'N!' => $value );
     $encoded_value =~ s/^\x00+//;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes(
-            $TypeNameToNum{int32}, length($encoded_value)
+    _write_encoded_data(
+        $self,
+        _control_bytes(
+            $self,
+            $TypeNameToNum{int32},
+            length($encoded_value)
         ),
         $encoded_value,
     );
@@ -400,27 +638,29 @@ sub _encode_int32 {
 sub _encode_uint64 {
     my $self = shift;
 
-    $self->_encode_unsigned_int( 64 => @_ );
+    _encode_unsigned_int( $self, 64 => @_ );
 }
 
 sub _encode_uint128 {
     my $self = shift;
 
-    $self->_encode_unsigned_int( 128 => @_ );
+    _encode_unsigned_int( $self, 128 => @_ );
 }
 
 sub _encode_boolean {
     my $self  = shift;
     my $value = shift;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes( $TypeNameToNum{boolean}, $value ? 1 : 0 ) );
+    _write_encoded_data(
+        $self,
+        _control_bytes( $self, $TypeNameToNum{boolean}, $value ? 1 : 0 )
+    );
 }
 
 sub _encode_end_marker {
     my $self = shift;
 
-    $self->_simple_encode( 'end_marker', q{} );
+    _simple_encode( $self, 'end_marker', q{} );
 }
 
 sub _simple_encode {
@@ -428,8 +668,9 @@ sub _simple_encode {
     my $type  = shift;
     my $value = shift;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes( $TypeNameToNum{$type}, length($value) ),
+    _write_encoded_data(
+        $self,
+        _control_bytes( $self, $TypeNameToNum{$type}, length($value) ),
         $value,
     );
 }
@@ -439,7 +680,7 @@ sub _encode_unsigned_int {
     my $bits  = shift;
     my $value = shift;
 
-    $self->_require_x_bits_unsigned_integer( $bits, $value );
+    _require_x_bits_unsigned_integer( $self, $bits, $value );
 
     my $encoded_value;
     if ( $bits >= 64 ) {
@@ -451,8 +692,10 @@ sub _encode_unsigned_int {
 
     $encoded_value =~ s/^\x00+//;
 
-    $self->_write_encoded_data(
-        $self->_control_bytes(
+    _write_encoded_data(
+        $self,
+        _control_bytes(
+            $self,
             $TypeNameToNum{ 'uint' . $bits },
             length($encoded_value)
         ),
@@ -461,6 +704,23 @@ sub _encode_unsigned_int {
 }
 ## use critic
 
+%Encoders = (
+    array       => \&_encode_array,
+    boolean     => \&_encode_boolean,
+    bytes       => \&_encode_bytes,
+    double      => \&_encode_double,
+    end_marker  => \&_encode_end_marker,
+    float       => \&_encode_float,
+    int32       => \&_encode_int32,
+    map         => \&_encode_map,
+    pointer     => \&_encode_pointer,
+    uint128     => \&_encode_uint128,
+    uint16      => \&_encode_uint16,
+    uint32      => \&_encode_uint32,
+    uint64      => \&_encode_uint64,
+    utf8_string => \&_encode_utf8_string,
+);
+
 {
     my %Max = (
         16 => ( 2**16 ) - 1,
@@ -513,11 +773,25 @@ sub _encode_unsigned_int {
         4 => 29 + 256 + 2**16 + 2**24,
     );
 
+    # Nearly every value has a size that fits in one or two bytes, so we only
+    # build the control bytes for each of those type and size pairs once.
+    my @Cache;
+
     sub _control_bytes {
         my $self = shift;
         my $type = shift;
         my $size = shift;
 
+        return $Cache[$type][$size] //= _build_control_bytes( $type, $size )
+            if $size <= $ThresholdSize{2};
+
+        return _build_control_bytes( $type, $size );
+    }
+
+    sub _build_control_bytes {
+        my $type = shift;
+        my $size = shift;
+
         if ( $size >= $ThresholdSize{4} ) {
             die "Cannot store $size bytes - max size is "
                 . ( $ThresholdSize{4} - 1 )
@@ -576,7 +850,7 @@ sub _encode_unsigned_int {
 sub _write_encoded_data {
     my $self = shift;
 
-    ${ $self->buffer() } .= $_ for @_;
+    ${ $self->{buffer} } .= $_ for @_;
 
     $self->_debug_binary( 'Wrote', join q{}, @_ )
         if DEBUG;
@@ -16,9 +16,11 @@ use MaxMind::DB::Common 0.031003 qw(
 );
 use MaxMind::DB::Metadata;
 use MaxMind::DB::Writer::Serializer;
+use MaxMind::DB::Writer::Tree::DataHandle;
 use MaxMind::DB::Writer::Util qw( key_for_data );
 use MooseX::Params::Validate qw( validated_list );
 use Sereal::Decoder qw( decode_sereal );
+use Scalar::Util qw( blessed );
 use Sereal::Encoder qw( encode_sereal );
 
 use Moose;
@@ -68,6 +70,61 @@ has remove_reserved_networks => (
     default => 1,
 );
 
+has pack_data => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+has mark_and_sweep_data => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+has eager_serialize => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+has optimize_pointer_sizes => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+has order_data_by_frequency => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+has blocked_node_layout => (
+    is      => 'ro',
+    isa     => 'Bool',
+    default => 0,
+);
+
+has previous_database => (
+    is        => 'ro',
+    isa       => 'Str',
+    predicate => '_has_previous_database',
+);
+
+#<<<
+my $SampleRateType = subtype
+    as 'Num',
+    where { $_ >= 0 && $_ <= 1 },
+    message { 'The sample rate must be a number from 0 to 1' };
+#>>>
+
+has verify_data_sample_rate => (
+    is      => 'ro',
+    isa     => $SampleRateType,
+    default => 0,
+);
+
 has _tree => (
     is        => 'ro',
     lazy      => 1,
@@ -85,9 +142,15 @@ has _root_data_type => (
 );
 
 has map_key_type_callback => (
-    is       => 'ro',
-    isa      => 'CodeRef',
-    required => 1,
+    is        => 'ro',
+    isa       => 'CodeRef',
+    predicate => '_has_map_key_type_callback',
+);
+
+has map_key_types => (
+    is      => 'ro',
+    isa     => 'HashRef',
+    default => sub { {} },
 );
 
 has database_type => (
@@ -164,7 +227,13 @@ around BUILDARGS => sub {
 
 # The XS code expects $self->{_tree} to be populated.
 sub BUILD {
-    $_[0]->_tree();
+    my $self = shift;
+
+    die 'You must provide a map_key_type_callback or map_key_types'
+        unless $self->_has_map_key_type_callback
+        || %{ $self->map_key_types };
+
+    $self->_tree();
 }
 
 sub _build_tree {
@@ -176,9 +245,43 @@ sub _build_tree {
         $self->merge_strategy,
         $self->alias_ipv6_to_ipv4,
         $self->remove_reserved_networks,
+        $self->pack_data,
+        $self->mark_and_sweep_data,
+        $self->eager_serialize
+        ? _data_encoder(
+            $self->_root_data_type,
+            $self->_map_key_type_args,
+            )
+        : undef,
+    );
+}
+
+sub _map_key_type_args {
+    my $self = shift;
+
+    return (
+        (
+            $self->_has_map_key_type_callback
+            ? ( map_key_type_callback => $self->map_key_type_callback )
+            : ()
+        ),
+        map_key_types => $self->map_key_types,
     );
 }
 
+# The encoder must not hold a reference to the tree object, as the C tree
+# keeps the encoder alive until the tree is freed.
+sub _data_encoder {
+    my $root_data_type = shift;
+
+    my $serializer = MaxMind::DB::Writer::Serializer->new(
+        @_,
+        _deduplicate_data => 0,
+    );
+
+    return sub { $serializer->encode_data( $root_data_type, $_[0] ) };
+}
+
 sub merge_record_collisions {
     warn
         'merge_record_collisions is deprecated and will be removed in a future release';
@@ -206,8 +309,7 @@ sub insert_network {
     $self->_insert_network(
         $ip_address,
         $prefix_length,
-        key_for_data($data),
-        $data,
+        _key_and_data($data),
         $merge_strategy,
     );
     return;
@@ -225,13 +327,94 @@ sub insert_range {
     $self->_insert_range(
         $start_ip_address,
         $end_ip_address,
-        key_for_data($data),
-        $data,
+        _key_and_data($data),
         $merge_strategy,
     );
     return;
 }
 
+sub insert_from_jsonl {
+    my $self     = shift;
+    my $filename = shift;
+    my ( $network_field, $merge_strategy ) = validated_list(
+        \@_,
+        network_field  => { isa => 'Str',              optional => 1 },
+        merge_strategy => { isa => $MergeStrategyEnum, optional => 1 },
+    );
+
+    $self->_insert_from_jsonl(
+        $filename,
+        $network_field,
+        $merge_strategy // q{},
+    );
+    return;
+}
+
+sub insert_from_csv {
+    my $self     = shift;
+    my $filename = shift;
+    my (
+        $data,            $id_column,      $network_column,
+        $first_ip_column, $last_ip_column, $merge_strategy,
+        )
+        = validated_list(
+        \@_,
+        data            => { isa => 'HashRef' },
+        id_column       => { isa => 'Str' },
+        network_column  => { isa => 'Str', default => 'network' },
+        first_ip_column => { isa => 'Str', optional => 1 },
+        last_ip_column  => { isa => 'Str', optional => 1 },
+        merge_strategy  => { isa => $MergeStrategyEnum, optional => 1 },
+        );
+
+    die 'You must pass both first_ip_column and last_ip_column or neither'
+        if defined $first_ip_column xor defined $last_ip_column;
+
+    # Finding the key for each id up front means it is only computed once,
+    # and the C code can look up both the key and the data by id. These are
+    # plain arrays so that the C code does not depend on how a handle, which
+    # may be a subclass, stores them.
+    my %key_and_data
+        = map { $_ => [ _key_and_data( $data->{$_} ) ] } keys %{$data};
+
+    $self->_insert_from_csv(
+        $filename,
+        ( defined $first_ip_column ? undef : $network_column ),
+        $first_ip_column,
+        $last_ip_column,
+        $id_column,
+        \%key_and_data,
+        $merge_strategy // q{},
+    );
+    return;
+}
+
+# A handle does not belong to a tree, so this can also be called as a class
+# method.
+sub data_handle {
+    shift;
+    my $data = shift;
+
+    return MaxMind::DB::Writer::Tree::DataHandle->new($data);
+}
+
+# A handle already knows its key, which saves encoding and hashing the data
+# again for every network inserted with it.
+sub _key_and_data {
+    my $data = shift;
+
+    return _is_data_handle($data)
+        ? ( $data->key, $data->data )
+        : ( key_for_data($data), $data );
+}
+
+sub _is_data_handle {
+    my $data = shift;
+
+    return blessed $data
+        && $data->isa('MaxMind::DB::Writer::Tree::DataHandle');
+}
+
 sub _merge_strategy {
     my $self = shift;
     my $args = shift;
@@ -280,8 +463,7 @@ sub _build_serializer {
     my $self = shift;
 
     return MaxMind::DB::Writer::Serializer->new(
-        map_key_type_callback => $self->map_key_type_callback(),
-    );
+        $self->_map_key_type_args() );
 }
 
 sub write_tree {
@@ -292,6 +474,18 @@ sub write_tree {
         $output,
         $self->_root_data_type(),
         $self->_serializer(),
+        $self->optimize_pointer_sizes(),
+        $self->order_data_by_frequency(),
+        $self->blocked_node_layout(),
+        $self->previous_database(),
+        $self->verify_data_sample_rate(),
+        ( $self->verify_data_sample_rate() || $self->_has_previous_database() )
+            && !$self->eager_serialize()
+        ? _data_encoder(
+            $self->_root_data_type(),
+            $self->_map_key_type_args(),
+            )
+        : undef,
     );
 
     $output->print(
@@ -302,6 +496,153 @@ sub write_tree {
     );
 }
 
+sub write_ipv4_tree {
+    my $self   = shift;
+    my $output = shift;
+
+    die 'write_ipv4_tree() can only be called on an IPv6 tree'
+        unless $self->ip_version() == 6;
+
+    # The tree's own serializer holds the data written by write_tree(), so the
+    # IPv4 database gets a serializer of its own.
+    my $serializer = $self->_build_serializer();
+
+    my $node_count = $self->_write_ipv4_search_tree(
+        $output,
+        $self->_root_data_type(),
+        $serializer,
+        $self->optimize_pointer_sizes(),
+        $self->order_data_by_frequency(),
+        $self->blocked_node_layout(),
+        $self->verify_data_sample_rate(),
+        $self->verify_data_sample_rate() && !$self->eager_serialize()
+        ? _data_encoder(
+            $self->_root_data_type(),
+            $self->_map_key_type_args(),
+            )
+        : undef,
+    );
+
+    $output->print(
+        DATA_SECTION_SEPARATOR,
+        ${ $serializer->buffer() },
+        METADATA_MARKER,
+        $self->_encoded_metadata(
+            ip_version => 4,
+            node_count => $node_count,
+        ),
+    );
+}
+
+{
+    my %do_not_copy = map { $_ => 1 } qw(
+        _tree
+        previous_database
+    );
+
+    sub write_trees {
+        my $self     = shift;
+        my $editions = shift;
+
+        my %constructor_params;
+        for my $attr ( $self->meta()->get_all_attributes() ) {
+            next unless $attr->init_arg();
+            next if $do_not_copy{ $attr->name() };
+            next unless $attr->has_value($self) || $attr->is_lazy();
+
+            my $reader = $attr->get_read_method();
+            $constructor_params{ $attr->init_arg() } = $self->$reader();
+        }
+
+        my ( @trees, @projections, @outputs );
+        for my $edition ( @{$editions} ) {
+            my %args = %{$edition};
+
+            my $output = delete $args{output}
+                or die 'Each edition must have an output';
+            my $project = delete $args{project};
+            push @outputs,     $output;
+            push @projections, _projection($project);
+
+            # An edition with the tree's data and settings is the tree
+            # itself, so it is written without building another tree.
+            push @trees,
+                !defined $project
+                && _has_same_params( \%constructor_params, \%args )
+                ? undef
+                : ( ref $self )->new( %constructor_params, %args );
+        }
+
+        $self->_project_tree( \@trees, \@projections )
+            if grep {defined} @trees;
+
+        for my $i ( 0 .. $#trees ) {
+            ( $trees[$i] // $self )->write_tree( $outputs[$i] );
+        }
+
+        return;
+    }
+}
+
+sub _has_same_params {
+    my $params = shift;
+    my $args   = shift;
+
+    for my $name ( keys %{$args} ) {
+        return 0 unless exists $params->{$name};
+
+        my $value = $args->{$name};
+        my $own   = $params->{$name};
+        next if !defined $value && !defined $own;
+        return 0 unless defined $value && defined $own;
+        return 0 unless ref $value
+            ? ref $own && $value == $own
+            : !ref $own && $value eq $own;
+    }
+
+    return 1;
+}
+
+sub _projection {
+    my $project = shift;
+
+    return $project unless ref $project eq 'ARRAY';
+
+    my @keys = @{$project};
+    return sub {
+        my $data = shift;
+
+        my %projected = map { $_ => $data->{$_} }
+            grep { exists $data->{$_} } @keys;
+
+        return %projected ? \%projected : undef;
+    };
+}
+
+sub check_lookups {
+    my $self = shift;
+    my ( $filename, $random_addresses, $seed ) = validated_list(
+        \@_,
+        filename         => { isa => 'Str' },
+        random_addresses => { isa => 'Int', default => 10_000 },
+        seed             => { isa => 'Int', default => 1 },
+    );
+
+    return @{
+        $self->_check_lookups(
+            $filename,
+            $random_addresses,
+            $seed,
+            $self->eager_serialize()
+            ? undef
+            : _data_encoder(
+                $self->_root_data_type(),
+                $self->_map_key_type_args(),
+            ),
+        )
+    };
+}
+
 {
     my %key_types = (
         binary_format_major_version => 'uint16',
@@ -321,6 +662,10 @@ sub write_tree {
 
     sub _encoded_metadata {
         my $self = shift;
+        my %args = @_;
+
+        my $ip_version = $args{ip_version} // $self->ip_version();
+        my $node_count = $args{node_count} // $self->node_count();
 
         my $metadata = MaxMind::DB::Metadata->new(
             binary_format_major_version => 2,
@@ -328,9 +673,9 @@ sub write_tree {
             build_epoch                 => uint128( $self->_build_epoch() ),
             database_type               => $self->database_type(),
             description                 => $self->description(),
-            ip_version                  => $self->ip_version(),
+            ip_version                  => $ip_version,
             languages                   => $self->languages(),
-            node_count                  => $self->node_count(),
+            node_count                  => $node_count,
             record_size                 => $self->record_size(),
         );
 
@@ -358,6 +703,9 @@ sub write_tree {
         for my $attr ( $self->meta()->get_all_attributes() ) {
             next unless $attr->init_arg();
             next if $do_not_freeze{ $attr->name() };
+            # An optional attribute that was never set, such as
+            # previous_database, is left unset when the tree is thawed.
+            next unless $attr->has_value($self) || $attr->is_lazy();
 
             my $reader = $attr->get_read_method();
             $constructor_params{ $attr->init_arg() } = $self->$reader();
@@ -379,7 +727,7 @@ sub new_from_frozen_tree {
         = validated_list(
         \@_,
         filename              => { isa => 'Str' },
-        map_key_type_callback => { isa => 'CodeRef' },
+        map_key_type_callback => { isa => 'CodeRef', optional => 1 },
         database_type         => { isa => 'Str', optional => 1 },
         description           => { isa => 'HashRef[Str]', optional => 1 },
         merge_strategy        => { isa => $MergeStrategyEnum, optional => 1 },
@@ -426,14 +774,66 @@ sub new_from_frozen_tree {
                 merge_strategy
                 alias_ipv6_to_ipv4
                 remove_reserved_networks
+                pack_data
+                mark_and_sweep_data
                 )
         },
+        $params->{eager_serialize}
+        ? _data_encoder(
+            $params->{root_data_type} // 'map',
+            _frozen_map_key_type_args( $params, $callback ),
+            )
+        : undef,
     );
 
     return $class->new(
         %{$params},
-        map_key_type_callback => $callback,
-        _tree                 => $tree,
+        ( $callback ? ( map_key_type_callback => $callback ) : () ),
+        _tree => $tree,
+    );
+}
+
+sub new_from_mmdb {
+    my $class    = shift;
+    my $filename = shift;
+    my %args     = @_;
+
+    my $metadata = _read_mmdb_metadata($filename);
+
+    my $tree = $class->new(
+        ip_version         => $metadata->{ip_version},
+        record_size        => $metadata->{record_size},
+        database_type      => $metadata->{database_type},
+        languages          => $metadata->{languages} // [],
+        description        => $metadata->{description} // {},
+        alias_ipv6_to_ipv4 => _mmdb_has_ipv4_aliases($filename),
+        %args,
+    );
+    $tree->_insert_from_mmdb($filename);
+
+    return $tree;
+}
+
+sub validate_database {
+    my $class = shift;
+    my ( $filename, $threads ) = validated_list(
+        \@_,
+        filename => { isa => 'Str' },
+        threads  => { isa => 'Int', default => 0 },
+    );
+
+    _validate_database( $filename, $threads );
+
+    return 1;
+}
+
+sub _frozen_map_key_type_args {
+    my $params   = shift;
+    my $callback = shift;
+
+    return (
+        ( $callback ? ( map_key_type_callback => $callback ) : () ),
+        map_key_types => $params->{map_key_types} // {},
     );
 }
 
@@ -552,7 +952,18 @@ This is a subroutine reference that is called in order to determine how to
 store each value in a map (hash) data structure. See L<DATA TYPES> below for
 more details.
 
-This parameter is required.
+This parameter is required unless C<map_key_types> is given.
+
+=item * map_key_types
+
+This is a hash reference mapping map keys to their types, using the same type
+descriptions that the C<map_key_type_callback> returns. Keys found in this
+hash are resolved without calling the callback, and the callback is only
+called for keys that are not in it. See L<DATA TYPES> below for more details.
+
+Unlike the callback, these types are saved when the tree is frozen.
+
+This parameter is required unless C<map_key_type_callback> is given.
 
 =item * merge_record_collisions
 
@@ -704,13 +1115,131 @@ Teredo, may still be added.
 
 This parameter is optional. It defaults to true.
 
+=item * pack_data
+
+If this is true, the tree stores each distinct data structure in a compact
+serialized form rather than keeping the Perl data structure around. The data
+is inflated again when it is needed, for example for lookups, merges,
+iteration, and when writing the tree.
+
+This uses much less memory for trees with many distinct data records at the
+cost of some speed when the data is accessed.
+
+This parameter is optional. It defaults to false.
+
+=item * mark_and_sweep_data
+
+If this is true, the tree does not keep a count of the records using each
+distinct data structure as networks are inserted and removed. Instead, data
+that is no longer used is found by walking the tree, which happens when the
+number of distinct data structures in the tree has doubled since the last
+time, before the tree is written or frozen, and when C<sweep_data()> is
+called.
+
+Keeping the counts up to date means a hash lookup each time a record is
+split, merged, or overwritten, so this makes inserts faster for large trees.
+Data that is no longer used stays in memory until the next sweep.
+
+This parameter is optional. It defaults to false.
+
+=item * eager_serialize
+
+If this is true, each distinct data structure is encoded in the MaxMind DB
+format when it is inserted into the tree, rather than when the tree is
+written. Writing the tree then only needs to copy the encoded bytes into the
+data section.
+
+Values encoded this way are stored as a whole and do not share parts of their
+data (such as a common C<names> map) with other values, so the resulting
+database may be larger.
+
+This parameter is optional. It defaults to false.
+
+=item * optimize_pointer_sizes
+
+If this is true, the parts of the data that are shared between data structures
+(such as map keys and common nested maps) are written at the start of the data
+section, with the most shared first. Pointers to data near the start of the
+data section take fewer bytes, so this makes the data section smaller for
+large databases, at the cost of a pass over all the data when the tree is
+written.
+
+This has no effect when C<eager_serialize> is true.
+
+This parameter is optional. It defaults to false.
+
+=item * verify_data_sample_rate
+
+If this is greater than zero, the tree checks the data section after writing
+it. For each data structure that is checked, the data that the records point
+to is followed through any pointers and compared byte for byte with the data
+structure encoded on its own. The write dies if they differ.
+
+This is a number from 0 to 1 giving the fraction of distinct data structures
+to check. The sample is chosen based on the data, so the same data is checked
+every time. A value of 1 checks all of the data.
+
+This is much faster than setting the C<MAXMIND_DB_SERIALIZER_VERIFY>
+environment variable, which decodes every stored value in Perl.
+
+This parameter is optional. It defaults to 0.
+
+=item * order_data_by_frequency
+
+If this is true, the data section is written in order of how many records
+point to each data structure, with the most common data first. By default,
+data is written in the order it is first reached when walking the tree.
+
+Putting the most commonly used data together improves the locality of
+lookups in the database, which reduces page faults for readers that
+C<mmap> the database.
+
+This parameter is optional. It defaults to false.
+
+=item * blocked_node_layout
+
+If this is true, the nodes of the search tree are written in blocks rather
+than in the order they are reached when walking the tree. Each block holds
+nine levels of the tree, which fits in a 4K page, and is itself laid out so
+that each group of three levels fits in a 64 byte cache line. This is a van
+Emde Boas style layout.
+
+A lookup walks one node per bit of the address, and with the default layout
+most of those nodes are far apart in a large database. With this layout, a
+lookup touches about one page per nine levels of the tree, which reduces page
+faults and cache misses for readers that C<mmap> the database. The database
+format is unchanged, so any reader can read it.
+
+This parameter is optional. It defaults to false.
+
+=item * previous_database
+
+The file name of a database written by an earlier build. If this is set, the
+data that is also in that database is written first, in the order it has
+there, and data that is new is written after it. Data is matched by its
+content, so it does not matter how it was inserted.
+
+By default, the position of each value in the data section depends on the
+values before it, so a small change to the data moves most of the data
+section. With this, a value keeps its offset as long as the values before it
+are unchanged, and otherwise moves by the change in their size, which keeps
+binary deltas between builds small. The search tree itself still changes with
+the networks.
+
+For the smallest deltas, leave C<optimize_pointer_sizes> and
+C<order_data_by_frequency> off. The shared data that C<optimize_pointer_sizes>
+writes first depends on all of the data, and C<order_data_by_frequency> only
+applies to data that is not in the previous database.
+
+This parameter is optional.
+
 =back
 
 =head2 $tree->insert_network( $network, $data, $additional_args )
 
 This method expects two parameters. The first is a network in CIDR notation.
 The second can be any Perl data structure (except a coderef, glob, or
-filehandle).
+filehandle), or a handle returned by C<data_handle()>.
 
 The C<$data> payload is encoded according to the L<MaxMind DB database format
 spec|http://maxmind.github.io/MaxMind-DB/>. The short overview is that
@@ -766,8 +1295,111 @@ inserting a network as discussed above.
 This method is similar to C<insert_network()>, except that it takes an IP
 range rather than a network. The first parameter is the first IP address in
 the range. The second is the last IP address in the range. The third is a
-Perl data structure containing the data to be inserted. The final parameter
-are additional arguments, as outlined for C<insert_network()>.
+Perl data structure containing the data to be inserted, or a handle returned
+by C<data_handle()>. The final parameter are additional arguments, as
+outlined for C<insert_network()>.
+
+=head2 $tree->insert_from_jsonl( $filename, ... )
+
+This method inserts a network for each line of a
+L<JSON Lines|https://jsonlines.org/> file. The file is read and parsed in C,
+and each record is parsed straight into the data structure the tree stores,
+which is much faster than decoding each line in Perl and calling
+C<insert_network()>.
+
+By default, each line is an array holding a network in CIDR notation and its
+data, such as C<["1.2.3.0/24", {"country": "DE"}]>. This method also accepts
+the following named parameters:
+
+=over 4
+
+=item * network_field
+
+When this is set, each line is instead an object, and the network is the
+value of the field with this name. The field is removed from the data that
+is inserted.
+
+=item * merge_strategy
+
+Overrides the tree's merge strategy for these inserts, as with the
+C<merge_strategy> argument to C<insert_network()>.
+
+=back
+
+JSON has no way to say which type a number or string should be written as,
+so the tree's C<map_key_types> or C<map_key_type_callback> must cover every
+key in the file, as they would for data inserted from Perl. Integers are
+parsed as Perl integers, and integers too large for those are kept as strings
+so that they can be written as a C<uint128>. C<true> and C<false> become 1 and
+0. A pair in an object whose value is C<null> is left out, and a C<null>
+anywhere else is an error.
+
+The method dies on the first line that is not valid JSON or does not hold a
+valid network. The networks from the lines before it will already have been
+inserted.
+
+=head2 $tree->insert_from_csv( $filename, ... )
+
+This method inserts the networks from a CSV file where each record has an id
+for its data, such as the blocks files of the GeoIP2 CSV databases. The data
+for each id comes from a hash reference, so the data only needs to be built
+once for each id, typically from another CSV file. The networks file is read
+and parsed in C and each record is inserted without calling back into Perl.
+
+The first record of the file must name the columns. Fields may be quoted as
+described in RFC 4180, and a quoted field may span several lines. Records
+with an empty id are skipped, as they have no data to insert. A record with
+an id that is not in the C<data> hash is an error.
+
+This method accepts the following named parameters:
+
+=over 4
+
+=item * data
+
+A hash reference from each id to its data. The values may be data structures
+or handles returned by C<data_handle()>. This parameter is required.
+
+=item * id_column
+
+The name of the column holding each record's id. This parameter is required.
+
+=item * network_column
+
+The name of the column holding each record's network in CIDR notation. This
+defaults to C<network>.
+
+=item * first_ip_column and last_ip_column
+
+The names of the columns holding the first and last addresses of each
+record's range, for files of ranges rather than networks. When these are set,
+each record is inserted as with C<insert_range()>.
+
+=item * merge_strategy
+
+Overrides the tree's merge strategy for these inserts, as with the
+C<merge_strategy> argument to C<insert_network()>.
+
+=back
+
+As with C<insert_from_jsonl()>, the method dies on the first invalid record,
+and the records before it will already have been inserted.
+
+=head2 $tree->data_handle($data)
+
+This method returns a L<MaxMind::DB::Writer::Tree::DataHandle> for the given
+data structure, which can be passed to C<insert_network()> or
+C<insert_range()> in place of the data.
+
+Each insert identifies its data by a hash of the data's Sereal encoding, and
+computing this is most of the cost of an insert for large data structures.
+A handle computes the hash once, so if you insert the same data for many
+networks, inserting a handle is much faster. Each insert still looks the data
+up in the tree by its key.
+
+The data must not be changed after the handle is created. A handle does not
+belong to a particular tree, so it can be inserted into several, and this
+method can also be called as a class method.
 
 =head2 $tree->remove_network( $network )
 
@@ -779,6 +1411,131 @@ network in CIDR notation.
 Given a filehandle, this method writes the contents of the tree as a MaxMind
 DB database to that filehandle.
 
+=head2 $tree->write_ipv4_tree($fh)
+
+Given a filehandle, this method writes an IPv4 database from an IPv6 tree to
+it. The IPv4 database has the networks in the tree's C<::/96> subtree, which
+is where IPv4 networks are inserted into an IPv6 tree, so it has the same
+data for each IPv4 address as the IPv6 database.
+
+The subtree is written in place, sharing the tree's data, so this is much
+cheaper than building a second tree with only the IPv4 networks. It is
+particularly cheap with C<eager_serialize>, as the data is then encoded only
+once for both databases.
+
+The database is written with the tree's settings other than
+C<previous_database>, which only applies to the IPv6 database. This method
+dies if the tree is not an IPv6 tree.
+
+=head2 $tree->write_trees( \@editions )
+
+This method writes several editions of the tree, such as a full database and
+a smaller one with only some of its data, without building a tree for each
+edition yourself. It takes an array reference with a hash reference for each
+edition. Each hash reference accepts the following keys:
+
+=over 4
+
+=item * output
+
+The filehandle to write the edition to. This is required.
+
+=item * project
+
+The data for the edition. This may be an array reference of keys, in which
+case the edition's data is a hash with only those keys, or a subroutine
+reference, which is called with the tree's data and returns the edition's
+data. The subroutine must not change the data it is given. When the edition
+has no data for a network, because the subroutine returns C<undef> or the
+data has none of the keys, the network is left out of the edition. If this is
+not set, the edition has the same data as the tree.
+
+=back
+
+Any other keys are passed to the edition's constructor, and override the
+tree's own settings. For example, C<record_size> or C<database_type> can be
+set for each edition. The edition must have the same C<ip_version> as the
+tree.
+
+An edition without C<project> whose other keys are all the same as the tree's
+settings is written directly from the tree with C<write_tree()>, without
+building another tree.
+
+For the other editions, each distinct data value in the tree is projected
+once for each edition, no matter how many networks use it. The editions are
+then built together by a single walk of the tree that copies its nodes rather
+than inserting each network. Neighbouring networks whose projected data is the
+same are merged, so an edition with less data may have far fewer nodes than
+the tree. Each edition is then written as with C<write_tree()>. The editions
+have the tree's fixed networks, so they cannot set a different
+C<alias_ipv6_to_ipv4> or C<remove_reserved_networks>.
+
+=head2 $tree->compact()
+
+This method moves the tree's nodes into a single block of memory, in the
+order they are written. After many inserts and removals the nodes are
+scattered across the heap, and walking them is dominated by cache misses.
+
+You do not need to call this before C<write_tree()>, which compacts the tree
+itself if anything was inserted since it was last compacted. It may be
+useful before iterating over a large tree.
+
+=head2 $tree->sweep_data()
+
+This method walks the tree and frees the data that no network uses any more.
+Trees created with C<mark_and_sweep_data> do this themselves from time to
+time, but you may want to call it after removing or overwriting many networks
+to release the memory sooner. Other trees free unused data as soon as the
+last network using it goes away, so calling this does nothing for them.
+
+=head2 $tree->map_data($transform)
+
+This method replaces the data in the tree with what the given subroutine
+reference returns for it. The subroutine is called once for each distinct
+data value in the tree, not once for each network, so dropping or rewriting a
+field is much faster than iterating over the tree and inserting each network
+again. The subroutine is given a copy of the data, so it may change it and
+return it.
+
+When the subroutine returns C<undef>, the networks with that data are removed
+from the tree. Neighbouring networks that end up with the same data are
+merged, as they would be if the new data had been inserted.
+
+If the subroutine dies, the tree is left unchanged.
+
+=head2 $tree->check_lookups( filename => $filename, ... )
+
+Given the name of a database written from this tree, this method looks up
+addresses in both the tree and the database and checks that they return the
+same data. The data is compared by a hash of its encoded content, so this is
+much faster than reading the database with L<MaxMind::DB::Reader>.
+
+The addresses checked are the first and last address of every network with
+data in the tree, the addresses just outside each of those networks, and a
+number of random addresses.
+
+This method accepts the following parameters:
+
+=over 4
+
+=item * filename
+
+The database to check. This parameter is required.
+
+=item * random_addresses
+
+The number of random addresses to check. This defaults to 10,000.
+
+=item * seed
+
+The seed for the random addresses. The same seed always checks the same
+addresses. This defaults to 1.
+
+=back
+
+This method returns a list with a description of each address where the tree
+and the database differ. The list is empty if they agree.
+
 =head2 $tree->iterate($object)
 
 This method iterates over the tree by calling methods on the passed
@@ -862,6 +1619,10 @@ Returns the merge strategy used when two records collide.
 Returns the callback used to determine the type of a map's values, as passed
 to the constructor.
 
+=head2 $tree->map_key_types()
+
+Returns the hash reference of map key types, as passed to the constructor.
+
 =head2 $tree->database_type()
 
 Returns the tree's database type, as passed to the constructor.
@@ -879,6 +1640,43 @@ Returns the tree's description hashref, as passed to the constructor.
 Returns a boolean indicating whether the tree will alias some IPv6 ranges to
 their corresponding IPv4 ranges when the tree is written to disk.
 
+=head2 $tree->pack_data()
+
+Returns a boolean indicating whether the tree stores its data in a packed
+form.
+
+=head2 $tree->mark_and_sweep_data()
+
+Returns a boolean indicating whether the tree finds unused data by walking
+the tree rather than by counting references to it.
+
+=head2 $tree->eager_serialize()
+
+Returns a boolean indicating whether the tree encodes its data when it is
+inserted.
+
+=head2 $tree->optimize_pointer_sizes()
+
+Returns a boolean indicating whether the tree writes its shared data at the
+start of the data section.
+
+=head2 $tree->verify_data_sample_rate()
+
+Returns the fraction of the data that is verified after the tree is written.
+
+=head2 $tree->order_data_by_frequency()
+
+Returns a boolean indicating whether the tree writes its most common data
+first.
+
+=head2 $tree->blocked_node_layout()
+
+Returns a boolean indicating whether the tree writes its nodes in blocks.
+
+=head2 $tree->previous_database()
+
+Returns the file whose data order the tree keeps, if one was given.
+
 =head2 MaxMind::DB::Writer::Tree->new_from_frozen_tree()
 
 This method constructs a tree from a file containing a frozen tree.
@@ -902,7 +1700,8 @@ more details.
 This needs to be passed because subroutine references cannot be reliably
 serialized and restored between processes.
 
-This parameter is required.
+This parameter is required unless the frozen tree was created with
+C<map_key_types>.
 
 =item * database_type
 
@@ -935,6 +1734,62 @@ machine not identical to the one on which it was written is not guaranteed.
 In addition, there is no guarantee that the freeze/thaw format will be stable
 across different versions of this module.
 
+=head2 MaxMind::DB::Writer::Tree->new_from_mmdb( $filename, ... )
+
+This method constructs a tree from a MaxMind DB file that has already been
+written, so that a small set of changes can be made to a database without
+rebuilding it from all of its sources.
+
+The file is mapped into memory and its search tree is walked in C, inserting
+each network that has data. Each distinct value in the data section is decoded
+into a Perl data structure once, the first time a network pointing to it is
+found, and is shared by every network pointing to it.
+
+The C<ip_version>, C<record_size>, C<database_type>, C<languages>, and
+C<description> of the tree are taken from the database's metadata, and
+C<alias_ipv6_to_ipv4> is set if the database's IPv4-mapped network points at
+its IPv4 networks. Any other parameters are passed to C<new()>, and override
+those taken from the file.
+
+A database does not record the type of each map key, so you must pass either
+C<map_key_type_callback> or C<map_key_types>, as with C<new()>. Numbers are
+decoded as Perl numbers, except for C<uint128> values too large for a Perl
+integer, which are decoded as decimal strings.
+
+If the database was written with C<remove_reserved_networks> set to false,
+you must pass that here as well, or the networks in reserved space will not be
+inserted.
+
+=head2 MaxMind::DB::Writer::Tree->validate_database()
+
+This method checks the structure of a MaxMind DB file that has already been
+written. It maps the file into memory and walks the entire search tree,
+checking that every record points to a node or into the data section, that no
+node can be reached by more than one record (other than the IPv4 subtree that
+the C<alias_ipv6_to_ipv4> networks point to), and that every data record
+points to a valid value. The walk is split across threads by subtree.
+
+This method accepts the following parameters:
+
+=over 4
+
+=item * filename
+
+The file to check.
+
+This parameter is required.
+
+=item * threads
+
+The number of threads to use. The default, C<0>, uses one thread per CPU.
+
+This parameter is optional.
+
+=back
+
+This method returns true if the file is valid and dies with a description of
+the first problem found if it is not.
+
 =head1 DATA TYPES
 
 The MaxMind DB file format is strongly typed. Because Perl is not strongly
@@ -978,6 +1833,12 @@ error. Note that for an array we return a 2 element arrayref where the first
 element is C<'array'> and the second element is the type of content in the
 array.
 
+If the types do not depend on the values, you can pass the C<%types> hash
+itself as C<map_key_types> instead of (or as well as) a callback. This avoids
+calling back into Perl code for every key as the data is serialized:
+
+    map_key_types => \%types,
+
 The valid types are:
 
 =over 4
@@ -4,6 +4,7 @@ extern "C" {
 #endif
 
 #include "tree.h"
+#include "validate.h"
 
 #ifdef __cplusplus
 }
@@ -44,6 +45,14 @@ void call_iteration_method(MMDBW_tree_s *tree,
                          ? 7
                          : 8;
 
+    /* Getting the data may call into Perl to inflate packed data, so we need
+       to do it before we start pushing onto the stack. */
+    SV *data = NULL;
+    if (MMDBW_RECORD_TYPE_DATA == record->type) {
+        data = newSVsv(data_for_key(tree, record->value.key));
+        SPAGAIN;
+    }
+
     PUSHMARK(SP);
     EXTEND(SP, stack_size);
     PUSHs((SV *)args->receiver);
@@ -54,11 +63,14 @@ void call_iteration_method(MMDBW_tree_s *tree,
     mPUSHs(newSVu128(record_ip_num));
     mPUSHi(record_prefix_length);
     if (MMDBW_RECORD_TYPE_DATA == record->type) {
-        mPUSHs(newSVsv(data_for_key(tree, record->value.key)));
+        mPUSHs(data);
     } else if (MMDBW_RECORD_TYPE_NODE == record->type ||
                MMDBW_RECORD_TYPE_FIXED_NODE == record->type ||
                MMDBW_RECORD_TYPE_ALIAS == record->type) {
         mPUSHi(record->value.node->number);
+    } else if (MMDBW_RECORD_TYPE_PATH == record->type) {
+        /* The first node of the path. */
+        mPUSHi(record->value.path->number);
     }
     PUTBACK;
 
@@ -90,6 +102,7 @@ SV *method_for_record_type(perl_iterator_args_s *args,
         case MMDBW_RECORD_TYPE_NODE:
         case MMDBW_RECORD_TYPE_FIXED_NODE:
         case MMDBW_RECORD_TYPE_ALIAS:
+        case MMDBW_RECORD_TYPE_PATH:
             return args->node_method;
             break;
     }
@@ -164,17 +177,21 @@ MODULE = MaxMind::DB::Writer::Tree    PACKAGE = MaxMind::DB::Writer::Tree
 
 BOOT:
     PERL_MATH_INT128_LOAD_OR_CROAK;
+    build_tree_skeletons();
 
 MMDBW_tree_s *
-_create_tree(ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks)
+_create_tree(ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks, pack_data, mark_and_sweep_data, data_encoder)
     uint8_t ip_version;
     uint8_t record_size;
     MMDBW_merge_strategy merge_strategy;
     bool alias_ipv6;
     bool remove_reserved_networks;
+    bool pack_data;
+    bool mark_and_sweep_data;
+    SV *data_encoder;
 
     CODE:
-        RETVAL = new_tree(ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks);
+        RETVAL = new_tree(ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks, pack_data, mark_and_sweep_data, data_encoder);
 
     OUTPUT:
         RETVAL
@@ -204,6 +221,38 @@ _insert_range(self, start_ip_address, end_ip_address, key, data, merge_strategy)
     CODE:
         insert_range(tree_from_self(self), start_ip_address, end_ip_address, key, data, merge_strategy);
 
+void
+_insert_from_jsonl(self, filename, network_field, merge_strategy)
+    SV *self;
+    char *filename;
+    SV *network_field;
+    MMDBW_merge_strategy merge_strategy;
+
+    CODE:
+        insert_from_jsonl(tree_from_self(self), filename, SvOK(network_field) ? SvPV_nolen(network_field) : NULL, merge_strategy);
+
+void
+_insert_from_csv(self, filename, network_column, first_ip_column, last_ip_column, id_column, data_by_id, merge_strategy)
+    SV *self;
+    char *filename;
+    SV *network_column;
+    SV *first_ip_column;
+    SV *last_ip_column;
+    char *id_column;
+    HV *data_by_id;
+    MMDBW_merge_strategy merge_strategy;
+
+    CODE:
+        insert_from_csv(tree_from_self(self), filename, SvOK(network_column) ? SvPV_nolen(network_column) : NULL, SvOK(first_ip_column) ? SvPV_nolen(first_ip_column) : NULL, SvOK(last_ip_column) ? SvPV_nolen(last_ip_column) : NULL, id_column, data_by_id, merge_strategy);
+
+void
+_insert_from_mmdb(self, filename)
+    SV *self;
+    char *filename;
+
+    CODE:
+        insert_from_mmdb(tree_from_self(self), filename);
+
 void
 _remove_network(self, ip_address, prefix_length)
     SV *self;
@@ -214,14 +263,91 @@ _remove_network(self, ip_address, prefix_length)
         remove_network(tree_from_self(self), ip_address, prefix_length);
 
 void
-_write_search_tree(self, output, root_data_type, serializer)
+_write_search_tree(self, output, root_data_type, serializer, optimize_pointer_sizes, order_data_by_frequency, blocked_node_layout, previous_database, verify_sample_rate, data_encoder)
     SV *self;
     SV *output;
     SV *root_data_type;
     SV *serializer;
+    bool optimize_pointer_sizes;
+    bool order_data_by_frequency;
+    bool blocked_node_layout;
+    SV *previous_database;
+    double verify_sample_rate;
+    SV *data_encoder;
 
     CODE:
-        write_search_tree(tree_from_self(self), output, root_data_type, serializer);
+        write_search_tree(tree_from_self(self), output, root_data_type, serializer, optimize_pointer_sizes, order_data_by_frequency, blocked_node_layout, previous_database, verify_sample_rate, data_encoder);
+
+uint32_t
+_write_ipv4_search_tree(self, output, root_data_type, serializer, optimize_pointer_sizes, order_data_by_frequency, blocked_node_layout, verify_sample_rate, data_encoder)
+    SV *self;
+    SV *output;
+    SV *root_data_type;
+    SV *serializer;
+    bool optimize_pointer_sizes;
+    bool order_data_by_frequency;
+    bool blocked_node_layout;
+    double verify_sample_rate;
+    SV *data_encoder;
+
+    CODE:
+        RETVAL = write_ipv4_search_tree(tree_from_self(self), output, root_data_type, serializer, optimize_pointer_sizes, order_data_by_frequency, blocked_node_layout, verify_sample_rate, data_encoder);
+
+    OUTPUT:
+        RETVAL
+
+void
+_project_tree(self, trees, projections)
+    SV *self;
+    AV *trees;
+    AV *projections;
+
+    CODE:
+        SSize_t count = av_len(trees) + 1;
+        if (av_len(projections) + 1 != count) {
+            croak("Each edition tree needs a projection");
+        }
+        ENTER;
+        MMDBW_edition_s *editions;
+        Newxz(editions, count ? count : 1, MMDBW_edition_s);
+        SAVEFREEPV(editions);
+        // Editions without a tree are written from this tree as it is.
+        size_t edition_count = 0;
+        for (SSize_t i = 0; i < count; i++) {
+            SV *tree = *av_fetch(trees, i, 0);
+            if (!SvOK(tree)) {
+                continue;
+            }
+            editions[edition_count].tree = tree_from_self(tree);
+            editions[edition_count].projection =
+                *av_fetch(projections, i, 0);
+            editions[edition_count].number = i;
+            edition_count++;
+        }
+        project_tree(tree_from_self(self), editions, edition_count);
+        LEAVE;
+
+void
+compact(self)
+    SV *self;
+
+    CODE:
+        compact_tree(tree_from_self(self));
+
+void
+sweep_data(self)
+    SV *self;
+
+    CODE:
+        sweep_data(tree_from_self(self));
+
+void
+map_data(self, transform)
+    SV *self;
+    SV *transform;
+
+    CODE:
+        map_data(tree_from_self(self), transform);
 
 uint32_t
 node_count(self)
@@ -286,6 +412,20 @@ lookup_ip_address(self, address)
     OUTPUT:
         RETVAL
 
+SV *
+_check_lookups(self, filename, random_count, seed, data_encoder)
+    SV *self;
+    char *filename;
+    UV random_count;
+    UV seed;
+    SV *data_encoder;
+
+    CODE:
+        RETVAL = newRV_inc((SV *)check_lookups(tree_from_self(self), filename, random_count, seed, data_encoder));
+
+    OUTPUT:
+        RETVAL
+
 void
 _freeze_tree(self, filename, frozen_params, frozen_params_size)
     SV *self;
@@ -297,7 +437,7 @@ _freeze_tree(self, filename, frozen_params, frozen_params_size)
         freeze_tree(tree_from_self(self), filename, frozen_params, frozen_params_size);
 
 MMDBW_tree_s *
-_thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks)
+_thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks, pack_data, mark_and_sweep_data, data_encoder)
     char *filename;
     int initial_offset;
     int ip_version;
@@ -305,13 +445,44 @@ _thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, al
     MMDBW_merge_strategy merge_strategy;
     bool alias_ipv6;
     bool remove_reserved_networks;
+    bool pack_data;
+    bool mark_and_sweep_data;
+    SV *data_encoder;
 
     CODE:
-        RETVAL = thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks);
+        RETVAL = thaw_tree(filename, initial_offset, ip_version, record_size, merge_strategy, alias_ipv6, remove_reserved_networks, pack_data, mark_and_sweep_data, data_encoder);
 
     OUTPUT:
         RETVAL
 
+SV *
+_read_mmdb_metadata(filename)
+    char *filename;
+
+    CODE:
+        RETVAL = read_mmdb_metadata(filename);
+
+    OUTPUT:
+        RETVAL
+
+bool
+_mmdb_has_ipv4_aliases(filename)
+    char *filename;
+
+    CODE:
+        RETVAL = mmdb_has_ipv4_aliases(filename);
+
+    OUTPUT:
+        RETVAL
+
+void
+_validate_database(filename, thread_count)
+    char *filename;
+    int thread_count;
+
+    CODE:
+        validate_database(filename, thread_count);
+
 void
 _free_tree(self)
     SV *self;
@@ -0,0 +1,59 @@
+package MaxMind::DB::Writer::Tree::DataHandle;
+
+use strict;
+use warnings;
+
+our $VERSION = '0.300004';
+
+use MaxMind::DB::Writer::Util ();
+
+# This is deliberately not a Moose class. Handles are passed to every insert,
+# so they are just the data's key and the data itself in an array.
+sub new {
+    my $class = shift;
+    my $data  = shift;
+
+    return bless [ MaxMind::DB::Writer::Util::key_for_data($data), $data ],
+        $class;
+}
+
+sub key {
+    return $_[0][0];
+}
+
+sub data {
+    return $_[0][1];
+}
+
+1;
+
+# ABSTRACT: A handle for data along with its key in a tree
+
+__END__
+
+=pod
+
+=head1 SYNOPSIS
+
+    my $handle = $tree->data_handle( { country => 'DE' } );
+    $tree->insert_network( $_, $handle ) for @networks;
+
+=head1 DESCRIPTION
+
+Objects of this class are returned by C<<
+MaxMind::DB::Writer::Tree->data_handle() >>. A handle holds a data structure
+along with the key a tree stores it under, so inserting a network with a
+handle does not need to compute the key again.
+
+=head1 METHODS
+
+=head2 $handle->data()
+
+Returns the data structure the handle was created for. It must not be changed
+once the handle has been created, as the key would no longer match it.
+
+=head2 $handle->key()
+
+Returns the key the tree stores the data under.
+
+=cut
@@ -0,0 +1,119 @@
+use strict;
+use warnings;
+
+use Test::More;
+
+use MaxMind::DB::Writer::Serializer;
+
+my $encoder = MaxMind::DB::Writer::Serializer->new(
+    map_key_type_callback => sub { 'utf8_string' },
+    _deduplicate_data     => 0,
+);
+
+{
+    my $serializer = _serializer();
+
+    $serializer->store_data( utf8_string => '1234.5' );
+    $serializer->store_data( double      => '1234.5' );
+    $serializer->store_data( bytes       => '1234.5' );
+
+    is(
+        ${ $serializer->buffer() },
+        join(
+            q{},
+            map { $encoder->encode_data( $_ => '1234.5' ) }
+                qw( utf8_string double bytes )
+        ),
+        'the same value stored as different types is not deduplicated'
+    );
+}
+
+{
+    my $serializer = _serializer();
+
+    my $string   = "caf\x{e9} name";
+    my $upgraded = $string;
+    utf8::upgrade($upgraded);
+
+    $serializer->store_data( utf8_string => $string );
+    my $length = length ${ $serializer->buffer() };
+
+    $serializer->store_data( utf8_string => $upgraded );
+    is(
+        substr( ${ $serializer->buffer() }, $length ),
+        $encoder->encode_data( pointer => 0 ),
+        'a string with the UTF-8 flag is deduplicated with one without it'
+    );
+}
+
+{
+    my $serializer = _serializer();
+
+    $serializer->store_data( map => { long_key => 'long_value' } );
+    my $length = length ${ $serializer->buffer() };
+
+    $serializer->store_data( map => { long_value => 'long_key' } );
+    is(
+        substr( ${ $serializer->buffer() }, $length ),
+        join(
+            q{},
+            # a map with one pair
+            "\xe1",
+            $encoder->encode_data( pointer => 10 ),
+            $encoder->encode_data( pointer => 1 ),
+        ),
+        'map keys and values are deduplicated with each other'
+    );
+}
+
+{
+    my $serializer = _serializer();
+
+    my @values = (
+        { long_key => 'long_value' },
+        { long_key => 'other_value', other_key => 'long_value' },
+    );
+    $serializer->store_shared_values( map => \@values );
+
+    my %positions;
+    for my $string (qw( long_key long_value )) {
+        $positions{$string} = index(
+            ${ $serializer->buffer() },
+            $encoder->encode_data( utf8_string => $string )
+        );
+    }
+    is_deeply(
+        [ sort { $a <=> $b } values %positions ],
+        [ 0, 9 ],
+        'strings used more than once are stored by store_shared_values'
+    );
+}
+
+{
+    my @values = (
+        { long_key => 'long_value' },
+        { other_key => 'long_value' },
+        { long_key => 'other_value', other_key => 'long_value' },
+    );
+
+    my $all = _serializer();
+    $all->store_shared_values( map => \@values );
+
+    my $batched = _serializer();
+    $batched->count_shared_values( map => [ @values[ 0, 1 ] ] );
+    $batched->count_shared_values( map => [ $values[2] ] );
+    $batched->store_shared_values();
+
+    is(
+        ${ $batched->buffer() },
+        ${ $all->buffer() },
+        'values counted in batches are stored like values counted at once'
+    );
+}
+
+done_testing();
+
+sub _serializer {
+    return MaxMind::DB::Writer::Serializer->new(
+        map_key_type_callback => sub { 'utf8_string' } );
+}
@@ -0,0 +1,132 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+# The blocked layout only changes the order of the nodes in the search tree,
+# so the database should be valid and give the same answers as the tree.
+for my $ip_version ( 4, 6 ) {
+    for my $alias ( $ip_version == 6 ? ( 0, 1 ) : 0 ) {
+        for my $record_size ( 24, 28, 32 ) {
+            my $desc = "IPv$ip_version, alias = $alias, "
+                . "record size = $record_size";
+
+            my %databases;
+            my %node_counts;
+            for my $blocked ( 0, 1 ) {
+                my $tree = _tree(
+                    ip_version          => $ip_version,
+                    alias_ipv6_to_ipv4  => $alias,
+                    record_size         => $record_size,
+                    blocked_node_layout => $blocked,
+                );
+                _insert_networks($tree);
+
+                my $filename = _write_tree($tree);
+                $databases{$blocked}   = _search_tree( $tree, $filename );
+                $node_counts{$blocked} = $tree->node_count;
+
+                next unless $blocked;
+
+                is(
+                    exception {
+                        MaxMind::DB::Writer::Tree->validate_database(
+                            filename => $filename );
+                    },
+                    undef,
+                    "$desc - written database is valid"
+                );
+                is_deeply(
+                    [ $tree->check_lookups( filename => $filename ) ],
+                    [],
+                    "$desc - tree and written database agree"
+                );
+            }
+
+            is(
+                $node_counts{1}, $node_counts{0},
+                "$desc - same number of nodes as the default layout"
+            );
+            isnt(
+                $databases{1}, $databases{0},
+                "$desc - nodes are in a different order"
+            );
+        }
+    }
+}
+
+{
+    my $tree = _tree(
+        ip_version          => 6,
+        record_size         => 24,
+        blocked_node_layout => 1,
+    );
+    $tree->insert_network( '2a02:1234:5678::/48',      { id => 1 } );
+    $tree->insert_network( '2a02:1234:5678:9abc::/64', { id => 2 } );
+
+    my $filename = _write_tree($tree);
+    is_deeply(
+        [ $tree->check_lookups( filename => $filename ) ],
+        [],
+        'tree stored as paths and written database agree'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        map_key_type_callback => sub {'uint32'},
+        @_,
+    );
+}
+
+sub _insert_networks {
+    my $tree = shift;
+
+    for my $i ( 0 .. 255 ) {
+        $tree->insert_network( "1.$i.0.0/16", { id => $i % 7 } );
+        $tree->insert_network( "1.$i.$i.0/24", { id => $i } ) if $i % 3;
+        $tree->insert_network( "9.$i.0.0/20", { id => $i % 11 } );
+        $tree->insert_network( "2a02:$i\::/32", { id => $i } )
+            if $tree->ip_version == 6;
+    }
+    $tree->insert_range( '5.0.0.1', '5.0.10.200', { id => 1000 } );
+}
+
+{
+    my $count = 0;
+
+    sub _write_tree {
+        my $tree = shift;
+
+        my $filename = "$tempdir/blocked-" . $count++ . '.mmdb';
+        open my $fh, '>:raw', $filename or die $!;
+        $tree->write_tree($fh);
+        close $fh or die $!;
+
+        return $filename;
+    }
+}
+
+sub _search_tree {
+    my $tree     = shift;
+    my $filename = shift;
+
+    open my $fh, '<:raw', $filename or die $!;
+    my $size = $tree->node_count * $tree->record_size / 4;
+    read( $fh, my $buffer, $size ) == $size or die $!;
+    close $fh or die $!;
+
+    return $buffer;
+}
@@ -0,0 +1,120 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my %types = (
+    id    => 'uint32',
+    names => 'map',
+    en    => 'utf8_string',
+);
+
+for my $ip_version ( 4, 6 ) {
+    for my $options (
+        {},
+        { eager_serialize         => 1 },
+        { optimize_pointer_sizes  => 1 },
+        { order_data_by_frequency => 1 },
+        ) {
+        my $desc = join ', ', "IPv$ip_version", %{$options};
+
+        my $tree = _tree( ip_version => $ip_version, %{$options} );
+        my $filename = _write_tree($tree);
+
+        is_deeply(
+            [ $tree->check_lookups( filename => $filename ) ],
+            [],
+            "tree and database agree - $desc"
+        );
+    }
+}
+
+{
+    my $tree = _tree( ip_version => 6 );
+    my $filename = _write_tree($tree);
+
+    $tree->insert_network( '5.0.0.0/24', { id => 1 } );
+    $tree->insert_network( '1.0.3.0/24', { id => 999 } );
+    $tree->remove_network('1.0.7.0/24');
+
+    my @mismatches = $tree->check_lookups(
+        filename         => $filename,
+        random_addresses => 0,
+    );
+
+    for my $expect (
+        '::5.0.0.0: data in the tree but none in the database',
+        '::5.0.0.255: data in the tree but none in the database',
+        '::1.0.3.0: different data in the tree and the database',
+        '::1.0.3.255: different data in the tree and the database',
+        '::1.0.7.0: data in the database but none in the tree',
+        '::1.0.7.255: data in the database but none in the tree',
+        ) {
+        ok(
+            ( grep { $_ eq $expect } @mismatches ),
+            "reports $expect"
+        );
+    }
+
+    ok(
+        !( grep {/1\.0\.2\./} @mismatches ),
+        'unchanged networks are not reported'
+    );
+}
+
+{
+    my $filename = _write_tree( _tree( ip_version => 4 ) );
+
+    like(
+        exception {
+            _tree( ip_version => 6 )->check_lookups( filename => $filename );
+        },
+        qr/is for IPv4 but the tree is for IPv6/,
+        'database for another IP version is an error'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+        @_,
+    );
+
+    for my $i ( 0 .. 255 ) {
+        $tree->insert_network(
+            "1.0.$i.0/24",
+            { id => $i % 13, names => { en => 'Name ' . $i % 5 } },
+        );
+    }
+
+    return $tree;
+}
+
+{
+    my $count = 0;
+
+    sub _write_tree {
+        my $tree = shift;
+
+        my $filename = "$tempdir/check-lookups-" . $count++ . '.mmdb';
+        open my $fh, '>:raw', $filename or die $!;
+        $tree->write_tree($fh);
+        close $fh or die $!;
+
+        return $filename;
+    }
+}
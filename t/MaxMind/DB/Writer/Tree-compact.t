@@ -0,0 +1,81 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::MaxMind::DB::Writer qw( database_without_metadata );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+for my $ip_version ( 4, 6 ) {
+    for my $alias ( $ip_version == 6 ? ( 0, 1 ) : 0 ) {
+        my $desc = "IPv$ip_version, alias = $alias";
+
+        my @trees = map {
+            _tree(
+                ip_version         => $ip_version,
+                alias_ipv6_to_ipv4 => $alias,
+            );
+        } 0, 1;
+
+        for my $tree (@trees) {
+            _insert_networks( $tree, 0 );
+        }
+        $trees[1]->compact();
+
+        for my $tree (@trees) {
+            _insert_networks( $tree, 1 );
+        }
+        $trees[1]->compact();
+        $trees[1]->compact();
+
+        for my $address ( '1.0.0.1', '1.2.3.4', '1.200.0.1', '3.0.0.1' ) {
+            is_deeply(
+                $trees[1]->lookup_ip_address($address),
+                $trees[0]->lookup_ip_address($address),
+                "$desc - same data for $address after compacting"
+            );
+        }
+
+        is(
+            database_without_metadata( $trees[1] ),
+            database_without_metadata( $trees[0] ),
+            "$desc - compacted tree writes the same database"
+        );
+
+        _insert_networks( $trees[1], 2 );
+        $trees[1]->remove_network('1.0.0.0/8');
+        is(
+            $trees[1]->lookup_ip_address('1.2.3.4'),
+            undef,
+            "$desc - networks can be removed after compacting"
+        );
+    }
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        map_key_type_callback => sub {'uint32'},
+        @_,
+    );
+}
+
+sub _insert_networks {
+    my $tree = shift;
+    my $pass = shift;
+
+    for my $i ( 0 .. 255 ) {
+        $tree->insert_network( "1.$i.0.0/16", { id => $i % 7 + $pass } );
+        $tree->insert_network( "1.$i.$i.0/24", { id => $i } ) if $i % 3;
+        $tree->remove_network("1.$i.0.0/20") unless $i % 5;
+        $tree->insert_network( "2a02:$i\::/32", { id => $i } )
+            if $tree->ip_version == 6;
+    }
+}
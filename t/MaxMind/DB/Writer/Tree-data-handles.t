@@ -0,0 +1,101 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::MaxMind::DB::Writer qw( database_without_metadata );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+use MaxMind::DB::Writer::Util qw( key_for_data );
+
+my %types = (
+    id    => 'uint32',
+    names => 'map',
+    en    => 'utf8_string',
+);
+
+my @records = map { { id => $_, names => { en => "Name $_" } } } 0 .. 6;
+
+{
+    my $handle = MaxMind::DB::Writer::Tree::DataHandle->new( $records[0] );
+    is( $handle->key, key_for_data( $records[0] ), 'handle key' );
+    is( $handle->data, $records[0], 'handle data' );
+}
+
+for my $options (
+    {},
+    { pack_data       => 1 },
+    { eager_serialize => 1 },
+    { merge_strategy  => 'recurse' },
+    ) {
+    my $desc = join ', ', 'options', %{$options};
+
+    my @trees = map { _tree( %{$options} ) } 0, 1;
+
+    my @handles = map { $trees[1]->data_handle($_) } @records;
+    for my $i ( 0 .. 255 ) {
+        $trees[0]->insert_network( "1.$i.0.0/16", $records[ $i % 7 ] );
+        $trees[1]->insert_network( "1.$i.0.0/16", $handles[ $i % 7 ] );
+    }
+    $trees[0]->insert_range( '2.0.0.1', '2.0.3.200', $records[3] );
+    $trees[1]->insert_range( '2.0.0.1', '2.0.3.200', $handles[3] );
+
+    for my $address ( '1.0.0.1', '1.7.3.4', '1.200.0.1', '2.0.3.7' ) {
+        is_deeply(
+            $trees[1]->lookup_ip_address($address),
+            $trees[0]->lookup_ip_address($address),
+            "$desc - same data for $address with handles"
+        );
+    }
+
+    is(
+        database_without_metadata( $trees[1] ),
+        database_without_metadata( $trees[0] ),
+        "$desc - tree with handles writes the same database"
+    );
+}
+
+{
+    my $handle = _tree()->data_handle( $records[1] );
+
+    my $tree = _tree();
+    $tree->insert_network( '1.0.0.0/24', $handle );
+    is_deeply(
+        $tree->lookup_ip_address('1.0.0.1'),
+        $records[1],
+        'handle can be inserted into another tree'
+    );
+}
+
+{
+    my $handle = My::DataHandle->new( $records[2] );
+
+    my $tree = _tree();
+    $tree->insert_network( '1.0.0.0/24', $handle );
+    $tree->insert_range( '1.0.1.0', '1.0.1.255', $handle );
+    is_deeply(
+        [ map { $tree->lookup_ip_address($_) } '1.0.0.1', '1.0.1.1' ],
+        [ $records[2], $records[2] ],
+        'a handle from a subclass can be inserted'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+        @_,
+    );
+}
+
+package My::DataHandle;
+
+use parent -norequire, 'MaxMind::DB::Writer::Tree::DataHandle';
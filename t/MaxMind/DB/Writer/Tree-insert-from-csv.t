@@ -0,0 +1,229 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( compare_trees write_lines_file );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my @addresses = (
+    '1.1.1.1', '1.1.1.201', '1.1.2.1', '1.1.2.7', '1.1.3.0', '1.1.3.1',
+    '2001:db8::1',
+);
+
+my %types = (
+    id    => 'uint32',
+    names => 'map',
+    en    => 'utf8_string',
+);
+
+my %locations = (
+    10 => { id => 10, names => { en => 'Germany' } },
+    20 => { id => 20, names => { en => 'Name, with "quotes"' } },
+    30 => { id => 30 },
+);
+
+{
+    my $filename = write_lines_file(
+        "$tempdir/networks.csv",
+        "\x{FEFF}network,geoname_id,is_anonymous_proxy\r",
+        "1.1.1.0/24,10,0\r",
+        '"1.1.2.0/24",20,0',
+        '1.1.3.0/24,,1',
+        q{},
+        '2001:db8::/32,30,"a ""quoted""',
+        'value, over two lines"',
+    );
+
+    my $tree = _tree();
+    $tree->insert_from_csv(
+        $filename,
+        data      => \%locations,
+        id_column => 'geoname_id',
+    );
+
+    my $expect = _tree();
+    $expect->insert_network( '1.1.1.0/24',    $locations{10} );
+    $expect->insert_network( '1.1.2.0/24',    $locations{20} );
+    $expect->insert_network( '2001:db8::/32', $locations{30} );
+
+    compare_trees( $tree, $expect, 'networks', \@addresses );
+}
+
+{
+    my $filename = write_lines_file(
+        "$tempdir/ranges.csv",
+        'id,first,last',
+        '10,1.1.1.0,1.1.1.200',
+        '20,1.1.2.7,1.1.3.0',
+        '30,2001:db8::,2001:db8::ffff',
+    );
+
+    my $tree = _tree();
+    $tree->insert_from_csv(
+        $filename,
+        data => {
+            %locations,
+            20 => $tree->data_handle( $locations{20} ),
+        },
+        id_column       => 'id',
+        first_ip_column => 'first',
+        last_ip_column  => 'last',
+    );
+
+    my $expect = _tree();
+    $expect->insert_range( '1.1.1.0',    '1.1.1.200',      $locations{10} );
+    $expect->insert_range( '1.1.2.7',    '1.1.3.0',        $locations{20} );
+    $expect->insert_range( '2001:db8::', '2001:db8::ffff', $locations{30} );
+
+    compare_trees( $tree, $expect, 'ranges', \@addresses );
+}
+
+{
+    my $filename = write_lines_file(
+        "$tempdir/subclass.csv",
+        'network,id',
+        '1.1.1.0/24,10',
+    );
+
+    my $tree = _tree();
+    $tree->insert_from_csv(
+        $filename,
+        data      => { 10 => My::HashDataHandle->new( $locations{10} ) },
+        id_column => 'id',
+    );
+    is_deeply(
+        $tree->lookup_ip_address('1.1.1.1'),
+        $locations{10},
+        'a handle from a subclass that is not an array can be used'
+    );
+}
+
+{
+    my $filename = write_lines_file(
+        "$tempdir/merge.csv",
+        'network,id',
+        '1.1.0.0/16,10',
+        '1.1.1.0/24,30',
+    );
+
+    my $tree = _tree();
+    $tree->insert_from_csv(
+        $filename,
+        data => {
+            10 => { names => { en => 'Germany' } },
+            30 => { id    => 30 },
+        },
+        id_column      => 'id',
+        merge_strategy => 'toplevel',
+    );
+    is_deeply(
+        $tree->lookup_ip_address('1.1.1.1'),
+        { id => 30, names => { en => 'Germany' } },
+        'merge_strategy is used for the inserts'
+    );
+}
+
+{
+    my %errors = (
+        'unknown id' => [
+            [ 'network,id', '1.1.1.0/24,10', '1.1.2.0/24,40' ],
+            qr/There is no data for the id 40 on line 3 of /,
+        ],
+        'missing column' => [
+            [ 'net,id', '1.1.1.0/24,10' ],
+            qr/The CSV file .+ does not have a network column/,
+        ],
+        'short record' => [
+            [ 'id,network', '10' ],
+            qr/Line 2 of .+ has only 1 fields/,
+        ],
+        'invalid network' => [
+            [ 'network,id', '1.1.1.0/1x,10' ],
+            qr{Invalid network on line 2 of .+: 1\.1\.1\.0/1x},
+        ],
+        'invalid quoted field' => [
+            [ 'network,id', '"1.1.1.0/24"x,10' ],
+            qr/Invalid quoted field on line 2 of /,
+        ],
+        'unterminated quoted field' => [
+            [ 'network,id', '1.1.1.0/24,"10' ],
+            qr/Unterminated quoted field on line 2 of /,
+        ],
+        'empty file' => [
+            [],
+            qr/The CSV file .+ is empty/,
+        ],
+    );
+
+    for my $desc ( sort keys %errors ) {
+        my ( $lines, $error ) = @{ $errors{$desc} };
+        my $filename = write_lines_file( "$tempdir/error.csv", @{$lines} );
+        like(
+            exception {
+                _tree()->insert_from_csv(
+                    $filename,
+                    data      => \%locations,
+                    id_column => 'id',
+                );
+            },
+            $error,
+            "error for $desc"
+        );
+    }
+
+    like(
+        exception {
+            _tree()->insert_from_csv(
+                "$tempdir/networks.csv",
+                data            => \%locations,
+                id_column       => 'geoname_id',
+                first_ip_column => 'network',
+            );
+        },
+        qr/You must pass both first_ip_column and last_ip_column/,
+        'error for a first_ip_column without a last_ip_column'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+}
+
+package My::HashDataHandle;
+
+use parent -norequire, 'MaxMind::DB::Writer::Tree::DataHandle';
+
+use MaxMind::DB::Writer::Util qw( key_for_data );
+
+sub new {
+    my $class = shift;
+    my $data  = shift;
+
+    return bless { key => key_for_data($data), data => $data }, $class;
+}
+
+sub key {
+    return $_[0]{key};
+}
+
+sub data {
+    return $_[0]{data};
+}
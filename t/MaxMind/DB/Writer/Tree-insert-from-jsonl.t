@@ -0,0 +1,195 @@
+use strict;
+use warnings;
+use utf8;
+
+use lib 't/lib';
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( compare_trees write_lines_file );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my @addresses = ( '1.1.1.1', '1.1.2.1', '1.1.3.1', '2001:db8::1' );
+
+my %types = (
+    id       => 'uint32',
+    big      => 'uint128',
+    negative => 'int32',
+    ratio    => 'double',
+    flag     => 'boolean',
+    names    => 'map',
+    en       => 'utf8_string',
+    de       => 'utf8_string',
+    tags     => [ 'array', 'utf8_string' ],
+);
+
+my @records = (
+    [
+        '1.1.1.0/24',
+        {
+            id    => 1,
+            names => { en => 'Name "1"', de => "Stra\x{df}e\n" },
+            tags  => [ 'a', 'b' ],
+        },
+    ],
+    [
+        '1.1.2.0/24',
+        {
+            id       => 2,
+            big      => '340282366920938463463374607431768211455',
+            negative => -7,
+            ratio    => 0.5,
+            flag     => 1,
+            names    => { en => "caf\x{e9} \x{1f600}" },
+        },
+    ],
+    [ '1.1.3.0/25', { id => 3, flag => 0, tags => [] } ],
+    [ '2001:db8::/32', { id => 4, names => {} } ],
+);
+
+my @lines = (
+    '["1.1.1.0/24", {"id": 1, "names": {"en": "Name \"1\"",'
+        . ' "de": "Straße\n"}, "tags": ["a", "b"]}]',
+    ' [ "1.1.2.0/24" , { "id" : 2 , "big" : '
+        . '340282366920938463463374607431768211455, "negative": -7,'
+        . ' "ratio": 5e-1, "flag": true,'
+        . ' "names": {"en": "café 😀"}, "id": 2} ]',
+    q{},
+    '["1.1.3.0/25",{"id":3,"flag":false,"tags":[],"ratio":null}]',
+    "[\"2001:db8::/32\", {\"id\": 4, \"names\": {}}]\r",
+);
+
+{
+    my $filename = write_lines_file( "$tempdir/array.jsonl", @lines );
+
+    my $tree = _tree();
+    $tree->insert_from_jsonl($filename);
+
+    my $expect = _tree();
+    $expect->insert_network( @{$_} ) for @records;
+
+    compare_trees( $tree, $expect, 'each line is an array', \@addresses );
+}
+
+{
+    my @objects = (
+        '{"network": "1.1.1.0/24", "id": 1, "names": {"en": "Name \"1\"",'
+            . ' "de": "Straße\n"}, "tags": ["a", "b"]}',
+        '{"id": 2, "big": 340282366920938463463374607431768211455,'
+            . ' "negative": -7, "ratio": 0.5, "flag": true,'
+            . ' "names": {"en": "café 😀"},'
+            . ' "network": "1.1.2.0/24"}',
+        '{"network":"1.1.3.0/25","id":3,"flag":false,"tags":[]}',
+        '{"network":"2001:db8::/32","id":4,"names":{}}',
+    );
+    my $filename = write_lines_file( "$tempdir/objects.jsonl", @objects );
+
+    my $tree = _tree();
+    $tree->insert_from_jsonl( $filename, network_field => 'network' );
+
+    my $expect = _tree();
+    $expect->insert_network( @{$_} ) for @records;
+
+    compare_trees( $tree, $expect, 'network_field', \@addresses );
+}
+
+{
+    my $filename = write_lines_file(
+        "$tempdir/merge.jsonl",
+        '["1.1.0.0/16", {"id": 1}]',
+        '["1.1.1.0/24", {"tags": ["a"]}]',
+    );
+
+    my $tree = _tree();
+    $tree->insert_from_jsonl( $filename, merge_strategy => 'toplevel' );
+    is_deeply(
+        $tree->lookup_ip_address('1.1.1.1'),
+        { id => 1, tags => ['a'] },
+        'merge_strategy is used for the inserts'
+    );
+}
+
+{
+    my %errors = (
+        'invalid JSON' => [
+            [ '["1.1.1.0/24", {"id": 1}]', '["1.1.2.0/24", {"id": 1,}]' ],
+            qr/Invalid JSON on line 2 .+: expected a string for an object key/,
+        ],
+        'trailing data' => [
+            ['["1.1.1.0/24", {"id": 1}] x'],
+            qr/Invalid JSON on line 1 .+: unexpected data after the value/,
+        ],
+        'newline in a string' => [
+            ['["1.1.1.0/24", {"id": "1}]'],
+            qr/Invalid JSON on line 1 .+: control character in a string/,
+        ],
+        'unpaired surrogate' => [
+            ['["1.1.1.0/24", {"en": "\ud83d"}]'],
+            qr/Invalid JSON on line 1 .+: unpaired surrogate/,
+        ],
+        'null in an array' => [
+            ['["1.1.1.0/24", {"tags": [null]}]'],
+            qr/Invalid JSON on line 1 .+: null can only be a value/,
+        ],
+        'deep nesting' => [
+            [ '["1.1.1.0/24", ' . ( '[' x 1000 ) . ( ']' x 1000 ) . ']' ],
+            qr/Invalid JSON on line 1 .+: values are nested too deeply/,
+        ],
+        'not a pair' => [
+            ['{"id": 1}'],
+            qr/Invalid JSON on line 1 .+: expected an array of a network/,
+        ],
+        'invalid network' => [
+            ['["1.1.1.0/129", {"id": 1}]'],
+            qr{Invalid network on line 1 of .+: 1\.1\.1\.0/129},
+        ],
+        'network without a prefix length' => [
+            ['["1.1.1.0", {"id": 1}]'],
+            qr{Invalid network on line 1 of .+: 1\.1\.1\.0},
+        ],
+    );
+
+    for my $desc ( sort keys %errors ) {
+        my ( $lines, $error ) = @{ $errors{$desc} };
+        my $filename = write_lines_file( "$tempdir/error.jsonl", @{$lines} );
+        like(
+            exception { _tree()->insert_from_jsonl($filename) },
+            $error,
+            "error for $desc"
+        );
+    }
+
+    my $filename = write_lines_file( "$tempdir/no-field.jsonl", '{"id": 1}' );
+    like(
+        exception {
+            _tree()->insert_from_jsonl( $filename, network_field => 'net' )
+        },
+        qr/Line 1 of .+ does not have a net field/,
+        'error for a missing network field'
+    );
+
+    like(
+        exception { _tree()->insert_from_jsonl("$tempdir/missing.jsonl") },
+        qr/Could not open file .+missing\.jsonl/,
+        'error for a missing file'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+}
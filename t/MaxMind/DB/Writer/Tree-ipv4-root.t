@@ -0,0 +1,109 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+# Trees that alias IPv6 networks to IPv4 start inserts and lookups within
+# ::/96 at the IPv4 root rather than at the root of the tree. A tree without
+# aliases takes the long way down, so the two should always agree on the
+# IPv4 space.
+{
+    my %trees = map { $_ => _tree( alias_ipv6_to_ipv4 => $_ ) } 0, 1;
+
+    for my $tree ( values %trees ) {
+        for my $i ( 0 .. 255 ) {
+            $tree->insert_network( "1.$i.0.0/16", { id => $i } );
+        }
+        $tree->insert_network( '::2.0.0.0/104', { id => 1000 } );
+        $tree->insert_network( '1.2.3.0/24',    { id => 1001 } );
+        $tree->insert_range( '3.0.0.1', '3.0.0.10', { id => 1002 } );
+        $tree->insert_network( '::/120', { id => 1003 } );
+        $tree->remove_network('1.3.0.0/16');
+        $tree->remove_network('::1.4.0.0/112');
+        $tree->insert_network( '2003::/16', { id => 1004 } );
+    }
+
+    for my $address (
+        qw(
+        0.0.0.1 0.0.1.1 1.0.0.1 1.2.3.4 1.2.4.4 1.3.0.1 1.4.255.255 1.5.0.0
+        2.255.255.255 ::2.1.2.3 3.0.0.0 3.0.0.5 3.0.0.11 2003::1
+        )
+        ) {
+        is_deeply(
+            $trees{1}->lookup_ip_address($address),
+            $trees{0}->lookup_ip_address($address),
+            "same data for $address with and without aliases"
+        );
+    }
+
+    is_deeply(
+        $trees{1}->lookup_ip_address('1.2.3.4'),
+        { id => 1001 },
+        'IPv4 network inserted in an aliased tree'
+    );
+
+    is(
+        $trees{1}->lookup_ip_address('1.3.0.1'),
+        undef,
+        'IPv4 network removed from an aliased tree'
+    );
+
+    my $filename = "$tempdir/ipv4-root.mmdb";
+    open my $fh, '>:raw', $filename or die $!;
+    $trees{1}->write_tree($fh);
+    close $fh or die $!;
+
+    is(
+        exception {
+            MaxMind::DB::Writer::Tree->validate_database(
+                filename => $filename );
+        },
+        undef,
+        'written database is valid'
+    );
+
+    is_deeply(
+        [ $trees{1}->check_lookups( filename => $filename ) ],
+        [],
+        'tree and written database agree'
+    );
+}
+
+{
+    my $tree = _tree( alias_ipv6_to_ipv4 => 1 );
+    $tree->insert_network( '0.0.0.0/0', { id => 1 } );
+    $tree->insert_network( '::/64',     { id => 2 } );
+
+    is_deeply(
+        $tree->lookup_ip_address('1.2.3.4'),
+        { id => 2 },
+        'network containing the IPv4 root overwrites IPv4 data'
+    );
+
+    is_deeply(
+        $tree->lookup_ip_address('::ffff:1.2.3.4'),
+        { id => 2 },
+        'aliased network still follows the IPv4 root'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        map_key_type_callback => sub {'uint32'},
+        @_,
+    );
+}
@@ -0,0 +1,160 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( database_without_metadata );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+my %types = (
+    id      => 'uint32',
+    city    => 'utf8_string',
+    country => 'utf8_string',
+);
+
+my @networks = (
+    (
+        map {
+            [
+                "1.1.$_.0/24",
+                {
+                    id      => $_,
+                    city    => "city $_",
+                    country => $_ < 8 ? 'DE' : 'FR',
+                },
+            ]
+        } 0 .. 15
+    ),
+    [ '1.2.0.0/16', { id => 16, city => 'city 16' } ],
+    [ '2a02::/16', { id => 17, city => 'city 17', country => 'DE' } ],
+);
+
+for my $args ( [], [ pack_data => 1 ], [ mark_and_sweep_data => 1 ] ) {
+    my $desc = @{$args} ? $args->[0] : 'default';
+
+    my $calls = 0;
+    my $tree  = _tree( @{$args} );
+    $tree->insert_network( '1.3.0.0/16', $networks[0][1] );
+    $tree->map_data(
+        sub {
+            $calls++;
+            return exists $_[0]{country}
+                ? { country => $_[0]{country} }
+                : undef;
+        }
+    );
+
+    is(
+        $calls, 18,
+        "$desc - the transform is called once for each distinct value"
+    );
+
+    my $expect = _tree( @{$args}, networks => [] );
+    $expect->insert_network( @{$_} )
+        for [ '1.1.0.0/21', { country => 'DE' } ],
+        [ '1.1.8.0/21', { country => 'FR' } ],
+        [ '1.3.0.0/16', { country => 'DE' } ],
+        [ '2a02::/16',  { country => 'DE' } ];
+
+    for my $address ( '1.1.1.1', '1.1.9.1', '1.2.0.1', '1.3.0.1', '2a02::1' )
+    {
+        is_deeply(
+            $tree->lookup_ip_address($address),
+            $expect->lookup_ip_address($address),
+            "$desc - data for $address"
+        );
+    }
+    is(
+        $tree->node_count(),
+        $expect->node_count(),
+        "$desc - networks with the same new data are merged"
+    );
+    is(
+        database_without_metadata($tree),
+        database_without_metadata($expect),
+        "$desc - same database as inserting the new data"
+    );
+}
+
+{
+    my $tree = _tree();
+    like(
+        exception {
+            $tree->map_data( sub { $_[0]{id} == 10 ? die 'oops' : {} } );
+        },
+        qr/oops/,
+        'an exception from the transform is passed on'
+    );
+    is(
+        database_without_metadata($tree),
+        database_without_metadata( _tree() ),
+        'the tree is unchanged when the transform dies'
+    );
+
+    for my $args ( [], [ pack_data => 1 ] ) {
+        my $desc = @{$args} ? $args->[0] : 'default';
+
+        $tree = _tree( @{$args} );
+        like(
+            exception {
+                $tree->map_data(
+                    sub {
+                        delete $_[0]{city};
+                        $_[0]{id} == 10 ? die 'oops' : $_[0];
+                    }
+                );
+            },
+            qr/oops/,
+            "$desc - an exception from a transform that changes its data"
+        );
+        # The tree holds the same hashes as @networks, so this is checked
+        # against the original values rather than against another tree.
+        is_deeply(
+            [ map { $tree->lookup_ip_address("1.1.$_.1")->{city} } 0 .. 15 ],
+            [ map {"city $_"} 0 .. 15 ],
+            "$desc - changes the transform made to its data are not kept"
+        );
+
+        $tree = _tree( @{$args} );
+        $tree->map_data( sub { delete $_[0]{city}; $_[0] } );
+        is_deeply(
+            $tree->lookup_ip_address('1.1.1.1'),
+            { id => 1, country => 'DE' },
+            "$desc - a transform may return the data it was given"
+        );
+    }
+
+    $tree = _tree();
+    $tree->map_data( sub { $_[0] } );
+    is(
+        database_without_metadata($tree),
+        database_without_metadata( _tree() ),
+        'the tree is unchanged when the transform returns the same data'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my %args = @_;
+
+    my $networks = delete $args{networks} // \@networks;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+        %args,
+    );
+
+    $tree->insert_network( @{$_} ) for @{$networks};
+
+    return $tree;
+}
@@ -0,0 +1,126 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Serializer;
+use MaxMind::DB::Writer::Tree;
+
+my %types = (
+    city   => 'map',
+    names  => 'map',
+    en     => 'utf8_string',
+    id     => 'uint32',
+    ranks  => [ 'array', 'uint16' ],
+    secret => 'utf8_string',
+);
+
+my @inserts = (
+    [ '1.0.0.0/16', { city => { names => { en => 'Berlin' } }, id => 1 } ],
+    [ '1.0.2.0/24', { ranks => [ 1, 2, 3 ] } ],
+    [ '2.0.0.0/8',  { id => 3, secret => 'x' } ],
+);
+
+my $expected = _output( map_key_type_callback => sub { $types{ $_[0] } } );
+
+is(
+    _output( map_key_types => \%types ),
+    $expected,
+    'map_key_types produces the same database as the callback'
+);
+
+{
+    my @called;
+    my %partial = %types;
+    delete $partial{secret};
+
+    is(
+        _output(
+            map_key_types         => \%partial,
+            map_key_type_callback => sub {
+                push @called, $_[0];
+                return $types{ $_[0] };
+            },
+        ),
+        $expected,
+        'callback is used for keys missing from map_key_types'
+    );
+    is_deeply(
+        \@called,
+        ['secret'],
+        'callback is only called for keys missing from map_key_types'
+    );
+}
+
+{
+    my $dir  = tempdir( CLEANUP => 1 );
+    my $file = "$dir/frozen";
+
+    _tree( map_key_types => \%types )->freeze_tree($file);
+
+    my $thawed;
+    is(
+        exception {
+            $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                filename => $file );
+        },
+        undef,
+        'tree frozen with map_key_types can be thawed without a callback'
+    );
+    is_deeply(
+        $thawed->map_key_types(),
+        \%types,
+        'thawed tree has the frozen map_key_types'
+    );
+}
+
+like(
+    exception { _tree() },
+    qr/must provide a map_key_type_callback or map_key_types/,
+    'tree needs either map_key_types or a callback'
+);
+
+for my $type ( 'string', [ 'array', 'list' ], [ 'map', 'uint16' ], ['array'] )
+{
+    like(
+        exception {
+            MaxMind::DB::Writer::Serializer->new(
+                map_key_types => { foo => $type } );
+        },
+        qr/Invalid type for map key "foo"/,
+        'invalid type in map_key_types is rejected - '
+            . ( ref $type ? join ', ', @{$type} : $type )
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version    => 4,
+        record_size   => 24,
+        database_type => 'Test',
+        languages     => ['en'],
+        description   => { en => 'Test tree' },
+        @_,
+    );
+
+    $tree->insert_network( @{$_} ) for @inserts;
+
+    return $tree;
+}
+
+sub _output {
+    my $tree = _tree(@_);
+
+    $tree->_set_build_epoch(1);
+
+    my $output;
+    open my $fh, '>:raw', \$output or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $output;
+}
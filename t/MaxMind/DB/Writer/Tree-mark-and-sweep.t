@@ -0,0 +1,117 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::MaxMind::DB::Writer qw( database_without_metadata );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my %types = (
+    id    => 'uint32',
+    extra => 'uint32',
+    names => 'map',
+    en    => 'utf8_string',
+);
+
+# A tree using mark and sweep should end up with exactly the data a tree
+# counting references has. Writing with verify_data_sample_rate fails if any
+# unused data is left in the tree, and order_data_by_frequency depends on the
+# reference counts.
+for my $merge_strategy (qw( none recurse add-only-if-parent-exists )) {
+    for my $ip_version ( 4, 6 ) {
+        my $desc = "IPv$ip_version, merge_strategy = $merge_strategy";
+
+        my @trees = map {
+            _tree(
+                ip_version          => $ip_version,
+                merge_strategy      => $merge_strategy,
+                mark_and_sweep_data => $_,
+            );
+        } 0, 1;
+
+        for my $tree (@trees) {
+            _insert_networks($tree);
+        }
+        $trees[1]->sweep_data();
+
+        for my $address ( '1.0.0.1', '1.3.3.4', '1.200.9.1', '2.0.0.5' ) {
+            is_deeply(
+                $trees[1]->lookup_ip_address($address),
+                $trees[0]->lookup_ip_address($address),
+                "$desc - same data for $address"
+            );
+        }
+
+        is(
+            database_without_metadata( $trees[1] ),
+            database_without_metadata( $trees[0] ),
+            "$desc - tree using mark and sweep writes the same database"
+        );
+
+        my $filename = "$tempdir/$ip_version-$merge_strategy.frozen";
+        $trees[1]->freeze_tree($filename);
+        my $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+            filename              => $filename,
+            map_key_type_callback => sub { $types{ $_[0] } },
+        );
+        ok(
+            $thawed->mark_and_sweep_data,
+            "$desc - thawed tree uses mark and sweep"
+        );
+        _insert_networks($thawed);
+
+        # A tree's serializer keeps the data from earlier writes, so we
+        # compare against a tree that has not been written yet.
+        my $expect = _tree(
+            ip_version     => $ip_version,
+            merge_strategy => $merge_strategy,
+        );
+        _insert_networks($expect) for 1, 2;
+        is(
+            database_without_metadata($thawed),
+            database_without_metadata($expect),
+            "$desc - thawed tree writes the same database"
+        );
+    }
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        record_size             => 24,
+        database_type           => 'Test',
+        languages               => ['en'],
+        description             => { en => 'Test tree' },
+        alias_ipv6_to_ipv4      => 1,
+        order_data_by_frequency => 1,
+        verify_data_sample_rate => 1,
+        map_key_type_callback   => sub { $types{ $_[0] } },
+        @_,
+    );
+}
+
+# Enough distinct data to pass the point where the tree sweeps by itself,
+# most of which is overwritten or removed again.
+sub _insert_networks {
+    my $tree = shift;
+
+    for my $i ( 0 .. 5000 ) {
+        my $network = sprintf( '1.%d.%d.0/24', $i >> 8 & 0xff, $i & 0xff );
+        $tree->insert_network( $network, { id => $i } );
+        $tree->insert_network(
+            $network,
+            { id => $i % 17, names => { en => 'Name ' . $i % 3 } }
+        );
+        $tree->remove_network($network) unless $i % 7;
+    }
+    $tree->insert_network( '1.3.0.0/16', { id => 1, extra => 2 } );
+    $tree->insert_range( '2.0.0.1', '2.0.3.200', { id => 3 } );
+    $tree->remove_network('1.4.0.0/16');
+}
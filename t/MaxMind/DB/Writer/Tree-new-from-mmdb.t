@@ -0,0 +1,205 @@
+use strict;
+use warnings;
+use utf8;
+
+use lib 't/lib';
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( compare_trees write_database_file );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my %types = (
+    id       => 'uint16',
+    count    => 'uint32',
+    big      => 'uint64',
+    huge     => 'uint128',
+    negative => 'int32',
+    ratio    => 'double',
+    weight   => 'float',
+    flag     => 'boolean',
+    raw      => 'bytes',
+    names    => 'map',
+    en       => 'utf8_string',
+    de       => 'utf8_string',
+    tags     => [ 'array', 'utf8_string' ],
+);
+
+my %shared = (
+    id    => 1,
+    names => { en => 'Germany', de => 'Deutschland' },
+    tags  => [ 'a', 'b' ],
+);
+
+my @networks = (
+    [ '1.1.1.0/24', \%shared ],
+    [ '1.1.2.0/25', \%shared ],
+    [
+        '1.1.3.0/24',
+        {
+            id       => 2,
+            count    => 4_000_000_000,
+            big      => '18446744073709551615',
+            huge     => '340282366920938463463374607431768211455',
+            negative => -7,
+            ratio    => 0.25,
+            weight   => 1.5,
+            flag     => 1,
+            raw      => "\x00\xff",
+            names    => { en => "Stra\x{df}e \x{1f600}" },
+        },
+    ],
+    [ '1.1.4.0/30',    { id => 3, flag => 0, tags => [] } ],
+    [ '2001:db8::/32', { id => 4, names => {} } ],
+);
+
+my @addresses = (
+    '1.1.1.1', '1.1.2.1', '1.1.2.200', '1.1.3.1', '1.1.4.3', '1.1.5.1',
+    '2001:db8::1', '::ffff:1.1.1.1',
+);
+
+{
+    my $filename = "$tempdir/ipv6.mmdb";
+    write_database_file( _tree(), $filename );
+
+    my $tree = MaxMind::DB::Writer::Tree->new_from_mmdb(
+        $filename,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+
+    is( $tree->ip_version(),    6,      'ip_version from the metadata' );
+    is( $tree->record_size(),   24,     'record_size from the metadata' );
+    is( $tree->database_type(), 'Test', 'database_type from the metadata' );
+    is_deeply( $tree->languages(), ['en'], 'languages from the metadata' );
+    is_deeply(
+        $tree->description(),
+        { en => 'Test tree' },
+        'description from the metadata'
+    );
+    ok(
+        $tree->alias_ipv6_to_ipv4(),
+        'alias_ipv6_to_ipv4 is set when the database has aliases'
+    );
+
+    my $expect = _tree();
+    compare_trees( $tree, $expect, 'IPv6 database', \@addresses );
+
+    # A tree's serializer is reused by later writes, so the patched tree is
+    # loaded again rather than reusing the one written above.
+    $tree = MaxMind::DB::Writer::Tree->new_from_mmdb(
+        $filename,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+    $tree->insert_network( '1.1.5.0/24', { id => 5 } );
+    $expect = _tree();
+    $expect->insert_network( '1.1.5.0/24', { id => 5 } );
+    compare_trees(
+        $tree, $expect, 'IPv6 database with a new network',
+        \@addresses
+    );
+}
+
+{
+    my $filename = "$tempdir/ipv4.mmdb";
+    write_database_file(
+        _tree( ip_version => 4, alias_ipv6_to_ipv4 => 0, record_size => 28 ),
+        $filename
+    );
+
+    my $tree = MaxMind::DB::Writer::Tree->new_from_mmdb(
+        $filename,
+        map_key_types => \%types,
+    );
+
+    is( $tree->ip_version(),  4,  'ip_version of an IPv4 database' );
+    is( $tree->record_size(), 28, 'record_size of an IPv4 database' );
+    ok(
+        !$tree->alias_ipv6_to_ipv4(),
+        'alias_ipv6_to_ipv4 is not set for an IPv4 database'
+    );
+
+    compare_trees(
+        $tree,
+        _tree( ip_version => 4, alias_ipv6_to_ipv4 => 0, record_size => 28 ),
+        'IPv4 database',
+        \@addresses,
+    );
+}
+
+{
+    my $filename = "$tempdir/no-aliases.mmdb";
+    write_database_file( _tree( alias_ipv6_to_ipv4 => 0 ), $filename );
+
+    my $tree = MaxMind::DB::Writer::Tree->new_from_mmdb(
+        $filename,
+        map_key_types => \%types,
+    );
+    ok(
+        !$tree->alias_ipv6_to_ipv4(),
+        'alias_ipv6_to_ipv4 is not set when the database has no aliases'
+    );
+    compare_trees(
+        $tree,
+        _tree( alias_ipv6_to_ipv4 => 0 ),
+        'IPv6 database without aliases',
+        \@addresses,
+    );
+}
+
+{
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_mmdb(
+                "$tempdir/ipv6.mmdb",
+                map_key_types      => \%types,
+                ip_version         => 4,
+                alias_ipv6_to_ipv4 => 0,
+            );
+        },
+        qr/The database .+ is for IPv6 but the tree is for IPv4/,
+        'error for a tree with a different IP version'
+    );
+
+    my $filename = "$tempdir/not-a-database";
+    open my $fh, '>:raw', $filename or die $!;
+    print {$fh} 'not a database' or die $!;
+    close $fh or die $!;
+
+    like(
+        exception {
+            MaxMind::DB::Writer::Tree->new_from_mmdb(
+                $filename,
+                map_key_types => \%types,
+            );
+        },
+        qr/Could not find the metadata marker/,
+        'error for a file that is not a database'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+        @_,
+    );
+
+    for my $network (@networks) {
+        next if $tree->ip_version() == 4 && $network->[0] =~ /:/;
+        $tree->insert_network( @{$network} );
+    }
+
+    return $tree;
+}
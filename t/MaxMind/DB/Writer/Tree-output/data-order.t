@@ -0,0 +1,96 @@
+use strict;
+use warnings;
+
+use Test::More;
+
+use Test::Requires (
+    'MaxMind::DB::Reader' => 0.040000,
+);
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Reader;
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my @addresses = map { ( "1.0.$_.1", "2.$_.0.1" ) } 0 .. 9;
+
+my %output = map { $_ => _write_tree($_) } 0, 1;
+
+{
+    my $data_section = _data_section( $output{1} );
+
+    my $common = index $data_section, 'common value';
+    my $rare   = index $data_section, 'rare value 0';
+
+    ok(
+        $common >= 0 && $common < $rare,
+        'the most common data is written first'
+    );
+
+    $data_section = _data_section( $output{0} );
+    ok(
+        index( $data_section, 'rare value 0' )
+            < index( $data_section, 'common value' ),
+        'by default data is written in the order it is reached in the tree'
+    );
+}
+
+is_deeply(
+    _lookups( $output{1} ),
+    _lookups( $output{0} ),
+    'ordering the data by frequency does not change lookups'
+);
+
+done_testing();
+
+sub _write_tree {
+    my $order_data_by_frequency = shift;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version              => 4,
+        record_size             => 24,
+        database_type           => 'Test',
+        languages               => ['en'],
+        description             => { en => 'Test tree' },
+        order_data_by_frequency => $order_data_by_frequency,
+        map_key_type_callback   => sub { 'utf8_string' },
+    );
+
+    # The rare values come first in the tree, but each of them is only used
+    # by a single network.
+    $tree->insert_network( "1.0.$_.0/24", { value => "rare value $_" } )
+        for 0 .. 9;
+    $tree->insert_network( "2.$_.0.0/16", { value => 'common value' } )
+        for 0 .. 9;
+
+    my $output;
+    open my $fh, '>:raw', \$output or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $output;
+}
+
+sub _data_section {
+    my $output = shift;
+
+    my $start = index $output, "\0" x 16;
+    my $end   = index $output, "\xab\xcd\xefMaxMind.com";
+
+    return substr( $output, $start + 16, $end - $start - 16 );
+}
+
+sub _lookups {
+    my $output = shift;
+
+    my $filename = "$tempdir/Test-data-order.mmdb";
+    open my $fh, '>:raw', $filename or die $!;
+    print {$fh} $output or die $!;
+    close $fh or die $!;
+
+    my $reader = MaxMind::DB::Reader->new( file => $filename );
+
+    return { map { $_ => $reader->record_for_address($_) } @addresses };
+}
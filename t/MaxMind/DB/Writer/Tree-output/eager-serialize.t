@@ -0,0 +1,124 @@
+use strict;
+use warnings;
+
+use Test::More;
+
+use Test::Requires (
+    'MaxMind::DB::Reader' => 0.040000,
+);
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Reader;
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my %types = (
+    city   => 'map',
+    names  => 'map',
+    en     => 'utf8_string',
+    de     => 'utf8_string',
+    id     => 'uint32',
+    ranks  => [ 'array', 'uint16' ],
+    secret => 'utf8_string',
+);
+
+my @inserts = (
+    [ '1.0.0.0/16', { city => { names => { en => 'Berlin' } }, id => 1 } ],
+    [ '1.0.1.0/24', { city => { names => { de => 'Berlin' } }, id => 2 } ],
+    [ '1.0.2.0/24', { ranks => [ 1, 2, 3 ] } ],
+    [ '2.0.0.0/8',  { id => 3, secret => 'x' } ],
+    [ '2.1.0.0/16', { id => 3, secret => 'x' } ],
+    [ '2.2.0.0/16', { id => 4, secret => 'x' x 100 } ],
+);
+
+my @addresses = qw( 1.0.0.1 1.0.1.1 1.0.2.1 1.0.3.1 2.1.1.1 2.2.0.1 3.0.0.0 );
+
+my $expected = _lookups( _write_tree( _tree(0) ) );
+
+{
+    my $tree = _tree(1);
+    ok( $tree->eager_serialize(), 'tree encodes its data when inserted' );
+
+    is_deeply(
+        _lookups( _write_tree($tree) ),
+        $expected,
+        'database written from eagerly encoded data has the same records'
+    );
+}
+
+{
+    my $file = "$tempdir/frozen";
+    _tree(1)->freeze_tree($file);
+
+    my $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+        filename              => $file,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+
+    ok( $thawed->eager_serialize(), 'thawed tree still encodes its data' );
+    is_deeply(
+        _lookups( _write_tree($thawed) ),
+        $expected,
+        'database written from a thawed tree has the same records'
+    );
+}
+
+{
+    my @trees = map { _tree($_) } 0, 1;
+    for my $tree (@trees) {
+        $tree->insert_network( '1.0.2.0/24', { id => 5 } );
+        $tree->remove_network('2.1.0.0/16');
+    }
+
+    is_deeply(
+        _lookups( _write_tree( $trees[1] ) ),
+        _lookups( _write_tree( $trees[0] ) ),
+        'merged and removed data is written correctly'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my $eager_serialize = shift;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        merge_strategy        => 'recurse',
+        eager_serialize       => $eager_serialize,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+
+    $tree->insert_network( @{$_} ) for @inserts;
+
+    return $tree;
+}
+
+sub _write_tree {
+    my $tree = shift;
+
+    my $filename = $tempdir . '/Test-eager-serialize.mmdb';
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $filename;
+}
+
+sub _lookups {
+    my $filename = shift;
+
+    my $reader = MaxMind::DB::Reader->new( file => $filename );
+
+    return {
+        map { $_ => $reader->record_for_address($_) } @addresses,
+        map {"::$_"} @addresses
+    };
+}
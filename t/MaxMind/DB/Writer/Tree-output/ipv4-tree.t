@@ -0,0 +1,162 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( database_without_metadata );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my @ipv4_networks = (
+    ( map { [ "1.1.$_.0/24", { id => $_ } ] } 0 .. 15 ),
+    [ '1.2.3.4/32',   { id => 16 } ],
+    [ '8.0.0.0/8',    { id => 17 } ],
+    [ '200.1.0.0/16', { id => 0 } ],
+);
+my @ipv6_networks = (
+    [ '2a02::/16',   { id => 18 } ],
+    [ '2a03:1::/32', { id => 0 } ],
+);
+
+for my $args (
+    [ alias_ipv6_to_ipv4 => 1 ],
+    [ alias_ipv6_to_ipv4 => 0 ],
+    [ alias_ipv6_to_ipv4 => 1, eager_serialize => 1 ],
+    [ alias_ipv6_to_ipv4 => 1, blocked_node_layout => 1 ],
+    [ alias_ipv6_to_ipv4 => 0, remove_reserved_networks => 0 ],
+    [ alias_ipv6_to_ipv4 => 1, order_data_by_frequency => 1 ],
+    [ alias_ipv6_to_ipv4 => 1, optimize_pointer_sizes  => 1 ],
+    [ alias_ipv6_to_ipv4 => 1, verify_data_sample_rate => 1 ],
+    ) {
+    my $desc = join ', ', map {"$args->[$_ * 2] = $args->[$_ * 2 + 1]"}
+        0 .. $#{$args} / 2;
+
+    my $filename = "$tempdir/ipv4.mmdb";
+    my $tree     = _tree( @{$args} );
+    _write_file( $tree, $filename, 'write_ipv4_tree' );
+
+    ok(
+        MaxMind::DB::Writer::Tree->validate_database( filename => $filename ),
+        "$desc - the IPv4 database is valid"
+    );
+
+    my $expect = _tree( @{$args}, ip_version => 4 );
+    is_deeply(
+        [ $expect->check_lookups( filename => $filename ) ],
+        [],
+        "$desc - the IPv4 database has the data of the IPv4 networks"
+    );
+
+    my %args   = @{$args};
+    my $loaded = MaxMind::DB::Writer::Tree->new_from_mmdb(
+        $filename,
+        map_key_types            => { id => 'uint32' },
+        remove_reserved_networks => $args{remove_reserved_networks} // 1,
+    );
+    is( $loaded->ip_version(), 4, "$desc - the database is for IPv4" );
+    is(
+        $loaded->node_count(),
+        $expect->node_count(),
+        "$desc - the node count is the same as for an IPv4 tree"
+    );
+
+    my $ipv6_filename = "$tempdir/ipv6.mmdb";
+    _write_file( $tree, $ipv6_filename, 'write_tree' );
+    is_deeply(
+        [ _tree( @{$args} )->check_lookups( filename => $ipv6_filename ) ],
+        [],
+        "$desc - the IPv6 database is unchanged by writing the IPv4 one"
+    );
+}
+
+# The IPv6 networks have data that no IPv4 network has, which must not be
+# written to the IPv4 database by the passes over all of the data.
+for my $args (
+    [],
+    [ order_data_by_frequency => 1 ],
+    [ optimize_pointer_sizes  => 1 ],
+    [ verify_data_sample_rate => 1 ],
+    ) {
+    my $desc = @{$args} ? $args->[0] : 'default';
+
+    my $tree = _tree( alias_ipv6_to_ipv4 => 1, @{$args} );
+    open my $fh, '>:raw', \my $ipv4 or die $!;
+    $tree->write_ipv4_tree($fh);
+    close $fh or die $!;
+
+    is(
+        database_without_metadata($ipv4),
+        database_without_metadata(
+            _tree( alias_ipv6_to_ipv4 => 1, ip_version => 4, @{$args} )
+        ),
+        "$desc - same database as an IPv4 tree with the same networks"
+    );
+}
+
+{
+    open my $fh, '>:raw', \my $output or die $!;
+    like(
+        exception { _tree( ip_version => 4 )->write_ipv4_tree($fh) },
+        qr/write_ipv4_tree\(\) can only be called on an IPv6 tree/,
+        'error for an IPv4 tree'
+    );
+
+    my $tree = _tree(
+        alias_ipv6_to_ipv4       => 0,
+        remove_reserved_networks => 0,
+        ipv4_networks            => [],
+    );
+    like(
+        exception { $tree->write_ipv4_tree($fh) },
+        qr/The tree has no IPv4 networks to write/,
+        'error for a tree without IPv4 networks'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my %args = @_;
+
+    my $ipv4_networks = delete $args{ipv4_networks} // \@ipv4_networks;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version    => 6,
+        record_size   => 24,
+        database_type => 'Test',
+        languages     => ['en'],
+        description   => { en => 'Test tree' },
+        map_key_types => { id => 'uint32' },
+        %args,
+    );
+
+    for my $network ( @{$ipv4_networks} ) {
+        my ( $ip, $prefix_length ) = split m{/}, $network->[0];
+        if ( $tree->ip_version() == 6 ) {
+            $ip = "::$ip";
+            $prefix_length += 96;
+        }
+        $tree->insert_network( "$ip/$prefix_length", $network->[1] );
+    }
+    if ( $tree->ip_version() == 6 ) {
+        $tree->insert_network( @{$_} ) for @ipv6_networks;
+    }
+
+    return $tree;
+}
+
+sub _write_file {
+    my $tree     = shift;
+    my $filename = shift;
+    my $method   = shift;
+
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->$method($fh);
+    close $fh or die $!;
+}
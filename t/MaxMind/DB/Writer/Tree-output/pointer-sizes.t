@@ -0,0 +1,90 @@
+use strict;
+use warnings;
+
+use Test::More;
+
+use Test::Requires (
+    'MaxMind::DB::Reader' => 0.040000,
+);
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Reader;
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my %types = (
+    continent  => 'map',
+    names      => 'map',
+    en         => 'utf8_string',
+    de         => 'utf8_string',
+    geoname_id => 'uint32',
+    population => 'uint32',
+    city       => 'utf8_string',
+);
+
+my @addresses = map { "1.0.$_.1" } 0 .. 255;
+
+my %files = map { $_ => _write_tree($_) } 0, 1;
+
+cmp_ok(
+    -s $files{1},
+    '<',
+    -s $files{0},
+    'storing shared data first makes the database smaller'
+);
+
+is_deeply(
+    _lookups( $files{1} ),
+    _lookups( $files{0} ),
+    'storing shared data first does not change lookups'
+);
+
+done_testing();
+
+sub _write_tree {
+    my $optimize_pointer_sizes = shift;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version             => 4,
+        record_size            => 24,
+        database_type          => 'Test',
+        languages              => ['en'],
+        description            => { en => 'Test tree' },
+        optimize_pointer_sizes => $optimize_pointer_sizes,
+        map_key_type_callback  => sub { $types{ $_[0] } },
+    );
+
+    # Each network has its own data. The networks after the first 100 also
+    # share a continent. Without the option, the continent is stored with
+    # the first network using it, after the cities of the first 100 networks
+    # have pushed the data section past 2KB.
+    for my $i ( 0 .. 255 ) {
+        my %data = (
+            city       => "A city with a reasonably long name $i",
+            population => 1000 + $i,
+        );
+        $data{continent} = {
+            geoname_id => 6255148,
+            names      => { en => 'Europe', de => 'Europa' },
+        } if $i >= 100;
+
+        $tree->insert_network( "1.0.$i.0/24", \%data );
+    }
+
+    my $filename = "$tempdir/Test-pointer-sizes-$optimize_pointer_sizes.mmdb";
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $filename;
+}
+
+sub _lookups {
+    my $filename = shift;
+
+    my $reader = MaxMind::DB::Reader->new( file => $filename );
+
+    return { map { $_ => $reader->record_for_address($_) } @addresses };
+}
@@ -0,0 +1,193 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+my $previous = "$tempdir/previous.mmdb";
+_write_file( _tree(), $previous );
+my $previous_data = _data_section( _read_file($previous) );
+
+{
+    my $data_section = _data_section(
+        _write_tree( _changed_tree( previous_database => $previous ) ) );
+
+    # Each map ends with its value string, so this is where the map for the
+    # changed value starts.
+    my $changed = index( $previous_data, 'value 9' ) + length 'value 9';
+    is(
+        substr( $data_section, 0, $changed ),
+        substr( $previous_data, 0, $changed ),
+        'the data before the first changed value is unchanged'
+    );
+    ok(
+        index( $data_section, 'value 19' )
+            < index( $data_section, 'new value' ),
+        'new data is written after the data from the previous database'
+    );
+
+    my $default_data_section = _data_section( _write_tree( _changed_tree() ) );
+    isnt(
+        substr( $default_data_section, 0, $changed ),
+        substr( $previous_data, 0, $changed ),
+        'by default new data can move the data before it'
+    );
+}
+
+{
+    my $filename = "$tempdir/changed.mmdb";
+    _write_file( _changed_tree( previous_database => $previous ), $filename );
+
+    is_deeply(
+        [ _changed_tree()->check_lookups( filename => $filename ) ],
+        [],
+        'the database written with previous_database has the same lookups'
+    );
+}
+
+{
+    my $data_section = _data_section(
+        _write_tree(
+            _changed_tree(
+                previous_database => $previous,
+                eager_serialize   => 1,
+            )
+        )
+    );
+
+    like(
+        $data_section,
+        qr/value 0.+value 9.+value 11.+value 19.+new value/s,
+        'previous_database keeps the data order with eager_serialize'
+    );
+}
+
+{
+    # An extended type of 17 at the start of the data section.
+    my $corrupt = _read_file($previous);
+    substr( $corrupt, index( $corrupt, "\0" x 16 ) + 16, 2 ) = "\x00\x0a";
+
+    my $filename = "$tempdir/corrupt.mmdb";
+    open my $fh, '>:raw', $filename or die $!;
+    print {$fh} $corrupt or die $!;
+    close $fh or die $!;
+
+    like(
+        exception {
+            _write_tree( _changed_tree( previous_database => $filename ) );
+        },
+        qr/Invalid value at offset 0 of the data section in \Q$filename\E/,
+        'invalid data in the previous database is reported for that file'
+    );
+}
+
+{
+    for my $args ( [], [ previous_database => $previous ] ) {
+        my $desc = @{$args} ? 'with' : 'without';
+
+        my $frozen = "$tempdir/frozen-tree";
+        _changed_tree( @{$args} )->freeze_tree($frozen);
+
+        my $thawed;
+        is(
+            exception {
+                $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+                    filename              => $frozen,
+                    map_key_type_callback =>
+                        sub { $_[0] eq 'id' ? 'uint32' : 'utf8_string' },
+                );
+            },
+            undef,
+            "a tree $desc previous_database can be frozen and thawed"
+        );
+        is(
+            $thawed->previous_database(),
+            $args->[1],
+            "the thawed tree $desc previous_database keeps its setting"
+        );
+    }
+}
+
+done_testing();
+
+sub _tree {
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version            => 4,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        map_key_type_callback =>
+            sub { $_[0] eq 'id' ? 'uint32' : 'utf8_string' },
+        @_,
+    );
+
+    $tree->insert_network( "1.0.$_.0/24", { id => $_, value => "value $_" } )
+        for 0 .. 19;
+
+    return $tree;
+}
+
+# This changes one value and adds a network with new data ahead of all of the
+# others. The ids are strings rather than numbers, which does not change how
+# they are written.
+sub _changed_tree {
+    my $tree = _tree(@_);
+
+    $tree->insert_network(
+        "1.0.$_.0/24",
+        { id => "$_", value => "value $_" }
+    ) for 0 .. 19;
+    $tree->insert_network(
+        '1.0.10.0/24',
+        { id => 10, value => 'changed value 10' }
+    );
+    $tree->insert_network( '1.0.0.0/28', { id => 20, value => 'new value' } );
+
+    return $tree;
+}
+
+sub _write_file {
+    my $tree     = shift;
+    my $filename = shift;
+
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+}
+
+sub _read_file {
+    my $filename = shift;
+
+    open my $fh, '<:raw', $filename or die $!;
+    my $output = do { local $/; <$fh> };
+    close $fh or die $!;
+
+    return $output;
+}
+
+sub _write_tree {
+    my $tree = shift;
+
+    my $output;
+    open my $fh, '>:raw', \$output or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $output;
+}
+
+sub _data_section {
+    my $output = shift;
+
+    my $start = index $output, "\0" x 16;
+    my $end   = index $output, "\xab\xcd\xefMaxMind.com";
+
+    return substr( $output, $start + 16, $end - $start - 16 );
+}
@@ -0,0 +1,142 @@
+use strict;
+use warnings;
+
+use Test::More;
+
+use File::Temp qw( tempdir );
+use MaxMind::DB::Writer::Tree ();
+
+my %types = (
+    city   => 'map',
+    names  => 'map',
+    en     => 'utf8_string',
+    de     => 'utf8_string',
+    id     => 'uint32',
+    ranks  => [ 'array', 'uint16' ],
+    secret => 'utf8_string',
+);
+
+my @inserts = (
+    [ '1.0.0.0/16', { city => { names => { en => 'Berlin' } }, id => 1 } ],
+    [ '1.0.1.0/24', { city => { names => { de => 'Berlin' } }, id => 2 } ],
+    [ '1.0.2.0/24', { ranks => [ 1, 2, 3 ] } ],
+    [ '2.0.0.0/8',  { id => 3, secret => 'x' } ],
+    [ '2.1.0.0/16', { id => 3, secret => 'x' } ],
+);
+
+my %trees = map { $_ => _tree($_) } 0, 1;
+
+for my $address (qw( 1.0.0.1 1.0.1.1 1.0.2.1 1.0.3.1 2.1.1.1 3.0.0.0 )) {
+    is_deeply(
+        $trees{1}->lookup_ip_address($address),
+        $trees{0}->lookup_ip_address($address),
+        "packed tree returns the same data for $address"
+    );
+}
+
+is_deeply(
+    $trees{1}->lookup_ip_address('1.0.1.1'),
+    {
+        city => { names => { en => 'Berlin', de => 'Berlin' } },
+        id   => 2,
+    },
+    'packed data is merged'
+);
+
+is(
+    $trees{1}->node_count(),
+    $trees{0}->node_count(),
+    'packed tree has the same node count'
+);
+
+is_deeply(
+    _iterated_data( $trees{1} ),
+    _iterated_data( $trees{0} ),
+    'iterating a packed tree sees the same data'
+);
+
+my $unpacked_output = _output( $trees{0} );
+is(
+    _output( $trees{1} ),
+    $unpacked_output,
+    'packed tree writes the same database'
+);
+
+{
+    my $dir  = tempdir( CLEANUP => 1 );
+    my $file = "$dir/frozen";
+
+    my $tree = _tree(1);
+    $tree->freeze_tree($file);
+
+    my $thawed = MaxMind::DB::Writer::Tree->new_from_frozen_tree(
+        filename              => $file,
+        map_key_type_callback => $tree->map_key_type_callback(),
+    );
+
+    ok( $thawed->pack_data(), 'thawed tree still packs its data' );
+    is(
+        _output($thawed),
+        $unpacked_output,
+        'thawed packed tree writes the same database'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my $pack_data = shift;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        merge_strategy        => 'recurse',
+        pack_data             => $pack_data,
+        map_key_type_callback => sub { $types{ $_[0] } },
+    );
+
+    $tree->insert_network( @{$_} ) for @inserts;
+
+    return $tree;
+}
+
+sub _output {
+    my $tree = shift;
+
+    $tree->_set_build_epoch(1);
+
+    my $output;
+    open my $fh, '>:raw', \$output or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $output;
+}
+
+sub _iterated_data {
+    my $tree = shift;
+
+    my $collector = DataCollector->new();
+    $tree->iterate($collector);
+
+    return $collector->{data};
+}
+
+## no critic (Modules::ProhibitMultiplePackages)
+{
+    package DataCollector;
+
+    sub new {
+        return bless { data => [] }, shift;
+    }
+
+    sub process_data_record {
+        my $self = shift;
+        push @{ $self->{data} }, $_[-1];
+        return;
+    }
+}
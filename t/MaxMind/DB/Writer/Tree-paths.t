@@ -0,0 +1,157 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+# Networks inserted into empty parts of the tree are stored as paths rather
+# than as a node per bit. They should behave exactly like the nodes they
+# stand for.
+{
+    my $tree = _tree();
+
+    $tree->insert_network( '2a02:1234:5678::/48', { id => 1 } );
+    is( _node_count($tree), 48, 'a /48 in an empty tree is 48 nodes' );
+
+    $tree->insert_network( '2a02:1234:5678:9abc::/64', { id => 2 } );
+    is(
+        _node_count($tree), 64,
+        'a /64 inside the /48 adds the nodes below it'
+    );
+
+    # 2a02:1234:5600:: and 2a02:1234:5678:: have the first 41 bits in
+    # common.
+    $tree->insert_network( '2a02:1234:5600::/48', { id => 3 } );
+    is(
+        _node_count($tree), 64 + 48 - 42,
+        'a network leaving the path part way along it'
+    );
+
+    $tree->insert_network( '2a02:1234:5600::/44', { id => 4 } );
+
+    my %expect = (
+        '2a02:1234:5678::1'      => 1,
+        '2a02:1234:5678:9abc::1' => 2,
+        '2a02:1234:5678:9abd::1' => 1,
+        '2a02:1234:5600::1'      => 4,
+        '2a02:1234:5601::1'      => 4,
+        '2a02:1234:560f::1'      => 4,
+        '2a02:1234:5610::1'      => undef,
+        '2a02:1235::1'           => undef,
+        '2a03::1'                => undef,
+    );
+    for my $address ( sort keys %expect ) {
+        is_deeply(
+            $tree->lookup_ip_address($address),
+            defined $expect{$address} ? { id => $expect{$address} } : undef,
+            "lookup of $address"
+        );
+    }
+
+    my $filename = "$tempdir/paths.mmdb";
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    is(
+        exception {
+            MaxMind::DB::Writer::Tree->validate_database(
+                filename => $filename );
+        },
+        undef,
+        'written database is valid'
+    );
+    is_deeply(
+        [ $tree->check_lookups( filename => $filename ) ],
+        [],
+        'tree and written database agree'
+    );
+}
+
+{
+    my $tree = _tree();
+
+    $tree->insert_network( '2a02:1234:5678::/48',      { id => 1 } );
+    $tree->insert_network( '2a02:1234:5600::/48',      { id => 3 } );
+    $tree->insert_network( '2a02:1234:5678:9abc::/64', { id => 2 } );
+    $tree->remove_network('2a02:1234:5600::/48');
+    is(
+        _node_count($tree), 64,
+        'removing the network beside the path leaves the nodes for the rest'
+    );
+
+    $tree->remove_network('2a02:1234:5678:9abc::/64');
+    is_deeply(
+        $tree->lookup_ip_address('2a02:1234:5678:9abc::1'),
+        undef,
+        'removed network is gone'
+    );
+
+    $tree->remove_network('2a02:1234:5678::/64');
+    is_deeply(
+        $tree->lookup_ip_address('2a02:1234:5678::1'),
+        undef,
+        'removing part of a path network'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('2a02:1234:5678:1::1'),
+        { id => 1 },
+        'the rest of the network is still there'
+    );
+
+    $tree->remove_network('2a02:1234:5678::/48');
+    $tree->insert_network( '::1.2.3.0/120', { id => 5 } );
+    is(
+        _node_count($tree), 120,
+        'removing the rest of the network removes its path'
+    );
+}
+
+{
+    my $tree = _tree( merge_strategy => 'recurse' );
+
+    $tree->insert_network( '2a02:1234:5678::/48', { id => 1, a => 1 } );
+    $tree->insert_network( '2a02:1234::/32',      { id => 2, b => 2 } );
+
+    is_deeply(
+        $tree->lookup_ip_address('2a02:1234:5678::1'),
+        { id => 2, a => 1, b => 2 },
+        'merging into the data at the end of a path'
+    );
+    is_deeply(
+        $tree->lookup_ip_address('2a02:1234:5679::1'),
+        { id => 2, b => 2 },
+        'merging around a path'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    return MaxMind::DB::Writer::Tree->new(
+        ip_version               => 6,
+        record_size              => 24,
+        database_type            => 'Test',
+        languages                => ['en'],
+        description              => { en => 'Test tree' },
+        remove_reserved_networks => 0,
+        map_key_type_callback    => sub {'uint32'},
+        @_,
+    );
+}
+
+sub _node_count {
+    my $tree = shift;
+
+    open my $fh, '>:raw', \my $buffer or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $tree->node_count;
+}
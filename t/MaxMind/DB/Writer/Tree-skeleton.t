@@ -0,0 +1,92 @@
+use strict;
+use warnings;
+
+use Test::More;
+
+use MaxMind::DB::Writer::Tree ();
+
+# The fixed networks of a new tree are copied from a skeleton shared by all
+# trees with the same settings. These tests make sure that each tree gets its
+# own copy and that the copies behave like a tree built from scratch.
+
+for my $ip_version ( 4, 6 ) {
+    for my $alias ( 0, 1 ) {
+        for my $remove_reserved ( 0, 1 ) {
+            my $desc
+                = "IPv$ip_version - alias_ipv6_to_ipv4 = $alias - remove_reserved_networks = $remove_reserved";
+
+            my @trees = map {
+                _tree( $ip_version, $alias, $remove_reserved )
+            } 1 .. 3;
+
+            $trees[$_]->insert_network( '1.0.0.0/8', { tree => $_ } )
+                for 0 .. $#trees;
+
+            # Destroying one of the trees must not affect the others.
+            shift @trees;
+
+            for my $i ( 0 .. $#trees ) {
+                is_deeply(
+                    $trees[$i]->lookup_ip_address('1.2.3.4'),
+                    { tree => $i + 1 },
+                    "tree $i has its own data - $desc"
+                );
+
+                is(
+                    $trees[$i]->lookup_ip_address('10.0.0.1'),
+                    undef,
+                    "no data for 10.0.0.1 - $desc"
+                );
+
+                next unless $ip_version == 6;
+
+                is_deeply(
+                    $trees[$i]->lookup_ip_address('::ffff:1.2.3.4'),
+                    ( $alias ? { tree => $i + 1 } : undef ),
+                    "lookup in the IPv4-mapped range - $desc"
+                );
+            }
+
+            $_->insert_network( '10.0.0.0/8', { reserved => 1 } ) for @trees;
+
+            is_deeply(
+                $trees[0]->lookup_ip_address('10.0.0.1'),
+                ( $remove_reserved ? undef : { reserved => 1 } ),
+                "insert into 10.0.0.0/8 - $desc"
+            );
+
+            is(
+                _tree( $ip_version, $alias, $remove_reserved )
+                    ->lookup_ip_address('10.0.0.1'),
+                undef,
+                "a new tree does not see data inserted in another tree - $desc"
+            );
+
+            my $node_count = $trees[0]->node_count();
+            is(
+                $trees[1]->node_count(),
+                $node_count,
+                "trees with the same inserts have the same node count - $desc"
+            );
+        }
+    }
+}
+
+done_testing();
+
+sub _tree {
+    my $ip_version      = shift;
+    my $alias           = shift;
+    my $remove_reserved = shift;
+
+    return MaxMind::DB::Writer::Tree->new(
+        ip_version               => $ip_version,
+        record_size              => 24,
+        database_type            => 'Test',
+        languages                => ['en'],
+        description              => { en => 'Test tree' },
+        alias_ipv6_to_ipv4       => $alias,
+        remove_reserved_networks => $remove_reserved,
+        map_key_type_callback    => sub { 'uint32' },
+    );
+}
@@ -0,0 +1,216 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+use File::Temp qw( tempdir );
+
+my $tempdir = tempdir( CLEANUP => 1 );
+
+for my $ip_version ( 4, 6 ) {
+    for my $record_size ( 24, 28, 32 ) {
+        for my $alias ( $ip_version == 6 ? ( 0, 1 ) : 0 ) {
+            my ($filename) = _write_tree(
+                ip_version         => $ip_version,
+                record_size        => $record_size,
+                alias_ipv6_to_ipv4 => $alias,
+            );
+
+            for my $threads ( 1, 4 ) {
+                is(
+                    exception {
+                        MaxMind::DB::Writer::Tree->validate_database(
+                            filename => $filename,
+                            threads  => $threads,
+                        );
+                    },
+                    undef,
+                    "IPv$ip_version, $record_size bit records, alias = $alias,"
+                        . " $threads threads - database is valid"
+                );
+            }
+        }
+    }
+}
+
+{
+    my ( $filename, $node_count ) = _write_tree(
+        ip_version  => 4,
+        record_size => 24,
+    );
+    my $database = _slurp($filename);
+
+    # The left record of the first node, pointing far past the data.
+    my $corrupt = $database;
+    substr( $corrupt, 0, 3 ) = "\xff\xff\xff";
+    like(
+        _validation_error($corrupt),
+        qr/outside the data section/,
+        'a record pointing past the data section is invalid'
+    );
+
+    # The left record of the last node, pointing back to the root.
+    $corrupt = $database;
+    substr( $corrupt, ( $node_count - 1 ) * 6, 3 ) = "\0\0\0";
+    like(
+        _validation_error($corrupt),
+        qr/reached more than once/,
+        'a record pointing back up the tree is invalid'
+    );
+
+    # An extended type of 17 at the start of the data section.
+    $corrupt = $database;
+    substr( $corrupt, $node_count * 6 + 16, 2 ) = "\x00\x0a";
+    like(
+        _validation_error($corrupt),
+        qr/no valid control byte at data section offset 0/,
+        'data with an invalid type is invalid'
+    );
+
+    $corrupt = $database;
+    substr( $corrupt, $node_count * 6, 1 ) = "\x01";
+    like(
+        _validation_error($corrupt),
+        qr/separator is not all zero bytes/,
+        'a bad data section separator is invalid'
+    );
+
+    like(
+        _validation_error( substr( $database, 0, $node_count * 6 ) ),
+        qr/Could not find the metadata marker/,
+        'a truncated database is invalid'
+    );
+}
+
+{
+    my ( $filename, $node_count ) = _write_tree(
+        ip_version         => 6,
+        record_size        => 24,
+        alias_ipv6_to_ipv4 => 1,
+    );
+    my $database = _slurp($filename);
+
+    my $ipv4_root
+        = _record( $database, _record_position( $database, '0' x 96 ) );
+    my @ipv4_mapped = _record_position( $database, '0' x 80 . '1' x 16 );
+    is(
+        _record( $database, @ipv4_mapped ),
+        $ipv4_root,
+        'the IPv4-mapped network points to the IPv4 root'
+    );
+
+    # 0.0.0.0/2, which is a node as it contains 1.0.0.0/8.
+    my $corrupt = $database;
+    _set_record(
+        \$corrupt, _record_position( $database, '0' x 98 ),
+        $ipv4_root
+    );
+    like(
+        _validation_error($corrupt),
+        qr/points to the IPv4 root node $ipv4_root but is not an IPv4 alias/,
+        'a record in the IPv4 subtree pointing back to its root is invalid'
+    );
+
+    # Without the IPv4-mapped alias the database is not aliased, so 6to4 may
+    # not point to the IPv4 root either.
+    $corrupt = $database;
+    _set_record( \$corrupt, @ipv4_mapped, $node_count );
+    like(
+        _validation_error($corrupt),
+        qr/is not an IPv4 alias, which is a cycle/,
+        'an alias network in a database that is not aliased is invalid'
+    );
+}
+
+done_testing();
+
+# The node and side of the record at the end of the path given as a string of
+# bits, for a database with 24 bit records.
+sub _record_position {
+    my $database = shift;
+    my $bits     = shift;
+
+    my $node = 0;
+    $node = _record( $database, $node, $_ )
+        for split //, substr( $bits, 0, -1 );
+
+    return ( $node, substr( $bits, -1 ) );
+}
+
+sub _record {
+    my $database = shift;
+    my $node     = shift;
+    my $right    = shift;
+
+    return unpack 'N', "\0" . substr( $database, $node * 6 + $right * 3, 3 );
+}
+
+sub _set_record {
+    my $database = shift;
+    my $node     = shift;
+    my $right    = shift;
+    my $value    = shift;
+
+    substr( ${$database}, $node * 6 + $right * 3, 3 )
+        = substr( pack( 'N', $value ), 1 );
+}
+
+sub _write_tree {
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        map_key_type_callback => sub { $_[0] eq 'id' ? 'uint32' : 'map' },
+        @_,
+    );
+
+    for my $i ( 0 .. 255 ) {
+        $tree->insert_network(
+            "1.$i.0.0/16",
+            { id => $i % 17, more => { id => $i } },
+        );
+        $tree->insert_network( "2003:$i\::/32", { id => $i } )
+            if $tree->ip_version == 6;
+    }
+
+    my $filename = _temp_filename();
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return ( $filename, $tree->node_count );
+}
+
+sub _validation_error {
+    my $database = shift;
+
+    my $filename = _temp_filename();
+    open my $fh, '>:raw', $filename or die $!;
+    print {$fh} $database or die $!;
+    close $fh or die $!;
+
+    return exception {
+        MaxMind::DB::Writer::Tree->validate_database( filename => $filename );
+    };
+}
+
+sub _slurp {
+    my $filename = shift;
+
+    open my $fh, '<:raw', $filename or die $!;
+    my $content = do { local $/; <$fh> };
+    close $fh or die $!;
+
+    return $content;
+}
+
+{
+    my $count = 0;
+
+    sub _temp_filename {
+        return "$tempdir/validate-" . $count++ . '.mmdb';
+    }
+}
@@ -0,0 +1,121 @@
+use strict;
+use warnings;
+
+use Test::Fatal;
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+my %types = (
+    city       => 'map',
+    names      => 'map',
+    en         => 'utf8_string',
+    de         => 'utf8_string',
+    geoname_id => 'uint32',
+    ranks      => [ 'array', 'uint16' ],
+    valid      => 'boolean',
+    score      => 'double',
+);
+
+my @inserts = map {
+    [
+        "1.0.$_.0/24",
+        {
+            city => {
+                geoname_id => 1000 + $_ % 7,
+                names      => { en => 'Berlin', de => "Berlin $_" },
+            },
+            ranks => [ 1 .. $_ % 5 ],
+            valid => $_ % 2,
+            score => $_ / 3,
+        }
+    ]
+} 0 .. 255;
+
+for my $options (
+    {},
+    { optimize_pointer_sizes  => 1 },
+    { order_data_by_frequency => 1 },
+    { eager_serialize         => 1 },
+    { pack_data               => 1 },
+    ) {
+    my $desc = join ', ', %{$options};
+    $desc ||= 'default options';
+
+    is(
+        exception {
+            _write_tree(
+                verify_data_sample_rate => 1,
+                map_key_type_callback   => sub { $types{ $_[0] } },
+                %{$options},
+            );
+        },
+        undef,
+        "all data verifies - $desc"
+    );
+}
+
+is(
+    exception {
+        _write_tree(
+            verify_data_sample_rate => 0.1,
+            map_key_type_callback   => sub { $types{ $_[0] } },
+        );
+    },
+    undef,
+    'sampled data verifies'
+);
+
+{
+    # A callback that changes its mind about a type means that the data
+    # written is not the data in the tree.
+    my $calls = 0;
+    like(
+        exception {
+            _write_tree(
+                verify_data_sample_rate => 1,
+                map_key_type_callback   => sub {
+                    return $calls++ < 100 ? 'uint32' : 'uint16'
+                        if $_[0] eq 'geoname_id';
+                    return $types{ $_[0] };
+                },
+            );
+        },
+        qr/Data verification failed/,
+        'data that does not match the tree fails verification'
+    );
+}
+
+like(
+    exception { _tree( verify_data_sample_rate => 2 ) },
+    qr/sample rate must be a number from 0 to 1/,
+    'sample rate must be between 0 and 1'
+);
+
+done_testing();
+
+sub _tree {
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version    => 6,
+        record_size   => 24,
+        database_type => 'Test',
+        languages     => ['en'],
+        description   => { en => 'Test tree' },
+        @_,
+    );
+
+    $tree->insert_network( @{$_} ) for @inserts;
+
+    return $tree;
+}
+
+sub _write_tree {
+    my $tree = _tree(@_);
+
+    my $output;
+    open my $fh, '>:raw', \$output or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return $output;
+}
@@ -0,0 +1,192 @@
+use strict;
+use warnings;
+
+use lib 't/lib';
+
+use Test::Fatal;
+use Test::MaxMind::DB::Writer qw( database_without_metadata );
+use Test::More;
+
+use MaxMind::DB::Writer::Tree;
+
+my %types = (
+    id      => 'uint32',
+    city    => 'utf8_string',
+    country => 'utf8_string',
+);
+
+my @networks = map {
+    [
+        "1.1.$_.0/24",
+        {
+            id      => $_,
+            city    => "city $_",
+            country => $_ < 8 ? 'DE' : 'FR',
+        },
+    ]
+} 0 .. 15;
+push @networks, [ '2a02::/16', { id => 16, city => 'city 16' } ];
+
+for my $args ( [], [ pack_data => 1 ], [ mark_and_sweep_data => 1 ] ) {
+    my $desc = @{$args} ? $args->[0] : 'default';
+
+    my $tree = _tree( @{$args} );
+
+    open my $full_fh, '>:raw', \my $full or die $!;
+    open my $wide_fh, '>:raw', \my $wide or die $!;
+    open my $lite_fh, '>:raw', \my $lite or die $!;
+    open my $ids_fh,  '>:raw', \my $ids  or die $!;
+    $tree->write_trees(
+        [
+            { output => $full_fh, database_type => 'Test' },
+            { output => $wide_fh, record_size   => 32 },
+            {
+                output        => $lite_fh,
+                project       => ['country'],
+                record_size   => 28,
+                database_type => 'Test-Lite',
+            },
+            {
+                output  => $ids_fh,
+                project => sub {
+                    $_[0]{id} % 2 ? undef : { id => $_[0]{id} };
+                },
+            },
+        ]
+    );
+    close $_ or die $! for $full_fh, $wide_fh, $lite_fh, $ids_fh;
+
+    is(
+        database_without_metadata($full),
+        database_without_metadata( _tree( @{$args} ) ),
+        "$desc - an edition with the tree's data and settings is the tree"
+    );
+    is(
+        database_without_metadata($wide),
+        database_without_metadata( _tree( @{$args}, record_size => 32 ) ),
+        "$desc - an edition without a projection has the tree's data"
+    );
+
+    my $expect_lite = _tree(
+        @{$args},
+        networks      => [],
+        record_size   => 28,
+        database_type => 'Test-Lite',
+    );
+    $expect_lite->insert_network( @{$_} )
+        for [ '1.1.0.0/21', { country => 'DE' } ],
+        [ '1.1.8.0/21', { country => 'FR' } ];
+    is(
+        database_without_metadata($lite),
+        database_without_metadata($expect_lite),
+        "$desc - an edition with the country keys has one network for each"
+            . ' country'
+    );
+    like(
+        $lite, qr/Test-Lite/,
+        "$desc - the edition has its own database_type"
+    );
+
+    my $expect_ids = _tree( @{$args}, networks => [] );
+    $expect_ids->insert_network( $_->[0], { id => $_->[1]{id} } )
+        for grep { !( $_->[1]{id} % 2 ) } @networks;
+    is(
+        database_without_metadata($ids),
+        database_without_metadata($expect_ids),
+        "$desc - networks with no data for an edition are left out of it"
+    );
+}
+
+{
+    my $calls = 0;
+    my $tree  = _tree();
+    $tree->insert_network( '1.2.0.0/16', $networks[0][1] );
+
+    open my $fh, '>:raw', \my $output or die $!;
+    $tree->write_trees(
+        [
+            {
+                output  => $fh,
+                project => sub { $calls++; { id => $_[0]{id} } },
+            },
+        ]
+    );
+
+    is( $calls, 17, 'the projection is called once for each distinct value' );
+}
+
+{
+    like(
+        exception {
+            _tree()->write_trees( [ { project => ['country'] } ] );
+        },
+        qr/Each edition must have an output/,
+        'error for an edition without an output'
+    );
+
+    open my $fh, '>:raw', \my $output or die $!;
+    like(
+        exception {
+            _tree()->write_trees(
+                [
+                    {
+                        output             => $fh,
+                        ip_version         => 4,
+                        alias_ipv6_to_ipv4 => 0,
+                    },
+                ]
+            );
+        },
+        qr/Edition 0 is for IPv4 but the tree is for IPv6/,
+        'error for an edition with a different IP version'
+    );
+
+    like(
+        exception {
+            _tree()->write_trees(
+                [
+                    { output => $fh },
+                    { output => $fh, alias_ipv6_to_ipv4 => 0 },
+                ]
+            );
+        },
+        qr/Edition 1 does not have the same fixed networks as the tree/,
+        'error for an edition with different fixed networks'
+    );
+
+    like(
+        exception {
+            _tree()->write_trees(
+                [
+                    { output => $fh, project => ['country'] },
+                    { output => $fh, project => sub { die 'oops' } },
+                ]
+            );
+        },
+        qr/oops/,
+        'an exception from a projection is passed on'
+    );
+}
+
+done_testing();
+
+sub _tree {
+    my %args = @_;
+
+    my $networks = delete $args{networks} // \@networks;
+
+    my $tree = MaxMind::DB::Writer::Tree->new(
+        ip_version            => 6,
+        record_size           => 24,
+        database_type         => 'Test',
+        languages             => ['en'],
+        description           => { en => 'Test tree' },
+        alias_ipv6_to_ipv4    => 1,
+        map_key_type_callback => sub { $types{ $_[0] } },
+        %args,
+    );
+
+    $tree->insert_network( @{$_} ) for @{$networks};
+
+    return $tree;
+}
@@ -16,6 +16,8 @@ use Test::HexDifferences qw( eq_or_dump_diff );
 
 use Exporter qw( import );
 our @EXPORT_OK = qw(
+    compare_trees
+    database_without_metadata
     insert_for_type
     make_tree_from_pairs
     ranges_to_data
@@ -23,8 +25,77 @@ our @EXPORT_OK = qw(
     test_freeze_thaw
     test_freeze_thaw_optional_params
     test_tree
+    write_database_file
+    write_lines_file
 );
 
+# Returns the database written for a tree, or the database in a string, up to
+# its metadata. The build epoch in the metadata is different for each tree, so
+# this is what tests compare to check that two trees write the same database.
+sub database_without_metadata {
+    my $database = shift;
+
+    if ( blessed $database ) {
+        open my $fh, '>:raw', \my $buffer or die $!;
+        $database->write_tree($fh);
+        close $fh or die $!;
+        $database = $buffer;
+    }
+
+    return substr(
+        $database, 0,
+        index( $database, "\xab\xcd\xefMaxMind.com" )
+    );
+}
+
+# Checks that two trees have the same data for each address, skipping IPv6
+# addresses for an IPv4 tree, and that they write the same database.
+sub compare_trees {
+    my $tree      = shift;
+    my $expect    = shift;
+    my $desc      = shift;
+    my $addresses = shift;
+
+    for my $address ( @{$addresses} ) {
+        next if $tree->ip_version() == 4 && $address =~ /:/;
+        is_deeply(
+            $tree->lookup_ip_address($address),
+            $expect->lookup_ip_address($address),
+            "$desc - same data for $address"
+        );
+    }
+
+    is(
+        database_without_metadata($tree),
+        database_without_metadata($expect),
+        "$desc - same database as the expected tree"
+    );
+}
+
+sub write_database_file {
+    my $tree     = shift;
+    my $filename = shift;
+
+    open my $fh, '>:raw', $filename or die $!;
+    $tree->write_tree($fh);
+    close $fh or die $!;
+
+    return;
+}
+
+# Writes each line to the file in UTF-8, followed by a newline, and returns
+# the filename.
+sub write_lines_file {
+    my $filename = shift;
+    my @lines    = @_;
+
+    open my $fh, '>:encoding(UTF-8)', $filename or die $!;
+    print {$fh} "$_\n" for @lines;
+    close $fh or die $!;
+
+    return $filename;
+}
+
 sub test_tree {
     my $insert_pairs   = shift;
     my $expect_pairs   = shift;